@@ -0,0 +1,90 @@
+#include <os/memory.h>
+#include <os/services.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <x86gprintrin.h>
+
+/*
+ BSS-heavy test program for the shared zero page.
+
+ Reads every page of a large BSS array, then writes to every WRITE_STRIDE-th
+ page. Reads of untouched BSS pages are backed by the init server's shared
+ zero frame, so only the written pages should need a frame of their own.
+
+ The init server's memory statistics are sampled before and after each pass.
+ Frames of our own are resident pages that aren't mapped to the zero frame.
+ */
+
+#define BSS_SIZE        (8 * 1024 * 1024)
+#define BSS_PAGES       (BSS_SIZE / PAGE_SIZE)
+#define WRITE_STRIDE    8
+
+static unsigned char bssArray[BSS_SIZE];
+
+static int sample(struct MemoryStats *stats)
+{
+  if(getMemoryStats(NULL_TID, stats) != 0)
+  {
+    fprintf(stderr, "bssbench: Unable to retrieve memory statistics.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void printSample(const char *label, const struct MemoryStats *stats)
+{
+  fprintf(stderr, "  %-24s%u resident, %u zero, %u private\n", label, (unsigned)stats->residentPages,
+          (unsigned)stats->zeroPages, (unsigned)(stats->residentPages - stats->zeroPages));
+}
+
+int main(void)
+{
+  volatile unsigned char *bss = bssArray;
+  unsigned int sum = 0;
+  size_t pagesWritten = 0;
+  struct MemoryStats before, afterRead, afterWrite;
+
+  if(sample(&before) != 0)
+    return EXIT_FAILURE;
+
+  unsigned long long start = _rdtsc();
+
+  for(size_t i=0; i < BSS_PAGES; i++)
+    sum += bss[i * PAGE_SIZE];
+
+  unsigned long long readCycles = _rdtsc() - start;
+
+  if(sample(&afterRead) != 0)
+    return EXIT_FAILURE;
+
+  start = _rdtsc();
+
+  for(size_t i=0; i < BSS_PAGES; i += WRITE_STRIDE, pagesWritten++)
+    bss[i * PAGE_SIZE] = 1;
+
+  unsigned long long writeCycles = _rdtsc() - start;
+
+  if(sample(&afterWrite) != 0)
+    return EXIT_FAILURE;
+
+  if(sum != 0)
+  {
+    fprintf(stderr, "bssbench: BSS wasn't zeroed.\n");
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "bssbench: %d BSS pages\n", BSS_PAGES);
+  fprintf(stderr, "  read every page:        %llu cycles/page\n", readCycles / BSS_PAGES);
+  fprintf(stderr, "  write every %d pages:    %llu cycles/page\n", WRITE_STRIDE,
+          writeCycles / pagesWritten);
+  printSample("before:", &before);
+  printSample("after reading:", &afterRead);
+  printSample("after writing:", &afterWrite);
+  fprintf(stderr, "  pages written:          %u, new private frames: %u\n", (unsigned)pagesWritten,
+          (unsigned)((afterWrite.residentPages - afterWrite.zeroPages)
+                     - (before.residentPages - before.zeroPages)));
+  fprintf(stderr, "  zero frame mappings:    %u system-wide\n", (unsigned)afterWrite.zeroFrameMappings);
+
+  return EXIT_SUCCESS;
+}
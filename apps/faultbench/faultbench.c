@@ -0,0 +1,85 @@
+#include <os/memory.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <x86gprintrin.h>
+
+/*
+ Page fault benchmark.
+
+ Allocates a 16 MiB buffer, which the init server maps lazily, and touches
+ every page of it once, first sequentially and then (with a fresh buffer) in
+ a scattered order. Each touch is timed separately. A touch that takes longer
+ than FAULT_THRESHOLD cycles is counted as a page fault, since user mode has
+ no other way to observe them.
+
+ With fault-around, sequential touches should produce far fewer faults per
+ MiB than scattered ones.
+ */
+
+#define BUFFER_SIZE       (16 * 1024 * 1024)
+#define BUFFER_PAGES      (BUFFER_SIZE / PAGE_SIZE)
+#define FAULT_THRESHOLD   2000ull
+
+// Prime stride so that consecutive touches are rarely neighbors
+
+#define SCATTER_STRIDE    97
+
+struct FaultResult
+{
+  unsigned long long totalCycles;
+  unsigned long faults;
+};
+
+static int touchBuffer(size_t stride, struct FaultResult *result)
+{
+  volatile unsigned char *buffer = malloc(BUFFER_SIZE);
+
+  if(!buffer)
+  {
+    fprintf(stderr, "Unable to allocate %d bytes.\n", BUFFER_SIZE);
+    return -1;
+  }
+
+  result->totalCycles = 0;
+  result->faults = 0;
+
+  for(size_t i=0, page=0; i < BUFFER_PAGES; i++, page = (page + stride) % BUFFER_PAGES)
+  {
+    unsigned long long start = _rdtsc();
+
+    buffer[page * PAGE_SIZE] = 1;
+
+    unsigned long long cycles = _rdtsc() - start;
+
+    result->totalCycles += cycles;
+
+    if(cycles > FAULT_THRESHOLD)
+      result->faults++;
+  }
+
+  // The buffer is intentionally leaked so that the next run gets fresh pages
+
+  return 0;
+}
+
+static void printResult(const char *name, const struct FaultResult *result)
+{
+  fprintf(stderr, "  %-10s %llu cycles, %lu faults, %lu faults/MiB\n", name,
+          result->totalCycles, result->faults,
+          result->faults / (BUFFER_SIZE / (1024 * 1024)));
+}
+
+int main(void)
+{
+  struct FaultResult sequential;
+  struct FaultResult scattered;
+
+  if(touchBuffer(1, &sequential) != 0 || touchBuffer(SCATTER_STRIDE, &scattered) != 0)
+    return EXIT_FAILURE;
+
+  fprintf(stderr, "faultbench: %d pages touched per run\n", BUFFER_PAGES);
+  printResult("sequential", &sequential);
+  printResult("scattered", &scattered);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+#include <os/services.h>
+#include <os/syscalls.h>
+#include <os/memory.h>
+#include <oslib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <x86gprintrin.h>
+
+/*
+ Ping-pong IPC benchmark between two address spaces.
+
+ Start two instances. The first one registers itself as the server. It
+ touches a working set of pages and then replies to every message it gets.
+ The second one becomes the client. It times round trips with and without
+ touching its own working set between messages.
+
+ When an address space switch flushes the TLB, every touched page has to be
+ refilled. The difference between the two runs approximates the cost of the
+ TLB misses caused by each switch. Kernel mappings are global, so they
+ shouldn't contribute to it.
+ */
+
+#define IPCBENCH_NAME       "ipcbench"
+#define ROUND_TRIPS         10000
+#define WORKING_SET_PAGES   32
+
+#define PING                1
+
+static unsigned char workingSet[WORKING_SET_PAGES * PAGE_SIZE];
+
+static void touchWorkingSet(void)
+{
+  for(size_t i=0; i < WORKING_SET_PAGES; i++)
+    ((volatile unsigned char *)workingSet)[i * PAGE_SIZE]++;
+}
+
+static int runServer(void)
+{
+  tid_t sender;
+
+  if(registerName(IPCBENCH_NAME) != 0)
+  {
+    fprintf(stderr, "Unable to register name: %s\n", IPCBENCH_NAME);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "ipcbench server registered.\n");
+
+  while(1)
+  {
+    if(sys_wait(0, &sender) < 0)
+      continue;
+
+    touchWorkingSet();
+    sys_send(sender, PING, 0);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static unsigned long long timeRoundTrips(tid_t serverTid, int touchPages)
+{
+  unsigned long long start = _rdtsc();
+
+  for(int i=0; i < ROUND_TRIPS; i++)
+  {
+    if(sys_send_and_recv(serverTid, serverTid, PING, 0, 0) < 0)
+    {
+      fprintf(stderr, "IPC failed after %d round trips.\n", i);
+      return 0;
+    }
+
+    if(touchPages)
+      touchWorkingSet();
+  }
+
+  return (_rdtsc() - start) / ROUND_TRIPS;
+}
+
+static int runClient(tid_t serverTid)
+{
+  // Warm up both address spaces before measuring
+
+  touchWorkingSet();
+  timeRoundTrips(serverTid, 1);
+
+  unsigned long long baseCycles = timeRoundTrips(serverTid, 0);
+  unsigned long long touchCycles = timeRoundTrips(serverTid, 1);
+
+  if(!baseCycles || !touchCycles)
+    return EXIT_FAILURE;
+
+  fprintf(stderr, "ipcbench: %d round trips\n", ROUND_TRIPS);
+  fprintf(stderr, "  IPC only:               %llu cycles/round trip\n",
+          baseCycles);
+  fprintf(stderr, "  IPC + %d page touches: %llu cycles/round trip\n",
+          WORKING_SET_PAGES, touchCycles);
+  fprintf(stderr, "  Estimated TLB refill:   %llu cycles/page\n",
+          touchCycles > baseCycles ?
+            (touchCycles - baseCycles) / WORKING_SET_PAGES : 0);
+
+  return EXIT_SUCCESS;
+}
+
+int main(void)
+{
+  tid_t serverTid = lookupName(IPCBENCH_NAME);
+
+  if(serverTid == NULL_TID)
+    return runServer();
+  else
+    return runClient(serverTid);
+}
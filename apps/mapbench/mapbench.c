@@ -0,0 +1,81 @@
+#include <os/services.h>
+#include <os/memory.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <x86gprintrin.h>
+
+/*
+ Address space mapping benchmark.
+
+ Creates MAPPING_COUNT single page mappings, each separated by an unmapped
+ page so that the init server can't treat them as one region. Map requests
+ are timed in batches to show how their cost changes as the number of
+ mappings grows. Afterwards, one page in every mapping is touched, in batches,
+ to time the fault path (which has to look up the faulting mapping).
+
+ With an indexed mapping table, the per-request and per-fault costs of the
+ last batch should be about the same as those of the first.
+
+ Finally, with all of the mappings still in place, anonymous buffers are
+ mapped at any free address and unmapped again to time address placement.
+ */
+
+#define MAPPING_COUNT     10000
+#define CHURN_COUNT       1000
+#define CHURN_PAGES       4
+#define BATCH_SIZE        1000
+#define BASE_ADDR         0x40000000u
+#define ZERO_DEV          0x00000001u
+
+#define MAPPING_ADDR(i)   (BASE_ADDR + 2 * (i) * PAGE_SIZE)
+
+int main(void)
+{
+  fprintf(stderr, "mapbench: %d mappings, %d per batch\n", MAPPING_COUNT, BATCH_SIZE);
+  fprintf(stderr, "  %-10s %-16s %s\n", "mappings", "cycles/map", "cycles/fault");
+
+  for(int batch=0; batch < MAPPING_COUNT / BATCH_SIZE; batch++)
+  {
+    int first = batch * BATCH_SIZE;
+    unsigned long long start = _rdtsc();
+
+    for(int i=first; i < first + BATCH_SIZE; i++)
+    {
+      if(!mapMem((addr_t)MAPPING_ADDR(i), ZERO_DEV, PAGE_SIZE, 0, 0))
+      {
+        fprintf(stderr, "Unable to map page at 0x%x.\n", MAPPING_ADDR(i));
+        return EXIT_FAILURE;
+      }
+    }
+
+    unsigned long long mapCycles = _rdtsc() - start;
+
+    start = _rdtsc();
+
+    for(int i=first; i < first + BATCH_SIZE; i++)
+      *(volatile unsigned char *)MAPPING_ADDR(i) = 1;
+
+    unsigned long long faultCycles = _rdtsc() - start;
+
+    fprintf(stderr, "  %-10d %-16llu %llu\n", first + BATCH_SIZE,
+            mapCycles / BATCH_SIZE, faultCycles / BATCH_SIZE);
+  }
+
+  unsigned long long start = _rdtsc();
+
+  for(int i=0; i < CHURN_COUNT; i++)
+  {
+    addr_t addr = mapMem(0, ZERO_DEV, CHURN_PAGES * PAGE_SIZE, 0, 0);
+
+    if(!addr || unmapMem(addr, CHURN_PAGES * PAGE_SIZE) != 0)
+    {
+      fprintf(stderr, "Unable to map/unmap an anonymous buffer.\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  fprintf(stderr, "  anonymous map + unmap: %llu cycles\n",
+          (_rdtsc() - start) / CHURN_COUNT);
+
+  return EXIT_SUCCESS;
+}
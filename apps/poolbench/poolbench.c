@@ -0,0 +1,119 @@
+#include <os/list.h>
+#include <os/rpc/serialization.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <x86gprintrin.h>
+
+/*
+ Node allocation benchmark for the libos object pool.
+
+ Builds and tears down a list of LIST_NODES elements and an RPC array of
+ RPC_NODES int32 elements, ROUNDS times each. List nodes and standalone RPC
+ nodes come from pools, so after the first round every node should be
+ reused from a pool's free list rather than allocated from the heap.
+
+ For comparison, the same number of objects of the same sizes are
+ allocated and freed with malloc() and free().
+ */
+
+#define ROUNDS        100
+#define LIST_NODES    1000
+#define RPC_NODES     1000
+
+static void *objects[LIST_NODES > RPC_NODES ? LIST_NODES : RPC_NODES];
+
+static unsigned long long timeMalloc(size_t size, size_t count)
+{
+  unsigned long long start = _rdtsc();
+
+  for(int round=0; round < ROUNDS; round++)
+  {
+    for(size_t i=0; i < count; i++)
+      objects[i] = malloc(size);
+
+    for(size_t i=0; i < count; i++)
+      free(objects[i]);
+  }
+
+  return _rdtsc() - start;
+}
+
+static int timeList(unsigned long long *cycles)
+{
+  list_t list;
+  void *elem;
+  unsigned long long start = _rdtsc();
+
+  for(int round=0; round < ROUNDS; round++)
+  {
+    listInit(&list);
+
+    for(int i=0; i < LIST_NODES; i++)
+    {
+      if(listInsertTail(&list, i, NULL) != 0)
+        return -1;
+    }
+
+    for(int i=0; i < LIST_NODES; i++)
+    {
+      if(listRemoveHead(&list, &elem) != 0)
+        return -1;
+    }
+  }
+
+  *cycles = _rdtsc() - start;
+  return 0;
+}
+
+static int timeRpc(unsigned long long *cycles)
+{
+  unsigned long long start = _rdtsc();
+
+  for(int round=0; round < ROUNDS; round++)
+  {
+    struct RPC_Node *array = rpc_new_node();
+
+    if(!array || !rpc_array(array))
+      return -1;
+
+    for(int i=0; i < RPC_NODES; i++)
+    {
+      struct RPC_Node *node = rpc_new_node();
+
+      if(!node || !rpc_int32(i, node) || !rpc_append_child(node, array))
+        return -1;
+    }
+
+    rpc_delete_node(array);
+  }
+
+  *cycles = _rdtsc() - start;
+  return 0;
+}
+
+int main(void)
+{
+  unsigned long long listCycles, rpcCycles;
+  unsigned long long listMallocCycles = timeMalloc(sizeof(list_node_t), LIST_NODES);
+  unsigned long long rpcMallocCycles = timeMalloc(sizeof(struct RPC_Node), RPC_NODES);
+
+  if(timeList(&listCycles) != 0)
+  {
+    fprintf(stderr, "poolbench: Unable to build the list.\n");
+    return EXIT_FAILURE;
+  }
+
+  if(timeRpc(&rpcCycles) != 0)
+  {
+    fprintf(stderr, "poolbench: Unable to build the RPC array.\n");
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "poolbench: %d rounds\n", ROUNDS);
+  fprintf(stderr, "  list (%d nodes):        %llu cycles/node, malloc: %llu cycles/node\n", LIST_NODES,
+          listCycles / (ROUNDS * LIST_NODES), listMallocCycles / (ROUNDS * LIST_NODES));
+  fprintf(stderr, "  RPC array (%d nodes):   %llu cycles/node, malloc: %llu cycles/node\n", RPC_NODES,
+          rpcCycles / (ROUNDS * RPC_NODES), rpcMallocCycles / (ROUNDS * RPC_NODES));
+
+  return EXIT_SUCCESS;
+}
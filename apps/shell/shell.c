@@ -307,6 +307,7 @@ int doCommand( char *command, size_t comm_len, char *arg_str )
     printf("exec <path> - Explicitly execute a file\n");
     printf("echo <msg> - Prints a message\n");
     printf("time - Displays the current time\n");
+    printf("mem - Displays physical memory usage\n");
     printf("help OR ? - Prints this message\n");
   }
   else if( strncmp( command, "read", 4 ) == 0 )
@@ -403,6 +404,34 @@ int doCommand( char *command, size_t comm_len, char *arg_str )
         printf("%.*s%c\n", attrib_list[i].name_len, attrib_list[i].name, ((attrib_list[i].flags & FS_DIR) ? '/' : '\0'));
     }
   }
+  else if( strncmp( command, "mem", 3 ) == 0 )
+  {
+    static const char *blockNames[MEM_STATS_BLOCK_SIZES] = { "4 kB", "128 kB", "4 MB", "128 MB" };
+    struct MemoryStats stats;
+
+    if( getMemoryStats( NULL_TID, &stats ) != 0 )
+    {
+      printf("Unable to retrieve memory statistics\n");
+      return -1;
+    }
+
+    printf("Block      Total     Free     Used\n");
+
+    for(unsigned i=0; i < MEM_STATS_BLOCK_SIZES; i++)
+      printf("%-8s %7u %8u %8u\n", blockNames[i], stats.totalBlocks[i], stats.freeBlocks[i], stats.usedBlocks[i]);
+
+    printf("Free: %u kB, largest free run: %u kB\n", stats.freeFrames * 4, stats.largestFreeRun * 4);
+    printf("Zeroed: %u 4 kB + %u 4 MB frames, page cache: %u pages\n", stats.zeroedFrames,
+           stats.zeroedLargeFrames, stats.cachedPages);
+    printf("Swap: %u/%u pages, shared memory: %u pages in %u regions\n", stats.swapUsed, stats.swapTotal,
+           stats.shmFrames, stats.shmRegions);
+    printf("Resident: %u pages + %u large blocks in %u address spaces\n", stats.totalResidentPages,
+           stats.totalLargePages, stats.addressSpaces);
+    printf("Shell: %u resident pages, %u large blocks, %u swapped pages\n", stats.residentPages,
+           stats.largePages, stats.swappedPages);
+    printf("Zero frame: %u mappings (%u in the shell)\n", stats.zeroFrameMappings, stats.zeroPages);
+    printf("Init server heap: %u of %u kB in use\n", stats.heapBytesInUse / 1024, stats.heapBytes / 1024);
+  }
   else if( strncmp( command, "echo", 4 ) == 0 )
   {
     if( arg_str )
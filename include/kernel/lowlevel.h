@@ -127,6 +127,9 @@
 #define SYSENTER_CS_MSR     0x174u
 #define SYSENTER_ESP_MSR    0x175u
 #define SYSENTER_EIP_MSR    0x176u
+#define IA32_EFER_MSR       0xC0000080u
+
+#define EFER_NXE            (1u << 11)
 
 #define enableInt()     __asm__ __volatile__("sti" ::: "cc")
 #define disableInt()    __asm__ __volatile__("cli" ::: "cc")
@@ -36,11 +36,15 @@
 #define KMAP_AREA2			        (0xFFC00000u)
 #define IOAPIC_VADDR            KMAP_AREA2
 #define LAPIC_VADDR             (IOAPIC_VADDR + 0x100000u)
+#ifdef PAE
+#define TEMP_PAGE               (KMAP_AREA2 + 0x1FF000u)
+#else
 #define TEMP_PAGE               (KMAP_AREA2 + 0x3FF000u)
+#endif /* PAE */
 #define INVALID_VADDR       	    ((addr_t)0xFFFFFFFF)
 #define INVALID_ADDR        	    ((addr_t)0xFFFFFFFF)
 
-#define INIT_SERVER_STACK_TOP	    (ALIGN_DOWN((addr_t)KERNEL_VSTART, PAGE_TABLE_SIZE))
+#define INIT_SERVER_STACK_TOP	    (ALIGN_DOWN((addr_t)USER_VEND, PAGE_TABLE_SIZE))
 #define INIT_SERVER_STACK_SIZE      0x400000u
 /** Aligns an address to the previous boundary (if not already aligned) */
 #define ALIGN_DOWN(addr, boundary)       ((addr_t)((addr) & ~((boundary) - 1) ))
@@ -1,4 +1,3 @@
-#if 0
 #ifndef KERNEL_PAE_H
 #define KERNEL_PAE_H
 
@@ -19,95 +18,208 @@
  as desired.
  */
 
+/*
+ * PAE paging layout used by the kernel when built with -DPAE:
+ *
+ * The root page map of an address space is a page frame (below 4 GiB) whose first
+ * 32 bytes hold the four PDPTEs. Each PDPTE points to a page directory of 512
+ * 64-bit entries. PDPTE 3 (0xC0000000-0xFFFFFFFF) points to the kernel's page
+ * directory and is shared by every address space, so user memory ends at 0xC0000000.
+ *
+ * PDE_INDEX() yields an index over all 2048 PDEs of the four page directories so
+ * that readPDE()/writePDE() callers don't need to be aware of the extra level.
+ */
+
 #include <stdint.h>
+#include <types.h>
+
+#define MAX_PHYS_MEMORY           0x10000000000ull
+
+#define PAGE_SIZE		            	0x1000u
+#define LARGE_PAGE_SIZE   	    	0x200000u
+#define PAE_LARGE_PAGE_SIZE	    	0x200000u
+#define PAGE_TABLE_SIZE	  	    	0x200000u
+#define PAGE_DIR_SIZE             0x40000000u
+
+#define PDPTE_ENTRY_COUNT         4u
+#define PDE_PER_PAGE_DIR          512u
+
+#define USER_VEND                 0xC0000000u
+
+#define PDPTE_INDEX(a)            (((a) >> 30) & 0x03u)
+#define PDE_INDEX(a)		    			(((a) >> 21) & 0x7FFu)
+#define PTE_INDEX(a)		    			(((a) >> 12) & 0x1FFu)
+#define PAGE_OFFSET(a)		    		((a) & (PAGE_SIZE-1))
+#define LARGE_PAGE_OFFSET(a)      ((a) & (LARGE_PAGE_SIZE-1))
+
+#define NDX_TO_VADDR(pde, pte, offset)  ((((pde) & 0x7FFu) << 21) | (((pte) & 0x1FFu) << 12) | ((offset) & 0xFFFu))
+
+#define PAGING_4MB_PAGE		    		(1u << 7)
+#define PAGING_2MB_PAGE		    		(1u << 7)
+#define PAGING_NO_EXEC            (1ull << 63)
+
+#define PMAP_FLAG_BITS          				12u
+#define PTE_FLAG_BITS                   12u
+#define PDE_FLAG_BITS                   12u
+#define LARGE_PDE_FLAG_BITS             21u
+
+#define PFRAME_BITS											12u
+#define LARGE_PFRAME_BITS								21u
+
+/// 1 + the highest page frame number that can be placed in a PTE (or a PDE that
+/// points to a page table)
+#define PTE_PFRAME_LIMIT                (MAX_PHYS_MEMORY >> PFRAME_BITS)
+
+/// 1 + the highest large page frame number that can be placed in a large PDE
+#define LARGE_PFRAME_LIMIT              (MAX_PHYS_MEMORY >> LARGE_PFRAME_BITS)
+
+#define PAGE_BASE_MASK		   					0xFFFFFFFFFF000ull
+
+#define CR3_PWT                 	(1u << 3)
+#define CR3_PCD                 	(1u << 4)
+
+#define CR3_BASE_MASK           	0xFFFFFFE0u
+
+/// Set if the processor supports (and the kernel has enabled) the execute-disable bit.
+extern bool nxEnabled;
+
+struct CR3_Struct {
+  union {
+    struct {
+      uint32_t _resd1 :3;
+      uint32_t pwt :1;    // ignored with PAE
+      uint32_t pcd :1;    // ignored with PAE
+      uint32_t base :27;  // bits 5-31 of the PDPT
+    };
+
+    uint32_t value;
+  };
+};
+
+typedef struct CR3_Struct cr3_t;
+
+_Static_assert(sizeof(cr3_t) == 4, "CR3_Struct should be 4 bytes");
+
+/// Represents a 4 kB PTE in a PAE page table.
+
+struct PageTableEntry {
+  union {
+    struct {
+      uint64_t isPresent :1;
+      uint64_t isReadWrite :1;
+      uint64_t isUser :1;
+      uint64_t pwt :1;
+      uint64_t pcd :1;
+      uint64_t accessed :1;
+      uint64_t dirty :1;
+      uint64_t pat :1;
+      uint64_t global :1;
+      uint64_t available :3;
+      uint64_t base :40;
+      uint64_t _resd :11;
+      uint64_t noExecute :1;
+    };
+
+    uint64_t value;
+  };
+};
+
+typedef struct PageTableEntry pte_t;
+
+_Static_assert(sizeof(pte_t) == 8, "PageTableEntry should be 8 bytes");
+
+/// Represents a PDE that points to a page table in a PAE page directory.
+
+struct PageDirEntry {
+  union {
+    struct {
+      uint64_t isPresent :1;
+      uint64_t isReadWrite :1;
+      uint64_t isUser :1;
+      uint64_t pwt :1;
+      uint64_t pcd :1;
+      uint64_t accessed :1;
+      uint64_t available2 :1;
+      uint64_t isLargePage :1;    // should be 0
+      uint64_t available :4;
+      uint64_t base :40;
+      uint64_t _resd :11;
+      uint64_t noExecute :1;
+    };
+
+    uint64_t value;
+  };
+};
+
+typedef struct PageDirEntry pde_t;
+
+_Static_assert(sizeof(pde_t) == 8, "PageDirEntry should be 8 bytes");
+
+/// Represents a 2 MB PDE in a PAE page directory.
+
+struct LargePageDirEntry {
+  union {
+    struct {
+      uint64_t isPresent :1;
+      uint64_t isReadWrite :1;
+      uint64_t usPriv :1;
+      uint64_t pwt :1;
+      uint64_t pcd :1;
+      uint64_t accessed :1;
+      uint64_t dirty :1;
+      uint64_t isLargePage :1;   // should be 1
+      uint64_t global :1;
+      uint64_t available :3;
+      uint64_t pat :1;
+      uint64_t _resd :8;
+      uint64_t base :31;        // bits 21-51 of 2 MB frame
+      uint64_t _resd2 :11;
+      uint64_t noExecute :1;
+    };
+
+    uint64_t value;
+  };
+};
+
+typedef struct LargePageDirEntry large_pde_t;
+
+_Static_assert(sizeof(large_pde_t) == 8, "LargePageDirEntry should be 8 bytes");
+
+/// Represents one of the four entries in a page directory pointer table.
+
+struct PageDirPointerEntry {
+  union {
+    struct {
+      uint64_t isPresent :1;
+      uint64_t _resd :2;
+      uint64_t pwt :1;
+      uint64_t pcd :1;
+      uint64_t _resd2 :4;
+      uint64_t available :3;
+      uint64_t base :40;
+      uint64_t _resd3 :12;
+    };
+
+    uint64_t value;
+  };
+};
+
+typedef struct PageDirPointerEntry pdpte_t;
+
+_Static_assert(sizeof(pdpte_t) == 8, "PageDirPointerEntry should be 8 bytes");
+
+struct PageMapEntry {
+  union {
+    pde_t pde;
+    pte_t pte;
+    large_pde_t largePde;
+    pdpte_t pdpte;
+    uint64_t value;
+  };
+};
+
+typedef struct PageMapEntry pmap_entry_t;
 
-#define PAE_PRESENT         (1ull << 0)
-#define PAE_RW              (1ull << 1)
-#define PAE_US              (1ull << 2)
-#define PAE_PWT             (1ull << 3)
-#define PAE_PCD             (1ull << 4)
-#define PAE_ACCESSED        (1ull << 5)
-#define PAE_DIRTY           (1ull << 6)
-#define PAE_4K_PAT          (1ull << 7)
-#define PAE_PS              (1ull << 7)
-#define PAE_GLOBAL          (1ull << 8)
-#define PAE_2MB_PAT         (1ull << 12)
-#define PAE_XD              (1ull << 63)
-
-#define LARGE_PAGE_SIZE     0x200000
-#define MAX_PHYS_ADDR_BITS  52
-
-#define PDPTE_INDEX(addr)   (size_t)(((addr) >> 30) & 0x03)
-#define PDE_INDEX(addr)     (size_t)(((addr) >> 21) & 0x1FF)
-#define PTE_INDEX(addr)     (size_t)(((addr) >> 12)  & 0x1FF)
-#define PAGE_OFFSET(addr)   (size_t)(((addr) & 0x1FF)
-
-#define INDEX_TO_ADDR(pdpte, pde, pte, offset)  (addr_t)((((pdpte) & 0x1FF) << 30) | (((pde) & 0x1FF) << 21) | (((pte) & 0x1FF) << 12) | (offset & 0xFFF))
-
-typedef struct {
-  uint64_t present :1;
-  uint64_t rwPriv :1;
-  uint64_t usPriv :1;
-  uint64_t pwt :1;
-  uint64_t pcd :1;
-  uint64_t accessed :1;
-  uint64_t dirty :1;
-  uint64_t pat :1;
-  uint64_t global :1;
-  uint64_t available :3;
-  uint64_t base :40;
-  uint64_t _resd :11;
-  uint64_t noExec :1;
-} pte_t;
-
-typedef struct {
-  uint64_t present :1;
-  uint64_t rwPriv :1;
-  uint64_t usPriv :1;
-  uint64_t pwt :1;
-  uint64_t pcd :1;
-  uint64_t accessed :1;
-  uint64_t available :1;
-  uint64_t pageSize :1;
-  uint64_t available2 :4;
-  uint64_t base :40;
-  uint64_t _resd :11;
-  uint64_t noExec :1;
-} pde_t;
-
-typedef struct {
-  uint64_t present :1;
-  uint64_t rwPriv :1;
-  uint64_t usPriv :1;
-  uint64_t pwt :1;
-  uint64_t pcd :1;
-  uint64_t accessed :1;
-  uint64_t available :1;
-  uint64_t pageSize :1;
-  uint64_t global :1;
-  uint64_t available2 :3;
-  uint64_t pat :1;
-  uint64_t _resd :8;
-  uint64_t base :31;
-  uint64_t _resd2 :11;
-  uint64_t noExec :1;
-} large_pde_t;
-
-typedef struct {
-  uint64_t present :1;
-  uint64_t _resd :2;
-  uint64_t pwt :1;
-  uint64_t pcd :1;
-  uint64_t _resd2 :4;
-  uint64_t available2 :3;
-  uint64_t base :40;
-  uint64_t _resd :12;
-} pdpte_t;
-
-typedef struct {
-  uint32_t _resd :5;
-  uint32_t base :27;
-} cr3_t;
+_Static_assert(sizeof(pmap_entry_t) == 8, "PageMapEntry should be 8 bytes");
 
 #endif /* KERNEL_PAE_H */
-#endif /* 0 */
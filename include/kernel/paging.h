@@ -5,6 +5,9 @@
 #include <kernel/error.h>
 #include <stdint.h>
 
+#ifdef PAE
+#include <kernel/pae.h>
+#else
 #define MAX_PHYS_MEMORY           0x10000000000ull
 
 #define PAGE_SIZE		            	0x1000u
@@ -12,6 +15,9 @@
 #define PAE_LARGE_PAGE_SIZE	    	0x200000u
 #define PAGE_TABLE_SIZE	  	    	0x400000u
 
+#define USER_VEND                 KERNEL_VSTART
+#endif /* PAE */
+
 #define PMAP_ENTRY_COUNT					(PAGE_SIZE / sizeof(pmap_entry_t))
 #define PDE_ENTRY_COUNT						(PAGE_SIZE / sizeof(pde_t))
 #define LARGE_PDE_ENTRY_COUNT			(PAGE_SIZE / sizeof(large_pde_t))
@@ -20,12 +26,14 @@
 #define VIRT_TO_PHYS( addr )			(addr_t)( (addr) + &kVirtToPhys )
 #define PHYS_TO_VIRT( addr )			(addr_t)( (addr) + &kPhysToVirt )
 
+#ifndef PAE
 #define PDE_INDEX(a)		    			(((a) >> 22) & 0x3FFu)
 #define PTE_INDEX(a)		    			(((a) >> 12) & 0x3FFu)
 #define PAGE_OFFSET(a)		    		((a) & (PAGE_SIZE-1))
 #define LARGE_PAGE_OFFSET(a)      ((a) & (LARGE_PAGE_SIZE-1))
 
 #define NDX_TO_VADDR(pde, pte, offset)  ((((pde) & 0x3FFu) << 22) | (((pte) & 0x3FFu) << 12) | ((offset) & 0xFFFu))
+#endif /* PAE */
 
 #define PAGING_PRES		        		(1u << 0)
 #define PAGING_RW		        			(1u << 1)
@@ -37,7 +45,9 @@
 #define PAGING_ACCESSED		    		(1u << 5)
 #define PAGING_DIRTY		    			(1u << 6)
 #define PAGING_4KB_PAGE		    		0u
+#ifndef PAE
 #define PAGING_4MB_PAGE		    		(1u << 7)
+#endif /* PAE */
 #define PTE_PAT                   (1u << 7)
 #define PAGING_GLOBAL		    			(1u << 8)
 
@@ -49,6 +59,7 @@
 #define PAGING_ERR_SUPERVISOR			0u
 #define PAGING_ERR_USER		    		(1u << 2)
 
+#ifndef PAE
 #define PMAP_FLAG_BITS          				12u
 #define PTE_FLAG_BITS                   12u
 #define PDE_FLAG_BITS                   12u
@@ -57,6 +68,14 @@
 #define PFRAME_BITS											12u
 #define LARGE_PFRAME_BITS								22u
 
+/// 1 + the highest page frame number that can be placed in a PTE (or a PDE that
+/// points to a page table)
+#define PTE_PFRAME_LIMIT                (1ull << (32u - PFRAME_BITS))
+
+/// 1 + the highest large page frame number that can be placed in a large PDE
+#define LARGE_PFRAME_LIMIT              (MAX_PHYS_MEMORY >> LARGE_PFRAME_BITS)
+#endif /* PAE */
+
 #define PMAP_FLAG_MASK              	((1u << PMAP_FLAG_BITS)-1)
 #define PTE_FLAG_MASK               	((1u << PMAP_FLAG_BITS)-1)
 #define PDE_FLAG_MASK               	((1u << PMAP_FLAG_BITS)-1)
@@ -70,14 +89,15 @@
 #define PADDR_TO_PFRAME(addr)    			(pframe_t)((addr) >> PFRAME_BITS)
 #define PADDR_TO_LARGE_PFRAME(addr)    (pframe_t)(ALIGN_DOWN(addr, (uint64_t)LARGE_PAGE_SIZE) >> PFRAME_BITS)
 
-#define PAGE_BASE_MASK		   					0xFFFFF000u
-
-#define PTE_BASE(pte) 								((pte).base << PTE_FLAG_BITS)
-#define PDE_BASE(pde) 								((pde).base << PDE_FLAG_BITS)
+#define PTE_BASE(pte) 								((uint64_t)(pte).base << PTE_FLAG_BITS)
+#define PDE_BASE(pde) 								((uint64_t)(pde).base << PDE_FLAG_BITS)
 
 #define PADDR_TO_PDE_BASE(addr)				(uint32_t)((addr) >> PDE_FLAG_BITS)
 #define PADDR_TO_PTE_BASE(addr)				(uint32_t)((addr) >> PDE_FLAG_BITS)
 
+#ifndef PAE
+#define PAGE_BASE_MASK		   					0xFFFFF000u
+
 #define CR3_PWT                 	(1u << 3)
 #define CR3_PCD                 	(1u << 4)
 
@@ -196,9 +216,10 @@ struct PageMapEntry {
 typedef struct PageMapEntry pmap_entry_t;
 
 _Static_assert(sizeof(pmap_entry_t) == 4, "PageMapEntry should be 4 bytes");
+#endif /* PAE */
 
-pmap_entry_t readPmapEntry(uint32_t pbase, unsigned int entry);
-int writePmapEntry(uint32_t pbase, unsigned int entry,
+pmap_entry_t readPmapEntry(uint64_t pbase, unsigned int entry);
+int writePmapEntry(uint64_t pbase, unsigned int entry,
                        pmap_entry_t pmapEntry);
 int mapLargeFrame(uint64_t phys, pmap_entry_t *pmapEntry);
 int unmapLargeFrame(pmap_entry_t pmapEntry);
@@ -229,6 +250,106 @@ static inline uint32_t getRootPageMap(void) {
   return (uint32_t)(getCR3() & CR3_BASE_MASK);
 }
 
+/**
+ Switches to a new address space.
+
+ CR3 is only written if the address space actually changes. Kernel
+ mappings are global, so they survive the TLB flush when it is.
+
+ @param rootPmap The physical address of the new root page map.
+ */
+
+static inline void switchAddressSpace(uint32_t rootPmap) {
+  if((getCR3() & CR3_BASE_MASK) != (rootPmap & CR3_BASE_MASK))
+    setCR3(rootPmap);
+}
+
+#ifdef PAE
+/**
+ Reads a page directory pointer table entry from an address space.
+
+ @param entryNum The index of the PDPTE (0-3).
+ @param rootPmap The physical address of the root page map. If
+ CURRENT_ROOT_PMAP, then use the root page map in register CR3.
+ @return The PDPTE that was read.
+ */
+
+static inline pdpte_t readPDPTE(unsigned int entryNum, uint32_t rootPmap) {
+  return readPmapEntry(rootPmap, entryNum).pdpte;
+}
+
+/**
+ Writes a page directory pointer table entry to an address space.
+
+ The processor caches PDPTEs when CR3 is loaded, so CR3 must be reloaded
+ if the current address space is modified.
+
+ @param entryNum The index of the PDPTE (0-3).
+ @param pdpte The PDPTE to be written.
+ @param rootPmap The physical address of the root page map. If
+ CURRENT_ROOT_PMAP, then use the root page map in register CR3.
+ @return E_OK on success. E_FAIL on failure.
+ */
+
+static inline int writePDPTE(unsigned int entryNum, pdpte_t pdpte,
+                             uint32_t rootPmap)
+{
+  pmap_entry_t pmapEntry = {
+    .pdpte = pdpte
+  };
+  return writePmapEntry(rootPmap, entryNum, pmapEntry);
+}
+
+/**
+ Reads a page directory entry from an address space.
+
+ @param entryNum The index of the PDE across all four page directories
+ (as returned by PDE_INDEX()).
+ @param pageDir The physical address of the root page map. If
+ CURRENT_ROOT_PMAP, then use the root page map in register CR3.
+ @return The PDE that was read. A non-present PDE is returned if the
+ page directory itself isn't present.
+ */
+
+static inline pde_t readPDE(unsigned int entryNum, uint32_t pageDir) {
+  pdpte_t pdpte = readPDPTE(entryNum / PDE_PER_PAGE_DIR, pageDir);
+
+  if(!pdpte.isPresent) {
+    pde_t pde = {
+      .value = 0
+    };
+    return pde;
+  }
+
+  return readPmapEntry(PFRAME_TO_PADDR(pdpte.base),
+                       entryNum % PDE_PER_PAGE_DIR).pde;
+}
+
+/**
+ Writes a page directory entry to an address space.
+
+ @param entryNum The index of the PDE across all four page directories
+ (as returned by PDE_INDEX()).
+ @param pde The PDE to be written.
+ @param pageDir The physical address of the root page map. If
+ CURRENT_ROOT_PMAP, then use the root page map in register CR3.
+ @return E_OK on success. E_NOT_MAPPED if the page directory isn't
+ present. E_FAIL on failure.
+ */
+
+static inline int writePDE(unsigned int entryNum, pde_t pde, uint32_t pageDir) {
+  pdpte_t pdpte = readPDPTE(entryNum / PDE_PER_PAGE_DIR, pageDir);
+  pmap_entry_t pmapEntry = {
+    .pde = pde
+  };
+
+  if(!pdpte.isPresent)
+    return E_NOT_MAPPED;
+
+  return writePmapEntry(PFRAME_TO_PADDR(pdpte.base),
+                        entryNum % PDE_PER_PAGE_DIR, pmapEntry);
+}
+#else
 /**
  Reads a page directory entry from an address space.
 
@@ -260,6 +381,7 @@ static inline int writePDE(unsigned int entryNum, pde_t pde, uint32_t pageDir) {
   };
   return writePmapEntry(pageDir, entryNum, pmapEntry);
 }
+#endif /* PAE */
 
 /**
  Read a page table entry from a page table mapped in an address space.
@@ -269,7 +391,7 @@ static inline int writePDE(unsigned int entryNum, pde_t pde, uint32_t pageDir) {
  @return The PTE that was read.
  */
 
-static inline pte_t readPTE(unsigned int entryNum, uint32_t pageTable) {
+static inline pte_t readPTE(unsigned int entryNum, uint64_t pageTable) {
   return readPmapEntry(pageTable, entryNum).pte;
 }
 
@@ -282,7 +404,7 @@ static inline pte_t readPTE(unsigned int entryNum, uint32_t pageTable) {
  @return E_OK on success. E_FAIL on failure.
  */
 
-static inline int writePTE(unsigned int entryNum, pte_t pte, uint32_t pageTable)
+static inline int writePTE(unsigned int entryNum, pte_t pte, uint64_t pageTable)
 {
   pmap_entry_t pmapEntry = {
     .pte = pte
@@ -290,6 +412,23 @@ static inline int writePTE(unsigned int entryNum, pte_t pte, uint32_t pageTable)
   return writePmapEntry(pageTable, entryNum, pmapEntry);
 }
 
+#ifdef PAE
+CONST static inline pframe_t getPdeFrameNumber(pde_t pde) {
+  pmap_entry_t entry = {
+    .pde = pde
+  };
+
+  return entry.pde.isLargePage ?
+      (pframe_t)entry.largePde.base << (LARGE_PFRAME_BITS - PFRAME_BITS) :
+      (pframe_t)entry.pde.base;
+}
+
+NON_NULL_PARAMS
+static inline void setLargePdeBase(large_pde_t *largePde, pframe_t pframe)
+{
+  largePde->base = pframe >> (LARGE_PFRAME_BITS - PFRAME_BITS);
+}
+#else
 CONST static inline pframe_t getPdeFrameNumber(pde_t pde) {
   pmap_entry_t entry = {
     .pde = pde
@@ -307,5 +446,6 @@ static inline void setLargePdeBase(large_pde_t *largePde, pframe_t pframe)
   largePde->baseLower = (uint32_t)((pframe >> 10) & 0x3FFu);
   largePde->baseUpper = (uint32_t)((pframe >> 20) & 0xFFu);
 }
+#endif /* PAE */
 
 #endif /* PAGING_H */
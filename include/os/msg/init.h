@@ -32,6 +32,75 @@ struct UnmapRequest
   size_t length;
 };
 
+struct AllocStackRequest
+{
+  size_t size;
+};
+
+/* FREE_STACK uses an UnmapRequest with addr set to the top of the stack. SYNC_MEM
+   uses an UnmapRequest as well. */
+
+struct CreateShmRequest
+{
+  char name[MAX_NAME_LEN];
+  size_t size;
+  int flags;
+};
+
+struct AttachShmRequest
+{
+  char name[MAX_NAME_LEN];
+  addr_t addr;
+  int flags;
+};
+
+/* ATTACH_SHM responds with a MapResponse. DETACH_SHM uses an UnmapRequest (the length
+   is ignored) and DELETE_SHM uses an UnregisterNameRequest. */
+
+#define MEM_STATS_BLOCK_SIZES	4	// 4 kB, 128 kB, 4 MB and 128 MB blocks
+
+struct MemoryStatsRequest
+{
+  tid_t tid;      // The thread whose address space is reported (NULL_TID for the caller)
+};
+
+/* Page counts are in 4 kB pages unless noted otherwise. */
+
+struct MemoryStats
+{
+  size_t totalBlocks[MEM_STATS_BLOCK_SIZES];
+  size_t freeBlocks[MEM_STATS_BLOCK_SIZES];
+  size_t usedBlocks[MEM_STATS_BLOCK_SIZES];
+  size_t freeFrames;
+  size_t largestFreeRun;      // The longest run of contiguous free frames
+  size_t zeroedFrames;
+  size_t zeroedLargeFrames;   // 4 MB blocks
+  size_t cachedPages;
+  size_t swapUsed;
+  size_t swapTotal;
+  size_t shmRegions;
+  size_t shmFrames;
+  size_t addressSpaces;
+  size_t totalResidentPages;
+  size_t totalLargePages;     // 4 MB blocks
+  size_t residentPages;       // of the requested address space
+  size_t largePages;          // of the requested address space (4 MB blocks)
+  size_t swappedPages;        // of the requested address space
+  size_t heapBytes;           // taken by the init server's allocator for small objects
+  size_t heapBytesInUse;
+  size_t zeroFrameMappings;   // pages mapped to the shared zero frame
+  size_t zeroPages;           // of the requested address space
+};
+
+/* The new thread starts at entry in a copy-on-write clone of the sender's address
+   space. CLONE responds with a LookupNameResponse holding the new thread's tid. */
+
+struct CloneRequest
+{
+  addr_t entry;
+  addr_t stackTop;
+};
+
 struct CreatePortRequest
 {
   pid_t pid;
@@ -0,0 +1,50 @@
+#ifndef SBPOOL_H
+#define SBPOOL_H
+
+#include <stddef.h>
+#include <os/mutex.h>
+#include <os/ostypes/ostypes.h>
+
+/* A pool of fixed-size objects. Objects are carved out of blocks that are
+ allocated from the heap as needed. Freed objects go on a free list and are
+ reused before any more of a block is carved.
+
+ A pool can also be used as an arena: sbPoolReset() makes every object
+ available again at once while keeping the blocks, and sbPoolDestroy()
+ returns the blocks to the heap. */
+
+struct SBPoolBlock;
+
+typedef struct SBPool
+{
+  mutex_t lock;
+  size_t objSize;
+  size_t objsPerBlock;
+  void *freeList;
+  struct SBPoolBlock *blocks;
+  struct SBPoolBlock *lastBlock;
+  struct SBPoolBlock *carveBlock; // the block that objects are being carved from
+  size_t carved;                  // objects carved from carveBlock so far
+  size_t numBlocks;
+  size_t inUse;
+} sbpool_t;
+
+#define SB_POOL_DEFAULT_BLOCK_OBJS  64
+
+// Statically initializes a pool of objects of the given type.
+
+#define SB_POOL_INITIALIZER(type, perBlock) \
+  { 0, SB_POOL_OBJ_SIZE(sizeof(type)), (perBlock), NULL, NULL, NULL, NULL, 0, 0, 0 }
+
+#define SB_POOL_OBJ_ALIGN           8u
+#define SB_POOL_OBJ_SIZE(size)      ((size) < sizeof(void *) ? SB_POOL_OBJ_ALIGN : \
+                                     ((size) + SB_POOL_OBJ_ALIGN - 1) & ~(SB_POOL_OBJ_ALIGN - 1))
+
+void *sbPoolAlloc(sbpool_t *pool);
+int sbPoolCreate(sbpool_t *pool, size_t objSize, size_t objsPerBlock);
+void sbPoolDestroy(sbpool_t *pool);
+int sbPoolFree(sbpool_t *pool, void *obj);
+size_t sbPoolInUse(sbpool_t *pool);
+int sbPoolReset(sbpool_t *pool);
+
+#endif /* SBPOOL_H */
@@ -5,6 +5,7 @@
 #include <os/device.h>
 #include <os/region.h>
 #include <os/vfs.h>
+#include <os/msg/init.h>
 
 #define SERVER_GENERIC		0
 #define SERVER_DEVICE		1
@@ -39,6 +40,19 @@
 #define SEND_MESSAGE		7
 #define RECEIVE_MESSAGE		8
 
+#define ALLOC_STACK		14
+#define FREE_STACK		15
+#define SYNC_MEM		16
+
+#define CREATE_SHM		17
+#define ATTACH_SHM		18
+#define DETACH_SHM		19
+#define DELETE_SHM		20
+
+#define MEMORY_STATS		21
+
+#define CLONE			22
+
 
 #define GEN_REPLY_TYPE		0x80000000
 #define SHARE_MEM_REQ		0xFFF0
@@ -50,6 +64,11 @@
 #define MEM_FLG_IO		    0x10		// Map IO memory instead
 #define MEM_FLG_NOCACHE     0x20
 
+#define SHM_OTHERS_READ     0x01        // Other processes may attach the region read-only
+#define SHM_OTHERS_WRITE    0x02        // Other processes may attach the region read-write
+
+#define SHM_READ_ONLY       0x01        // Attach the region read-only
+
 struct GenericReq
 {
   int request;
@@ -65,6 +84,15 @@ struct ExecReq
 
 addr_t mapMem(addr_t addr, int device, size_t length, uint64_t offset, int flags);
 int unmapMem(addr_t addr, size_t length);
+addr_t allocStack(size_t size);
+int freeStack(addr_t stackTop, size_t size);
+int syncMem(addr_t addr, size_t length);
+int createShm(const char *name, size_t size, int flags);
+addr_t attachShm(const char *name, addr_t addr, int flags);
+int detachShm(addr_t addr);
+int deleteShm(const char *name);
+int getMemoryStats(tid_t tid, struct MemoryStats *stats);
+tid_t cloneAddrSpace(addr_t entry, addr_t stackTop);
 pid_t createPort(pid_t port, int flags);
 int destroyPort(pid_t port);
 int registerServer(int type, int id);
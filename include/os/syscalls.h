@@ -27,6 +27,7 @@
 #define PM_ACCESSED             0x80u
 #define PM_PAGE_SIZED           0x100u      // PDE points to a large page instead of table
 #define PM_STICKY               0x200u      // Suggestion to not invalidate entry upon context switch
+#define PM_NO_EXEC              0x400u      // Execute-disable (ignored unless the kernel uses PAE)
 #define PM_AVAIL_MASK           0x1F000u    // Mask for flags that encode available bits
 #define PM_AVAIL_OFFSET         12
 #define PM_OVERWRITE            0x80000000u
@@ -40,6 +40,9 @@
 
 #define INIT_SERVER_FLAG  "initsrv="
 
+#define CPUID_EXT_FEATURES  0x80000001u
+#define CPUID_EXT_NX        (1u << 20)
+
 struct RSDPointer {
   char signature[8]; // should be "RSD PTR "
   uint8_t checksum;
@@ -113,6 +116,13 @@ DISC_DATA ALIGNED(PAGE_SIZE) uint8_t kBootStack[4 * PAGE_SIZE];
 DISC_DATA void *kBootStackTop = kBootStack + sizeof kBootStack;
 DISC_DATA ALIGNED(PAGE_SIZE) pmap_entry_t kPageDir[PMAP_ENTRY_COUNT]; // The initial page directory used by the kernel on bootstrap
 
+#ifdef PAE
+// With PAE, kPageDir is the initial page directory pointer table.
+
+DISC_DATA ALIGNED(PAGE_SIZE) pmap_entry_t kLowPageDir[PMAP_ENTRY_COUNT]; // Identity maps the first 2 MiB on bootstrap
+ALIGNED(PAGE_SIZE) pmap_entry_t kKernelPageDir[PMAP_ENTRY_COUNT]; // Shared by all address spaces
+#endif /* PAE */
+
 extern gdt_entry_t kernelGDT[8];
 extern idt_entry_t kernelIDT[NUM_EXCEPTIONS + NUM_IRQS];
 
@@ -122,6 +132,9 @@ extern uint8_t *kernelStackTop;
 DISC_CODE void initPaging(void);
 DISC_CODE static tcb_t* loadElfExe(addr_t, uint32_t, void*);
 DISC_CODE static bool isValidElfExe(elf_header_t *image);
+#ifdef PAE
+DISC_CODE static int initPageDir(addr_t addr, uint32_t rootPmap);
+#endif /* PAE */
 DISC_CODE static void initInterrupts(void);
 //DISC_CODE static void initTimer( void ));
 DISC_CODE static int initMemory(multiboot_info_t *info);
@@ -756,6 +769,38 @@ bool isValidElfExe(elf_header_t *image) {
          && image->identifier[EI_CLASS] == ELFCLASS32;
 }
 
+#ifdef PAE
+/**
+ Allocates a page directory for the 1 GiB region of an address space that
+ contains an address, if one isn't already present.
+
+ @param addr The virtual address.
+ @param rootPmap The physical address of the root page map.
+ @return E_OK on success. E_FAIL on failure.
+ */
+
+int initPageDir(addr_t addr, uint32_t rootPmap) {
+  pdpte_t pdpte = readPDPTE(PDPTE_INDEX(addr), rootPmap);
+
+  if(!pdpte.isPresent) {
+    addr_t pageDir = allocPageFrame();
+
+    if(pageDir == INVALID_PFRAME)
+      RET_MSG(E_FAIL, "Unable to allocate page directory.");
+
+    clearPhysPage(pageDir);
+
+    pdpte.base = ADDR_TO_PFRAME(pageDir);
+    pdpte.isPresent = 1;
+
+    if(IS_ERROR(writePDPTE(PDPTE_INDEX(addr), pdpte, rootPmap)))
+      RET_MSG(E_FAIL, "Unable to write PDPTE.");
+  }
+
+  return E_OK;
+}
+#endif /* PAE */
+
 tcb_t* loadElfExe(addr_t img, addr_t addrSpace, void *uStack) {
   elf_header_t image;
   elf_sheader_t sheader;
@@ -790,6 +835,11 @@ tcb_t* loadElfExe(addr_t img, addr_t addrSpace, void *uStack) {
       continue;
 
     for(offset = 0; offset < sheader.size; offset += PAGE_SIZE) {
+#ifdef PAE
+      if(IS_ERROR(initPageDir(sheader.addr + offset, addrSpace)))
+        RET_MSG(NULL, "loadElfExe(): Unable to create page directory.");
+#endif /* PAE */
+
       pde = readPDE(PDE_INDEX(sheader.addr + offset), addrSpace);
 
       if(!pde.isPresent) {
@@ -929,6 +979,13 @@ void bootstrapInitServer(multiboot_info_t *info) {
   pde.isUser = 1;
   pde.isPresent = 1;
 
+#ifdef PAE
+  if(IS_ERROR(initPageDir(initServerStack-PAGE_TABLE_SIZE, initServerPDir))) {
+    kprintf("Unable to create page directory for init server stack.\n");
+    goto failedBootstrap;
+  }
+#endif /* PAE */
+
   if(IS_ERROR(
       writePDE(PDE_INDEX(initServerStack-PAGE_TABLE_SIZE), pde, initServerPDir)))
   {
@@ -1182,6 +1239,85 @@ void showCPU_Features(void) {
 }
 #endif /* DEBUG */
 
+#ifdef PAE
+void initPaging(void) {
+  unsigned int eax, ebx, ecx, edx;
+
+  memset(kPageDir, 0, PAGE_SIZE);
+  memset(kLowPageDir, 0, PAGE_SIZE);
+  memset(kKernelPageDir, 0, PAGE_SIZE);
+  memset(kMapAreaPTab, 0, PAGE_SIZE);
+
+  pdpte_t *lowPdpte = &kPageDir[0].pdpte;
+  pdpte_t *kernelPdpte = &kPageDir[PDPTE_INDEX(KERNEL_VSTART)].pdpte;
+
+  lowPdpte->base = ADDR_TO_PFRAME(KVIRT_TO_PHYS(kLowPageDir));
+  lowPdpte->isPresent = 1;
+
+  kernelPdpte->base = ADDR_TO_PFRAME(KVIRT_TO_PHYS(kKernelPageDir));
+  kernelPdpte->isPresent = 1;
+
+  large_pde_t *pde = &kLowPageDir[0].largePde;
+
+  setLargePdeBase(pde, 0);
+  pde->isLargePage = 1;
+  pde->isPresent = 1;
+  pde->isReadWrite = 1;
+
+  /* Map lower 256 MiB of physical memory to kernel space.
+   * The kernel has to be careful not to write to read-only or non-existent areas.
+   */
+
+  for(addr_t addr = ALIGN_DOWN(KERNEL_VSTART, LARGE_PAGE_SIZE);
+      addr < KERNEL_VEND && addr >= ALIGN_DOWN(KERNEL_VSTART, LARGE_PAGE_SIZE); addr +=
+      LARGE_PAGE_SIZE)
+  {
+    size_t pdeIndex = PDE_INDEX(addr) % PDE_PER_PAGE_DIR;
+    large_pde_t *largePde = &kKernelPageDir[pdeIndex].largePde;
+
+    largePde->global = 1;
+    setLargePdeBase(largePde, ADDR_TO_PFRAME(KVIRT_TO_PHYS(addr)));
+    largePde->isLargePage = 1;
+
+    largePde->isReadWrite = 1;
+    largePde->isPresent = 1;
+  }
+
+  pde_t *kMapPde = &kKernelPageDir[PDE_INDEX(KMAP_AREA2) % PDE_PER_PAGE_DIR].pde;
+
+  kMapPde->base = ADDR_TO_PFRAME(KVIRT_TO_PHYS(kMapAreaPTab));
+
+  kMapPde->isReadWrite = 1;
+  kMapPde->isPresent = 1;
+
+  // Set the page directory pointer table
+  setCR3((uint32_t)KVIRT_TO_PHYS((addr_t )kPageDir));
+
+  // Enable debugging extensions, PAE, global pages, FXSAVE/FXRSTOR, and SIMD exceptions
+  setCR4(CR4_DE | CR4_PAE | CR4_PGE | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+  // Enable the execute-disable bit, if supported
+
+  if(__get_cpuid(CPUID_EXT_FEATURES, &eax, &ebx, &ecx, &edx)
+     && IS_FLAG_SET(edx, CPUID_EXT_NX))
+  {
+    wrmsr(IA32_EFER_MSR, rdmsr(IA32_EFER_MSR) | EFER_NXE);
+    nxEnabled = true;
+  }
+
+  // Enable paging
+  setCR0(getCR0() | CR0_PG);
+
+  // Reload segment registers
+
+  setDs(KDATA_SEL);
+  setEs(KDATA_SEL);
+  setFs(KDATA_SEL);
+  setGs(KDATA_SEL);
+  setSs(KDATA_SEL);
+  setCs(KCODE_SEL);
+}
+#else
 void initPaging(void) {
   memset(kPageDir, 0, PAGE_SIZE);
   memset(kMapAreaPTab, 0, PAGE_SIZE);
@@ -1237,6 +1373,7 @@ void initPaging(void) {
   setSs(KDATA_SEL);
   setCs(KCODE_SEL);
 }
+#endif /* PAE */
 
 /**
  Bootstraps the kernel.
@@ -10,6 +10,10 @@
 
 ALIGNED(PAGE_SIZE) pte_t kMapAreaPTab[PTE_ENTRY_COUNT];
 
+#ifdef PAE
+bool nxEnabled;
+#endif /* PAE */
+
 NON_NULL_PARAMS
 static int accessPhys(uint64_t phys, void *buffer, size_t len, bool readPhys);
 
@@ -63,6 +67,20 @@ int unmapLargeFrame(pmap_entry_t pmapEntry) {
 int initializeRootPmap(uint32_t pmap) {
   // Map kernel memory into the new address space
 
+#ifdef PAE
+  /* The kernel's page directory is shared by all address spaces. The identity
+   mapped first page table (DEBUG) is in a user page directory, so it won't
+   be shared. */
+
+  for(unsigned int entry = PDPTE_INDEX(KERNEL_VSTART); entry < PDPTE_ENTRY_COUNT;
+      entry++)
+  {
+    if(IS_ERROR(writePDPTE(entry, readPDPTE(entry, CURRENT_ROOT_PMAP), pmap)))
+      RET_MSG(E_FAIL, "Unable to copy kernel PDPTEs (write failed).");
+  }
+
+  return E_OK;
+#else
 #ifdef DEBUG
 
   // map the first page table
@@ -78,6 +96,7 @@ int initializeRootPmap(uint32_t pmap) {
   }
 
   return E_OK;
+#endif /* PAE */
 }
 
 /**
@@ -115,15 +134,15 @@ bool isAccessible(addr_t addr, uint32_t pdir, bool isRead) {
  yet.
  */
 
-pmap_entry_t readPmapEntry(uint32_t pbase, unsigned int entry) {
-  assert(entry < 1024);
+pmap_entry_t readPmapEntry(uint64_t pbase, unsigned int entry) {
+  assert(entry < PMAP_ENTRY_COUNT);
 
   if(pbase == CURRENT_ROOT_PMAP)
     pbase = getRootPageMap();
 
   pte_t *pte = &kMapAreaPTab[PTE_INDEX(TEMP_PAGE)];
 
-  pte->base = ADDR_TO_PFRAME(pbase);
+  pte->base = PADDR_TO_PFRAME(pbase);
   pte->isReadWrite = 1;
   pte->isPresent = 1;
 
@@ -151,15 +170,15 @@ pmap_entry_t readPmapEntry(uint32_t pbase, unsigned int entry) {
  yet.
  */
 
-int writePmapEntry(uint32_t pbase, unsigned int entry, pmap_entry_t buffer) {
-  assert(entry < 1024);
+int writePmapEntry(uint64_t pbase, unsigned int entry, pmap_entry_t buffer) {
+  assert(entry < PMAP_ENTRY_COUNT);
 
   if(pbase == CURRENT_ROOT_PMAP)
     pbase = getRootPageMap();
 
   pte_t *pte = &kMapAreaPTab[PTE_INDEX(TEMP_PAGE)];
 
-  pte->base = ADDR_TO_PFRAME(pbase);
+  pte->base = PADDR_TO_PFRAME(pbase);
   pte->isReadWrite = 1;
   pte->isPresent = 1;
 
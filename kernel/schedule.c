@@ -62,8 +62,7 @@ NON_NULL_PARAMS void switchStacks(ExecutionState *state) {
 
       // Switch to the new address space
 
-      if((getCR3() & CR3_BASE_MASK) != (newTcb->rootPageMap & CR3_BASE_MASK))
-        setCR3(newTcb->rootPageMap);
+      switchAddressSpace(newTcb->rootPageMap);
 
       if(oldTcb) {
         oldTcb->userExecState = *state;
@@ -43,6 +43,12 @@ typedef struct SyscallArgs {
   uint32_t eflags;
 } syscall_args_t;
 
+#ifdef PAE
+#define ROOT_PMAP_LEVEL   3
+#else
+#define ROOT_PMAP_LEVEL   2
+#endif /* PAE */
+
 noreturn void sysenterEntry(void) NAKED;
 
 static int sysReceive(syscall_args_t args);
@@ -84,7 +90,7 @@ static int sysGetPageMappings(syscall_args_t args) {
 #define COUNT       (size_t)args.arg2
 #define ADDR_SPACE_VAR args.arg3
 #define ADDR_SPACE  (addr_t)ADDR_SPACE_VAR
-#define MAPPINGS    (struct PageMapping *)args.arg3
+#define MAPPINGS    (struct PageMapping *)args.arg4
 #define LEVEL       (unsigned int)args.subArg.word
 
   struct PageMapping *mappings = MAPPINGS;
@@ -94,12 +100,12 @@ static int sysGetPageMappings(syscall_args_t args) {
     return ESYS_FAIL;
 
   if(ADDR_SPACE == CURRENT_ROOT_PMAP) {
-    if(LEVEL == 2) {
+    if(LEVEL == ROOT_PMAP_LEVEL) {
       cr3_t cr3 = {
         .value = getCR3()
       };
 
-      mappings->physFrame = (pframe_t)cr3.base;
+      mappings->physFrame = PADDR_TO_PFRAME(cr3.value & CR3_BASE_MASK);
       mappings->flags = 0;
 
       if(cr3.pcd)
@@ -116,7 +122,7 @@ static int sysGetPageMappings(syscall_args_t args) {
 
   switch(LEVEL ) {
     case 0:
-      for(i = 0; i < COUNT && VIRT < KERNEL_VSTART;
+      for(i = 0; i < COUNT && VIRT < USER_VEND;
           i++, VIRT_VAR += PAGE_SIZE, mappings++)
       {
         pde_t pde = readPDE(PDE_INDEX(VIRT), ADDR_SPACE);
@@ -153,11 +159,16 @@ static int sysGetPageMappings(syscall_args_t args) {
 
           if(pte.accessed)
             mappings->flags |= PM_ACCESSED;
+
+#ifdef PAE
+          if(pte.noExecute)
+            mappings->flags |= PM_NO_EXEC;
+#endif /* PAE */
         }
       }
       break;
     case 1:
-      for(i = 0; i < COUNT && VIRT < KERNEL_VSTART; i++, VIRT_VAR +=
+      for(i = 0; i < COUNT && VIRT < USER_VEND; i++, VIRT_VAR +=
       PAGE_TABLE_SIZE, mappings++)
       {
         pde_t pde = readPDE(PDE_INDEX(VIRT), ADDR_SPACE);
@@ -199,10 +210,39 @@ static int sysGetPageMappings(syscall_args_t args) {
 
           if(pde.accessed)
             mappings->flags |= PM_ACCESSED;
+
+#ifdef PAE
+          if(pde.noExecute)
+            mappings->flags |= PM_NO_EXEC;
+#endif /* PAE */
+        }
+      }
+      break;
+#ifdef PAE
+    case 2:
+      for(i = 0; i < COUNT && VIRT < USER_VEND; i++, VIRT_VAR +=
+      PAGE_DIR_SIZE, mappings++)
+      {
+        pdpte_t pdpte = readPDPTE(PDPTE_INDEX(VIRT), ADDR_SPACE);
+
+        if(!pdpte.isPresent) {
+          mappings->blockNum = 0;
+          mappings->flags = PM_UNMAPPED;
+        }
+        else {
+          mappings->physFrame = pdpte.base;
+          mappings->flags = 0;
+
+          if(pdpte.pcd)
+            mappings->flags |= PM_UNCACHED;
+
+          if(pdpte.pwt)
+            mappings->flags |= PM_WRITETHRU;
         }
       }
       break;
-    case 2: {
+#endif /* PAE */
+    case ROOT_PMAP_LEVEL: {
       mappings->physFrame = PADDR_TO_PFRAME(ADDR_SPACE);
       mappings->flags = 0;
 
@@ -234,7 +274,7 @@ static int sysSetPageMappings(syscall_args_t args) {
 #define COUNT       (size_t)args.arg2
 #define ADDR_SPACE_VAR args.arg3
 #define ADDR_SPACE  (uint32_t)ADDR_SPACE_VAR
-#define MAPPINGS    (struct PageMapping *)args.arg3
+#define MAPPINGS    (struct PageMapping *)args.arg4
 #define LEVEL				(unsigned int)args.subArg.word
 
   size_t i;
@@ -248,7 +288,7 @@ static int sysSetPageMappings(syscall_args_t args) {
 
   switch(LEVEL ) {
     case 0:
-      for(i = 0; i < COUNT && VIRT < KERNEL_VSTART;
+      for(i = 0; i < COUNT && VIRT < USER_VEND;
           i++, VIRT_VAR += PAGE_SIZE, mappings++)
       {
         pte_t pte = {
@@ -273,7 +313,7 @@ static int sysSetPageMappings(syscall_args_t args) {
               >> PM_AVAIL_OFFSET);
           pte.isPresent = 1;
 
-          if(mappings->physFrame >= 1048576u)
+          if(mappings->physFrame >= PTE_PFRAME_LIMIT)
             RET_MSG((int )i, "Tried to write invalid frame to PTE.");
           else if(availBits & ~0x07u)
             RET_MSG((int )i, "Cannot set available bits (overflow).");
@@ -290,16 +330,19 @@ static int sysSetPageMappings(syscall_args_t args) {
           pte.pwt = IS_FLAG_SET(mappings->flags, PM_WRITETHRU);
           pte.global = IS_FLAG_SET(mappings->flags, PM_STICKY);
           pte.available = availBits;
+#ifdef PAE
+          pte.noExecute = nxEnabled && IS_FLAG_SET(mappings->flags, PM_NO_EXEC);
+#endif /* PAE */
         }
 
-        if(IS_ERROR(writePTE(PTE_INDEX(VIRT), pte, ADDR_SPACE)))
+        if(IS_ERROR(writePTE(PTE_INDEX(VIRT), pte, PDE_BASE(pde))))
           RET_MSG((int )i, "Unable to write to PTE.");
 
         invalidatePage(VIRT);
       }
       break;
     case 1:
-      for(i = 0; i < COUNT && VIRT < KERNEL_VSTART; i++, VIRT_VAR +=
+      for(i = 0; i < COUNT && VIRT < USER_VEND; i++, VIRT_VAR +=
       PAGE_TABLE_SIZE, mappings++)
       {
         pmap_entry_t pmapEntry = {
@@ -324,12 +367,16 @@ static int sysSetPageMappings(syscall_args_t args) {
           pmapEntry.pde.accessed = IS_FLAG_SET(mappings->flags, PM_ACCESSED);
           pmapEntry.pde.pcd = IS_FLAG_SET(mappings->flags, PM_UNCACHED);
           pmapEntry.pde.pwt = IS_FLAG_SET(mappings->flags, PM_WRITETHRU);
+#ifdef PAE
+          pmapEntry.pde.noExecute = nxEnabled
+              && IS_FLAG_SET(mappings->flags, PM_NO_EXEC);
+#endif /* PAE */
 
           if(IS_FLAG_SET(mappings->flags, PM_PAGE_SIZED)) {
             uint32_t availBits = ((mappings->flags & PM_AVAIL_MASK)
                 >> PM_AVAIL_OFFSET);
 
-            if(mappings->physFrame >= 262144u)
+            if(mappings->physFrame >= LARGE_PFRAME_LIMIT)
               RET_MSG((int )i, "Tried to write invalid frame to PDE.");
             else if(availBits & ~0x07u)
               RET_MSG((int )i, "Cannot set available bits (overflow).");
@@ -342,15 +389,16 @@ static int sysSetPageMappings(syscall_args_t args) {
                                      && !IS_FLAG_SET(mappings->flags,
                                                      PM_UNCACHED);
             pmapEntry.largePde.available = availBits;
-            pmapEntry.largePde.baseLower = mappings->physFrame & 0x3FFu;
-            pmapEntry.largePde.baseUpper = mappings->physFrame >> 10u;
+            setLargePdeBase(&pmapEntry.largePde,
+                            mappings->physFrame
+                            << (LARGE_PFRAME_BITS - PFRAME_BITS));
             pmapEntry.largePde._resd = 0;
           }
           else {
             uint32_t availBits = ((mappings->flags & PM_AVAIL_MASK)
                 >> PM_AVAIL_OFFSET);
 
-            if(mappings->physFrame >= 1048576u)
+            if(mappings->physFrame >= PTE_PFRAME_LIMIT)
               RET_MSG((int )i, "Tried to write invalid frame to PDE.");
             else if(availBits & ~0x1fu)
               RET_MSG((int )i, "Cannot set available bits (overflow).");
@@ -366,6 +414,38 @@ static int sysSetPageMappings(syscall_args_t args) {
           RET_MSG((int )i, "Unable to write to PDE.");
       }
       break;
+#ifdef PAE
+    case 2:
+      for(i = 0; i < COUNT && VIRT < USER_VEND; i++, VIRT_VAR +=
+      PAGE_DIR_SIZE, mappings++)
+      {
+        pdpte_t pdpte = {
+          .value = 0
+        };
+
+        if(IS_FLAG_SET(mappings->flags, PM_KERNEL))
+          RET_MSG((int )i, "Cannot set page directory with kernel access privilege.");
+
+        if(!IS_FLAG_SET(mappings->flags, PM_UNMAPPED)) {
+          if(mappings->physFrame >= PTE_PFRAME_LIMIT)
+            RET_MSG((int )i, "Tried to write invalid frame to PDPTE.");
+
+          pdpte.base = mappings->physFrame;
+          pdpte.pcd = IS_FLAG_SET(mappings->flags, PM_UNCACHED);
+          pdpte.pwt = IS_FLAG_SET(mappings->flags, PM_WRITETHRU);
+          pdpte.isPresent = 1;
+        }
+
+        if(IS_ERROR(writePDPTE(PDPTE_INDEX(VIRT), pdpte, ADDR_SPACE)))
+          RET_MSG((int )i, "Unable to write to PDPTE.");
+      }
+
+      // The processor only loads PDPTEs when CR3 is written
+
+      if(ADDR_SPACE == getRootPageMap())
+        invalidateTlb();
+      break;
+#endif /* PAE */
     default:
       return ESYS_FAIL;
   }
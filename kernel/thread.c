@@ -288,8 +288,7 @@ tid_t getNewTid(void) {
 NON_NULL_PARAMS void switchContext(tcb_t *thread, int doXSave) {
   assert(thread->threadState == RUNNING);
 
-  if((thread->rootPageMap & CR3_BASE_MASK) != (getCR3() & CR3_BASE_MASK))
-    setCR3(thread->rootPageMap);
+  switchAddressSpace(thread->rootPageMap);
 
   tcb_t *currentThread = getCurrentThread();
 
@@ -311,6 +310,5 @@ NON_NULL_PARAMS void switchContext(tcb_t *thread, int doXSave) {
   *s = (uint32_t)kernelStackTop;
   *state = thread->userExecState;
 
-  setCR3(initServerThread->rootPageMap);
   RESTORE_STATE;
 }
@@ -268,6 +268,17 @@
  implementation is left out, so lock functions must be supplied manually,
  as described below.
 
+ MALLOC_THREAD_CACHE      default: 0 (false)
+ If true, small chunks that are freed are kept in per-thread caches and
+ handed out again without taking the global lock. Caches are refilled from
+ and drained to the global heap in batches. Implies USE_LOCKS. Caches are
+ picked by stack address: the page that the stack pointer is in, plus the
+ 1 << TCACHE_LARGE_STACK_SHIFT byte block that it's in. This separates
+ stacks that are a page apart (uthreads) as well as stacks that are 4 MB
+ apart (threads started by the init server). (TCACHE_COUNT,
+ TCACHE_STACK_SHIFT, TCACHE_LARGE_STACK_SHIFT, TCACHE_MAX_CHUNK,
+ TCACHE_BIN_LIMIT and TCACHE_BATCH may be overridden).
+
  USE_SPIN_LOCKS           default: 1 iff USE_LOCKS and spin locks available
  If true, uses custom spin locks for locking. This is currently
  supported only gcc >= 4.1, older gccs on x86 platforms, and recent
@@ -585,6 +596,36 @@
 /* The maximum possible size_t value has all bits set */
 #define MAX_SIZE_T           (~(size_t)0)
 
+#ifndef MALLOC_THREAD_CACHE
+#define MALLOC_THREAD_CACHE 0
+#endif /* MALLOC_THREAD_CACHE */
+#if MALLOC_THREAD_CACHE
+#ifndef USE_LOCKS
+#define USE_LOCKS 1
+#endif /* USE_LOCKS */
+#if !USE_LOCKS
+#error "MALLOC_THREAD_CACHE requires USE_LOCKS"
+#endif /* !USE_LOCKS */
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT        8
+#endif /* TCACHE_COUNT */
+#ifndef TCACHE_STACK_SHIFT
+#define TCACHE_STACK_SHIFT  12
+#endif /* TCACHE_STACK_SHIFT */
+#ifndef TCACHE_LARGE_STACK_SHIFT
+#define TCACHE_LARGE_STACK_SHIFT  22
+#endif /* TCACHE_LARGE_STACK_SHIFT */
+#ifndef TCACHE_MAX_CHUNK
+#define TCACHE_MAX_CHUNK    ((size_t)256U)
+#endif /* TCACHE_MAX_CHUNK */
+#ifndef TCACHE_BIN_LIMIT
+#define TCACHE_BIN_LIMIT    16U
+#endif /* TCACHE_BIN_LIMIT */
+#ifndef TCACHE_BATCH
+#define TCACHE_BATCH        (TCACHE_BIN_LIMIT / 2)
+#endif /* TCACHE_BATCH */
+#endif /* MALLOC_THREAD_CACHE */
+
 #ifndef USE_LOCKS /* ensure true if spin or recursive locks set */
 #define USE_LOCKS  ((defined(USE_SPIN_LOCKS) && USE_SPIN_LOCKS != 0) || \
                     (defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0))
@@ -1496,6 +1537,8 @@ extern void*     sbrk(ptrdiff_t);
 #include <thread.h>
 #elif !defined(LACKS_SCHED_H)
 #include <sched.h>
+#else
+#include <x86gprintrin.h> /* for __pause */
 #endif /* solaris or LACKS_SCHED_H */
 #if (defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0) || !USE_SPIN_LOCKS
 #include <pthread.h>
@@ -1867,7 +1910,8 @@ static FORCEINLINE void x86_clear_lock(int* sl) {
 #elif !defined(LACKS_SCHED_H)
 #define SPIN_LOCK_YIELD   sched_yield();
 #else
-#define SPIN_LOCK_YIELD
+/* There's no yield system call, so back off with a spin-wait hint */
+#define SPIN_LOCK_YIELD   __pause();
 #endif /* ... yield ... */
 
 #if !defined(USE_RECURSIVE_LOCKS) || USE_RECURSIVE_LOCKS == 0
@@ -4534,6 +4578,157 @@ static void reset_on_error(mstate m) {
     return 0;
   }
 
+#if MALLOC_THREAD_CACHE
+  /* ---------------------------- Thread caches ---------------------------- */
+
+  /*
+   Each thread is mapped to one of TCACHE_COUNT caches by the address of its
+   stack, since there's no thread-local storage. Threads whose stacks map to
+   the same cache share it. A cache's lock is only ever tried: a thread that
+   finds its cache busy goes straight to the global heap.
+
+   Stacks are a page apart (uthreads) or 4 MB apart (init server threads), so
+   the slot adds the stack pointer's page number to its 4 MB block number.
+   With only the page number, threads at the same depth of 4 MB-aligned
+   stacks would always share a cache. A thread whose stack spans several
+   pages may use a different cache at a different call depth; that only
+   costs it some cache hits, since every cache has its own lock.
+
+   A cache holds up to TCACHE_BIN_LIMIT free chunks of each small size. The
+   chunks stay in use as far as the global heap is concerned. An empty bin is
+   refilled with TCACHE_BATCH chunks from a single ialloc, and a full bin
+   returns TCACHE_BATCH chunks to the global heap with a single bulk free.
+   */
+
+#define TCACHE_BINS         (small_index(TCACHE_MAX_CHUNK) + 1)
+
+  struct malloc_tcache_bin {
+    void **head; /* the first word of a cached chunk links to the next one */
+    unsigned int count;
+  };
+
+  struct malloc_tcache {
+    MLOCK_T lock;
+    struct malloc_tcache_bin bins[TCACHE_BINS];
+  };
+
+  static struct malloc_tcache tcaches[TCACHE_COUNT];
+
+  static void** ialloc(mstate m, size_t n_elements, size_t *sizes, int opts,
+                       void *chunks[]);
+  static size_t internal_bulk_free(mstate m, void *array[], size_t nelem);
+
+  static FORCEINLINE struct malloc_tcache* tcache_for_thread(void) {
+    size_t sp = (size_t)__builtin_frame_address(0);
+    size_t slot = (sp >> TCACHE_STACK_SHIFT) + (sp >> TCACHE_LARGE_STACK_SHIFT);
+    return &tcaches[slot % TCACHE_COUNT];
+  }
+
+  static void tcache_push(struct malloc_tcache_bin *bin, void *mem) {
+    *(void**)mem = bin->head;
+    bin->head = (void**)mem;
+    bin->count++;
+  }
+
+  static void* tcache_pop(struct malloc_tcache_bin *bin) {
+    void **mem = bin->head;
+    bin->head = (void**)*mem;
+    bin->count--;
+    return mem;
+  }
+
+  /* Returns a cached chunk for a small request, or 0 if the request must be
+   handled by the global heap. */
+  static void* tcache_malloc(size_t bytes) {
+    struct malloc_tcache *tc;
+    struct malloc_tcache_bin *bin;
+    void *mem = 0;
+    size_t nb = (bytes < MIN_REQUEST) ? MIN_CHUNK_SIZE : pad_request(bytes);
+
+    if(nb > TCACHE_MAX_CHUNK)
+      return 0;
+
+    tc = tcache_for_thread();
+
+    if(!TRY_LOCK(&tc->lock))
+      return 0;
+
+    bin = &tc->bins[small_index(nb)];
+
+    if(bin->count == 0) {
+      void *chunks[TCACHE_BATCH];
+      size_t request = nb - CHUNK_OVERHEAD;
+      size_t i;
+
+      if(ialloc(gm, TCACHE_BATCH, &request, 0x1, chunks) != 0) {
+        for(i = TCACHE_BATCH; i != 0; --i)
+          tcache_push(bin, chunks[i - 1]);
+      }
+    }
+
+    if(bin->count != 0)
+      mem = tcache_pop(bin);
+
+    RELEASE_LOCK(&tc->lock);
+    return mem;
+  }
+
+  /* Returns half of a bin's chunks to the global heap. */
+  static void tcache_drain(struct malloc_tcache_bin *bin, unsigned int count) {
+    void *chunks[TCACHE_BIN_LIMIT];
+    unsigned int i;
+
+    for(i = 0; i != count && bin->count != 0; ++i)
+      chunks[i] = tcache_pop(bin);
+
+    internal_bulk_free(gm, chunks, i);
+  }
+
+  /* Caches a freed chunk. Returns 0 if the chunk must be freed by the global
+   heap instead. */
+  static int tcache_free(void *mem) {
+    mchunkptr p = mem2chunk(mem);
+    size_t psize = chunksize(p);
+    struct malloc_tcache *tc;
+    struct malloc_tcache_bin *bin;
+
+    if(psize > TCACHE_MAX_CHUNK || is_mmapped(p))
+      return 0;
+
+    tc = tcache_for_thread();
+
+    if(!TRY_LOCK(&tc->lock))
+      return 0;
+
+    bin = &tc->bins[small_index(psize)];
+
+    if(bin->count >= TCACHE_BIN_LIMIT)
+      tcache_drain(bin, TCACHE_BATCH);
+
+    tcache_push(bin, mem);
+    RELEASE_LOCK(&tc->lock);
+    return 1;
+  }
+
+  /* Returns every cached chunk to the global heap, so that it can be trimmed. */
+  static void tcache_flush_all(void) {
+    size_t i, j;
+
+    for(i = 0; i != TCACHE_COUNT; ++i) {
+      struct malloc_tcache *tc = &tcaches[i];
+
+      if(TRY_LOCK(&tc->lock)) {
+        for(j = 0; j != TCACHE_BINS; ++j) {
+          while(tc->bins[j].count != 0)
+            tcache_drain(&tc->bins[j], TCACHE_BIN_LIMIT);
+        }
+
+        RELEASE_LOCK(&tc->lock);
+      }
+    }
+  }
+#endif /* MALLOC_THREAD_CACHE */
+
 #if !ONLY_MSPACES
 
   void* dlmalloc(size_t bytes) {
@@ -4564,6 +4759,14 @@ static void reset_on_error(mstate m) {
   ensure_initialization(); /* initialize in sys_alloc if not using locks */
 #endif
 
+#if MALLOC_THREAD_CACHE
+    if(bytes <= MAX_SMALL_REQUEST) {
+      void *mem = tcache_malloc(bytes);
+      if(mem != 0)
+        return mem;
+    }
+#endif /* MALLOC_THREAD_CACHE */
+
     if(!PREACTION(gm)) {
       void *mem;
       size_t nb;
@@ -4683,6 +4886,10 @@ postaction:
 
     if(mem != 0) {
       mchunkptr p = mem2chunk(mem);
+#if MALLOC_THREAD_CACHE
+      if(tcache_free(mem))
+        return;
+#endif /* MALLOC_THREAD_CACHE */
 #if FOOTERS
     mstate fm = get_mstate_for(p);
     if (!ok_magic(fm)) {
@@ -5337,6 +5544,9 @@ void dlmalloc_inspect_all(void(*handler)(void *start,
   int dlmalloc_trim(size_t pad) {
     int result = 0;
     ensure_initialization();
+#if MALLOC_THREAD_CACHE
+    tcache_flush_all();
+#endif /* MALLOC_THREAD_CACHE */
     if(!PREACTION(gm)) {
       result = sys_trim(gm, pad);
       POSTACTION(gm);
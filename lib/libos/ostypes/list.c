@@ -1,6 +1,11 @@
 #include <os/list.h>
+#include <os/ostypes/sbpool.h>
 #include <stdlib.h>
 
+#define LIST_NODES_PER_BLOCK  128
+
+static sbpool_t listNodePool = SB_POOL_INITIALIZER(list_node_t, LIST_NODES_PER_BLOCK);
+
 enum ListOpWhich {
   FIRST, LAST, ALL, HEAD, TAIL
 };
@@ -15,7 +20,7 @@ static int _listRemove(list_t *list, int key, void **elemPtr,
 static int _listRemoveEnd(list_t *list, void **elemPtr, enum ListOpWhich which);
 
 static list_node_t* _createListNode(int key, void *elem) {
-  list_node_t *node = kmalloc(sizeof(list_node_t));
+  list_node_t *node = sbPoolAlloc(&listNodePool);
 
   if(!node)
     return NULL;
@@ -49,7 +54,7 @@ int listDestroy(list_t *list) {
 
   for(list_node_t *ptr = list->head; ptr != NULL; ptr = next) {
     next = ptr->next;
-    kfree(ptr, sizeof *ptr);
+    sbPoolFree(&listNodePool, ptr);
   }
 
   list->head = list->tail = NULL;
@@ -150,7 +155,7 @@ static int _listRemoveEnd(list_t *list, void **elemPtr, enum ListOpWhich which)
     if(elemPtr)
       *elemPtr = prevNode->elem;
 
-    kfree(prevNode, sizeof *prevNode);
+    sbPoolFree(&listNodePool, prevNode);
     return 0;
   }
   else
@@ -187,7 +192,7 @@ static int _listRemove(list_t *list, int key, void **elemPtr,
       if(elemPtr)
         *elemPtr = node->elem;
 
-      kfree(node, sizeof *node);
+      sbPoolFree(&listNodePool, node);
 
       if(which != ALL)
         return 0;
@@ -0,0 +1,160 @@
+#include <os/ostypes/sbpool.h>
+#include <x86gprintrin.h>
+#include <stdlib.h>
+
+struct SBPoolBlock
+{
+  struct SBPoolBlock *next;
+  size_t _pad; // keeps objects 8-byte aligned
+};
+
+static void lockPool(sbpool_t *pool);
+static void unlockPool(sbpool_t *pool);
+static void *carveObject(sbpool_t *pool);
+
+static void lockPool(sbpool_t *pool) {
+  while(mutex_lock(&pool->lock))
+    __pause();
+}
+
+static void unlockPool(sbpool_t *pool) {
+  while(mutex_unlock(&pool->lock));
+}
+
+/* Returns the next uncarved object. Blocks that were kept by sbPoolReset()
+ are carved again before a new block is allocated. */
+
+static void *carveObject(sbpool_t *pool) {
+  struct SBPoolBlock *block = pool->carveBlock;
+
+  if(!block || pool->carved == pool->objsPerBlock) {
+    block = block ? block->next : pool->blocks;
+
+    if(!block) {
+      block = malloc(sizeof *block + pool->objSize * pool->objsPerBlock);
+
+      if(!block)
+        return NULL;
+
+      block->next = NULL;
+
+      if(pool->lastBlock)
+        pool->lastBlock->next = block;
+      else
+        pool->blocks = block;
+
+      pool->lastBlock = block;
+      pool->numBlocks++;
+    }
+
+    pool->carveBlock = block;
+    pool->carved = 0;
+  }
+
+  return (char *)(block + 1) + pool->objSize * pool->carved++;
+}
+
+void *sbPoolAlloc(sbpool_t *pool) {
+  void *obj;
+
+  if(!pool)
+    return NULL;
+
+  lockPool(pool);
+
+  if(pool->freeList) {
+    obj = pool->freeList;
+    pool->freeList = *(void **)obj;
+  }
+  else
+    obj = carveObject(pool);
+
+  if(obj)
+    pool->inUse++;
+
+  unlockPool(pool);
+
+  return obj;
+}
+
+int sbPoolCreate(sbpool_t *pool, size_t objSize, size_t objsPerBlock) {
+  if(!pool || objSize == 0)
+    return SB_FAIL;
+
+  pool->lock = 0;
+  pool->objSize = SB_POOL_OBJ_SIZE(objSize);
+  pool->objsPerBlock = objsPerBlock ? objsPerBlock : SB_POOL_DEFAULT_BLOCK_OBJS;
+  pool->freeList = NULL;
+  pool->blocks = pool->lastBlock = pool->carveBlock = NULL;
+  pool->carved = 0;
+  pool->numBlocks = 0;
+  pool->inUse = 0;
+
+  return 0;
+}
+
+/* Returns every block to the heap. Any objects that are still allocated
+ from the pool become invalid. The pool may be used again afterwards. */
+
+void sbPoolDestroy(sbpool_t *pool) {
+  struct SBPoolBlock *next;
+
+  if(!pool)
+    return;
+
+  lockPool(pool);
+
+  for(struct SBPoolBlock *block = pool->blocks; block != NULL; block = next) {
+    next = block->next;
+    free(block);
+  }
+
+  pool->freeList = NULL;
+  pool->blocks = pool->lastBlock = pool->carveBlock = NULL;
+  pool->carved = 0;
+  pool->numBlocks = 0;
+  pool->inUse = 0;
+
+  unlockPool(pool);
+}
+
+int sbPoolFree(sbpool_t *pool, void *obj) {
+  if(!pool)
+    return SB_FAIL;
+
+  if(!obj)
+    return 0;
+
+  lockPool(pool);
+
+  *(void **)obj = pool->freeList;
+  pool->freeList = obj;
+  pool->inUse--;
+
+  unlockPool(pool);
+
+  return 0;
+}
+
+size_t sbPoolInUse(sbpool_t *pool) {
+  return !pool ? 0 : pool->inUse;
+}
+
+/* Makes every object in the pool available again without freeing them one
+ by one. The blocks are kept for reuse. */
+
+int sbPoolReset(sbpool_t *pool) {
+  if(!pool)
+    return SB_FAIL;
+
+  lockPool(pool);
+
+  pool->freeList = NULL;
+  pool->carveBlock = NULL;
+  pool->carved = 0;
+  pool->inUse = 0;
+
+  unlockPool(pool);
+
+  return 0;
+}
@@ -23,7 +23,7 @@ extern void _free_rpc_node(struct RPC_Node *node);
 
 struct RPC_Node* parse_rpc_string(uchar *str) {
   enum RPC_Error status;
-  struct RPC_Node *node = calloc(1, sizeof *node);
+  struct RPC_Node *node = rpc_new_node();
 
   if(!node)
     return NULL;
@@ -31,7 +31,8 @@ struct RPC_Node* parse_rpc_string(uchar *str) {
   status = _parse_node(&str, node);
 
   if(status != RPC_OK) {
-    free(node);
+    rpc_null(node);
+    rpc_delete_node(node);
     return NULL;
   }
   else
@@ -1,11 +1,21 @@
 #include "serialization.h"
+#include <os/ostypes/sbpool.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define RPC_NODES_PER_BLOCK  128
+
 void _free_rpc_node(struct RPC_Node *node);
 
+/* Standalone nodes are only short-lived: a parsed node is copied into its
+ parent's array of children and then released. They're kept in a pool
+ instead of going through the heap for each one. */
+
+static sbpool_t rpcNodePool = SB_POOL_INITIALIZER(struct RPC_Node,
+                                                  RPC_NODES_PER_BLOCK);
+
 struct RPC_Node* rpc_new_node(void) {
-  struct RPC_Node *node = malloc(sizeof *node);
+  struct RPC_Node *node = sbPoolAlloc(&rpcNodePool);
 
   rpc_null(node);
   return node;
@@ -35,7 +45,7 @@ int rpc_insert_child(struct RPC_Node *node, unsigned long long pos,
   parent->numChildren++;
   parent->children = newChildren;
 
-  free(node);
+  sbPoolFree(&rpcNodePool, node);
 
   return 1;
 }
@@ -52,7 +62,7 @@ void rpc_delete_node(struct RPC_Node *node) {
     return;
 
   _free_rpc_node(node);
-  free(node);
+  sbPoolFree(&rpcNodePool, node);
 }
 
 void rpc_remove_children(struct RPC_Node *node) {
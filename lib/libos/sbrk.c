@@ -7,55 +7,159 @@ size_t heapSize;
 void *heapStart, *heapEnd, *mapEnd;
 
 #define ZERO_DEV	0x00000001u
-#define MIN_MAP_PAGES	16
 
-//extern void mapVirt( void *virt, int pages );
+/* The heap's address range is reserved when the heap is first used, with a
+ read-only mapping of the zero device that keeps other mappings out of it.
 
-extern void print(char *str);
+ Memory is committed (and returned to the init server on trimming) in units:
+ small units until the heap has grown past HEAP_LARGE_THRESHOLD, and large
+ units after that. A large unit is a 4 MB aligned mapping of its own, which
+ the init server backs with large pages when it's first touched. */
 
-/* XXX: This doesn't handle negative increments. */
+#define HEAP_RESERVE		0x10000000u
+#define HEAP_LARGE_THRESHOLD	0x200000u
+#define SMALL_UNIT		(64 * PAGE_SIZE)
+#define LARGE_UNIT		0x400000u
+
+/* Trailing units are only released when at least this much would still be
+ committed above the break, so that a heap that shrinks and grows by a
+ little doesn't map and unmap the same unit over and over. */
+#define HEAP_TRIM_SLACK		0x100000u
+
+static size_t reserveEnd, largeBase;
+
+static size_t alignUp(size_t addr, size_t alignment);
+static void reserveHeap(void);
+static size_t unitEnd(size_t unit);
+static size_t unitStart(size_t end);
+static int commitTo(size_t end);
+static void releaseFrom(size_t end);
+
+static size_t alignUp(size_t addr, size_t alignment) {
+  return (addr + alignment - 1) & ~(alignment - 1);
+}
+
+static void reserveHeap(void) {
+  size_t start = alignUp((size_t)HEAP_START, PAGE_SIZE);
+  size_t end = start + HEAP_RESERVE;
+
+  if(end > HEAP_LIMIT || end < start)
+    end = HEAP_LIMIT;
+
+  heapStart = heapEnd = mapEnd = (void*)start;
+  largeBase = alignUp(start + HEAP_LARGE_THRESHOLD, LARGE_UNIT);
+
+  /* Without a reservation, the heap still works, but it can run into other
+   mappings as it grows. */
+
+  if(end > start && mapMem((addr_t)start, ZERO_DEV, end - start, 0, MEM_FLG_RO) != 0)
+    reserveEnd = end;
+  else
+    reserveEnd = start;
+}
+
+/* Returns the end of the unit that starts at unit. */
+
+static size_t unitEnd(size_t unit) {
+  if(unit >= largeBase)
+    return unit + LARGE_UNIT;
+  else
+    return (unit + SMALL_UNIT < largeBase) ? unit + SMALL_UNIT : largeBase;
+}
+
+/* Returns the start of the unit that ends at end. */
+
+static size_t unitStart(size_t end) {
+  size_t start = (size_t)heapStart;
+
+  if(end > largeBase)
+    return end - LARGE_UNIT;
+  else
+    return start + ((end - start - 1) / SMALL_UNIT) * SMALL_UNIT;
+}
+
+/* Commits units until at least end is committed. Units in the reserved
+ range have their part of the reservation replaced with anonymous memory. */
+
+static int commitTo(size_t end) {
+  while((size_t)mapEnd < end) {
+    size_t unit = (size_t)mapEnd;
+    size_t next = unitEnd(unit);
+
+    if(next > HEAP_LIMIT || next < unit)
+      return -1;
+
+    if(next <= reserveEnd && unmapMem((addr_t)unit, next - unit) != 0)
+      return -1;
+
+    if(mapMem((addr_t)unit, ZERO_DEV, next - unit, 0, 0) == 0) {
+      if(next <= reserveEnd)
+        mapMem((addr_t)unit, ZERO_DEV, next - unit, 0, MEM_FLG_RO);
+
+      return -1;
+    }
+
+    mapEnd = (void*)next;
+  }
+
+  return 0;
+}
+
+/* Returns whole trailing units above end to the init server. Their address
+ range goes back to being reserved. */
+
+static void releaseFrom(size_t end) {
+  size_t releaseEnd = (size_t)mapEnd;
+
+  while((size_t)mapEnd > (size_t)heapStart) {
+    size_t unit = unitStart((size_t)mapEnd);
+
+    if(unit < end + HEAP_TRIM_SLACK)
+      break;
+
+    if(unmapMem((addr_t)unit, (size_t)mapEnd - unit) != 0)
+      break;
+
+    mapEnd = (void*)unit;
+  }
+
+  if((size_t)mapEnd < releaseEnd && releaseEnd <= reserveEnd)
+    mapMem((addr_t)mapEnd, ZERO_DEV, releaseEnd - (size_t)mapEnd, 0, MEM_FLG_RO);
+}
 
 void* sbrk(int increment) {
-  void *prevHeapEnd = heapEnd;
-  size_t pages = 0;
+  void *prevHeapEnd;
+  size_t newEnd;
 
   errno = 0;
 
-  if(!heapEnd) {
-    size_t startAddr = (size_t)HEAP_START;
+  if(!heapEnd)
+    reserveHeap();
 
-    heapEnd = (void*)(
-        (startAddr & (PAGE_SIZE - 1)) == 0 ?
-            startAddr : (startAddr & ~(PAGE_SIZE - 1)) + PAGE_SIZE);
-    heapStart = heapEnd;
-    mapEnd = heapStart;
-  }
+  prevHeapEnd = heapEnd;
 
   if(increment == 0)
     return prevHeapEnd;
 
-  heapEnd = (void*)((unsigned)heapEnd + increment);
-  heapSize += increment;
+  newEnd = (size_t)heapEnd + increment;
 
-  if(heapEnd > mapEnd) {
-    pages = ((size_t)heapEnd / PAGE_SIZE) - ((size_t)mapEnd / PAGE_SIZE) + 1;
-    pages = (pages < MIN_MAP_PAGES ? MIN_MAP_PAGES : pages);
-  }
-
-  if(pages > 0) {
-    if(increment > 0) {
-      if(mapMem((addr_t)mapEnd, ZERO_DEV, PAGE_SIZE * pages, 0, 0) != 0) {
-        errno = -ENOMEM;
-        return (void*)-1;
-      }
-      else {
-        mapEnd = (void*)((size_t)mapEnd + pages * PAGE_SIZE);
-      }
+  if(increment > 0) {
+    if(newEnd < (size_t)heapEnd || commitTo(newEnd) != 0) {
+      errno = ENOMEM;
+      return (void*)-1;
     }
-    else if(increment < 0) {
-      // XXX: Unmap pages
+  }
+  else {
+    if(newEnd < (size_t)heapStart || newEnd > (size_t)heapEnd) {
+      errno = EINVAL;
+      return (void*)-1;
     }
+
+    releaseFrom(newEnd);
   }
 
+  heapEnd = (void*)newEnd;
+  heapSize += increment;
+
   return prevHeapEnd;
 }
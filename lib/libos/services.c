@@ -128,7 +128,7 @@ addr_t mapMem(addr_t addr, int device, size_t length, uint64_t offset,
 
   return
       (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
-          == RESPONSE_OK) ? response.addr : NULL;
+          == RESPONSE_OK) ? response.addr : 0;
 }
 
 int unmapMem(addr_t addr, size_t length) {
@@ -146,6 +146,169 @@ int unmapMem(addr_t addr, size_t length) {
           == RESPONSE_OK) ? 0 : -1;
 }
 
+/* Reserves a stack of at least size bytes with a guard page below it. Pages
+   are only committed when they're touched. Returns the top of the stack. */
+
+addr_t allocStack(size_t size) {
+  struct AllocStackRequest request;
+  struct MapResponse response;
+
+  request.size = size;
+
+  msg_t requestMsg = REQUEST_MSG(ALLOC_STACK, INIT_SERVER_TID, request);
+  msg_t responseMsg = RESPONSE_MSG(response);
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? response.addr : 0;
+}
+
+int freeStack(addr_t stackTop, size_t size) {
+  struct UnmapRequest request;
+
+  request.addr = stackTop;
+  request.length = size;
+
+  msg_t requestMsg = REQUEST_MSG(FREE_STACK, INIT_SERVER_TID, request);
+  msg_t responseMsg = EMPTY_MSG
+  ;
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? 0 : -1;
+}
+
+/* Writes the dirty pages of any file mappings in the range back to their files. */
+
+int syncMem(addr_t addr, size_t length) {
+  struct UnmapRequest request;
+
+  request.addr = addr;
+  request.length = length;
+
+  msg_t requestMsg = REQUEST_MSG(SYNC_MEM, INIT_SERVER_TID, request);
+  msg_t responseMsg = EMPTY_MSG
+  ;
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? 0 : -1;
+}
+
+/* Creates a named region of shared memory. Other processes may only attach it if
+   SHM_OTHERS_READ or SHM_OTHERS_WRITE is set in flags. */
+
+int createShm(const char *name, size_t size, int flags) {
+  struct CreateShmRequest request;
+
+  if(!name)
+    return -1;
+
+  msg_t requestMsg = REQUEST_MSG(CREATE_SHM, INIT_SERVER_TID, request);
+  msg_t responseMsg = EMPTY_MSG
+  ;
+
+  strncpy(request.name, name, sizeof request.name);
+  request.size = size;
+  request.flags = flags;
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? 0 : -1;
+}
+
+addr_t attachShm(const char *name, addr_t addr, int flags) {
+  struct AttachShmRequest request;
+  struct MapResponse response;
+
+  if(!name)
+    return 0;
+
+  msg_t requestMsg = REQUEST_MSG(ATTACH_SHM, INIT_SERVER_TID, request);
+  msg_t responseMsg = RESPONSE_MSG(response);
+
+  strncpy(request.name, name, sizeof request.name);
+  request.addr = addr;
+  request.flags = flags;
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? response.addr : 0;
+}
+
+int detachShm(addr_t addr) {
+  struct UnmapRequest request;
+
+  request.addr = addr;
+  request.length = 0;
+
+  msg_t requestMsg = REQUEST_MSG(DETACH_SHM, INIT_SERVER_TID, request);
+  msg_t responseMsg = EMPTY_MSG
+  ;
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? 0 : -1;
+}
+
+int deleteShm(const char *name) {
+  struct UnregisterNameRequest request;
+
+  if(!name)
+    return -1;
+
+  msg_t requestMsg = REQUEST_MSG(DELETE_SHM, INIT_SERVER_TID, request);
+  msg_t responseMsg = EMPTY_MSG
+  ;
+
+  strncpy(request.name, name, sizeof request.name);
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? 0 : -1;
+}
+
+/* Fills in a report of physical memory usage. The per-address-space counts are those of
+   tid's address space (or the caller's if tid is NULL_TID). */
+
+int getMemoryStats(tid_t tid, struct MemoryStats *stats) {
+  struct MemoryStatsRequest request;
+
+  if(!stats)
+    return -1;
+
+  request.tid = tid;
+
+  msg_t requestMsg = REQUEST_MSG(MEMORY_STATS, INIT_SERVER_TID, request);
+  msg_t responseMsg = RESPONSE_MSG(*stats);
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? 0 : -1;
+}
+
+/* Starts a thread at entry in a copy-on-write clone of the caller's address
+   space. stackTop must lie in a stack mapping of the caller, which the clone
+   gets a private copy of. */
+
+tid_t cloneAddrSpace(addr_t entry, addr_t stackTop) {
+  struct CloneRequest request;
+  struct LookupNameResponse response;
+
+  if(!entry || !stackTop)
+    return NULL_TID;
+
+  request.entry = entry;
+  request.stackTop = stackTop;
+
+  msg_t requestMsg = REQUEST_MSG(CLONE, INIT_SERVER_TID, request);
+  msg_t responseMsg = RESPONSE_MSG(response);
+
+  return
+      (sys_call(&requestMsg, &responseMsg) == ESYS_OK && responseMsg.subject
+          == RESPONSE_OK) ? response.tid : NULL_TID;
+}
+
 pid_t createPort(pid_t pid, int flags) {
   struct CreatePortRequest request;
   struct CreatePortResponse response;
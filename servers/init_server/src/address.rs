@@ -15,6 +15,9 @@ pub type FrameOffset = u32;
 
 pub const NULL_VADDR: VAddr = ptr::null();
 
+/// 1 + the highest user space address. The kernel is mapped from here to the end of memory.
+pub const USER_VEND: usize = 0xC0000000;
+
 fn difference<T: Sub<Output=T> + Ord>(a: T, b: T) -> (T, Ordering) {
     match a.cmp(&b)
     {
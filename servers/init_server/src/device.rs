@@ -1,14 +1,20 @@
 use crate::page::{PhysicalPage, VirtualPage};
 use crate::error::{self, Error};
 use core::prelude::v1::*;
-use crate::lowlevel::phys;
 use core::convert::TryFrom;
 use crate::phys_alloc::{self, BlockSize};
+use crate::address::PAddr;
+use crate::lowlevel::phys;
 use crate::{eprintln, println};
+use crate::file_map;
+use crate::shm;
 
 type DeviceMajor = u16;
 type DeviceMinor = u16;
 
+static mut ZERO_FRAME: Option<PAddr> = None;
+static mut ZERO_FRAME_MAPPINGS: usize = 0;
+
 pub mod manager {
     use alloc::collections::btree_map::BTreeMap;
     use super::DeviceMajor;
@@ -68,6 +74,13 @@ pub mod mem {
     pub const PMEM_MINOR: DeviceMinor = 0;
 }
 
+pub mod shared {
+    use super::DeviceMajor;
+
+    /// Each minor of this device is a named shared memory region (see `shm`)
+    pub const MAJOR: DeviceMajor = 2;
+}
+
 pub mod pseudo {
     use super::DeviceMajor;
     use crate::device::DeviceMinor;
@@ -120,9 +133,184 @@ impl From<DeviceId> for i32 {
     }
 }
 
-/// Read a block from a device into a physical page
+/// A cache of the frames that hold device pages, keyed by device and page-aligned offset.
+/// Every mapping of the same device page shares one frame. Each cached page counts the
+/// number of times it's mapped and is dropped when the last mapping goes away.
+
+pub mod page_cache {
+    use super::DeviceId;
+    use crate::address::PAddr;
+    use crate::page::{PhysicalPage, VirtualPage};
+    use crate::error::Error;
+    use crate::phys_alloc::{self, BlockSize};
+    use alloc::collections::btree_map::BTreeMap;
+    use alloc::vec::Vec;
+
+    struct CachedPage {
+        frame: PAddr,
+        refs: usize,
+        /// Set if the frame was allocated for the cache (as opposed to belonging to the device)
+        owns_frame: bool,
+    }
+
+    static mut PAGE_CACHE: Option<BTreeMap<(u32, u64), CachedPage>> = None;
+    static mut HITS: usize = 0;
+    static mut MISSES: usize = 0;
+
+    fn cache() -> &'static mut BTreeMap<(u32, u64), CachedPage> {
+        unsafe {
+            PAGE_CACHE.get_or_insert_with(BTreeMap::new)
+        }
+    }
+
+    fn key(vpage: &VirtualPage) -> (u32, u64) {
+        (u32::from(vpage.device.clone()), vpage.offset - vpage.offset % VirtualPage::SMALL_PAGE_SIZE as u64)
+    }
+
+    /// Returns the cached frame for a page and adds a reference to it. On a miss, the
+    /// page is read with `read` and then cached.
+
+    pub fn get(vpage: &VirtualPage, owns_frame: bool, read: fn(&VirtualPage) -> Result<PhysicalPage, Error>)
+        -> Result<PhysicalPage, Error> {
+        let key = key(vpage);
+
+        if let Some(cached) = cache().get_mut(&key) {
+            unsafe { HITS += 1; }
+            cached.refs += 1;
+            return Ok(PhysicalPage::new(cached.frame));
+        }
+
+        unsafe { MISSES += 1; }
+
+        let page = read(vpage)?;
+
+        cache().insert(key, CachedPage {
+            frame: page.as_address(),
+            refs: 1,
+            owns_frame,
+        });
+
+        Ok(page)
+    }
+
+    /// Adds a reference to a page that's already cached. Returns `false` if it isn't cached.
+
+    pub fn add_ref(vpage: &VirtualPage) -> bool {
+        match cache().get_mut(&key(vpage)) {
+            Some(cached) => {
+                cached.refs += 1;
+                true
+            },
+            None => false,
+        }
+    }
+
+    /// Returns `true` if a page is in the cache
+
+    pub fn contains(vpage: &VirtualPage) -> bool {
+        cache().contains_key(&key(vpage))
+    }
+
+    /// Returns the frame that's cached for a page
+
+    pub fn frame(vpage: &VirtualPage) -> Option<PAddr> {
+        cache().get(&key(vpage))
+            .map(|cached| cached.frame)
+    }
+
+    /// Caches a page that was read ahead of time. It has no references until it's
+    /// mapped. Returns `false` (and leaves the frame to the caller) if the page is
+    /// already cached.
+
+    pub fn insert_unreferenced(vpage: &VirtualPage, frame: PAddr) -> bool {
+        let key = key(vpage);
+
+        if cache().contains_key(&key) {
+            false
+        } else {
+            cache().insert(key, CachedPage {
+                frame,
+                refs: 0,
+                owns_frame: true,
+            });
+            true
+        }
+    }
+
+    /// Frees up to `target` cached pages that were read ahead, but never mapped.
+    /// Returns the number of pages that were freed.
+
+    pub fn drop_unreferenced(target: usize) -> usize {
+        let unused = cache().iter()
+            .filter(|(_, cached)| cached.refs == 0)
+            .map(|(key, _)| *key)
+            .take(target)
+            .collect::<Vec<(u32, u64)>>();
+
+        for key in unused.iter() {
+            if let Some(cached) = cache().remove(key) {
+                if cached.owns_frame {
+                    phys_alloc::release_phys(cached.frame, BlockSize::Block4k);
+                }
+            }
+        }
+
+        unused.len()
+    }
+
+    /// Drops a reference to a cached page. The page is removed from the cache (and its
+    /// frame is freed, if the cache allocated it) once the last reference is gone.
+
+    pub fn release(vpage: &VirtualPage) {
+        let key = key(vpage);
+
+        let is_unused = match cache().get_mut(&key) {
+            Some(cached) => {
+                cached.refs -= 1;
+                cached.refs == 0
+            },
+            None => false,
+        };
+
+        if is_unused {
+            if let Some(cached) = cache().remove(&key) {
+                if cached.owns_frame {
+                    phys_alloc::release_phys(cached.frame, BlockSize::Block4k);
+                }
+            }
+        }
+    }
+
+    /// Returns the number of cached pages along with the number of cache hits and misses.
+
+    pub fn stats() -> (usize, usize, usize) {
+        unsafe { (cache().len(), HITS, MISSES) }
+    }
+}
+
+/// Pages of the pseudo devices are never cached: /dev/zero pages are private and
+/// /dev/null can't be read. Shared memory regions keep track of their own frames.
+
+fn is_cacheable(vpage: &VirtualPage) -> bool {
+    vpage.device.major != pseudo::MAJOR && vpage.device.major != shared::MAJOR
+}
+
+/// Read a block from a device into a physical page. Device pages are shared through the page
+/// cache, so the page must eventually be passed to `release_page()`.
 
 pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
+    if is_cacheable(vpage) {
+        // Reads from /dev/pmem return the device's own frame
+
+        let owns_frame = !(vpage.device.major == mem::MAJOR && vpage.device.minor == mem::PMEM_MINOR);
+
+        page_cache::get(vpage, owns_frame, read_device_page)
+    } else {
+        read_device_page(vpage)
+    }
+}
+
+fn read_device_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
     let major = vpage.device.major;
     let minor = vpage.device.minor;
 
@@ -132,15 +320,144 @@ pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
                 pseudo::NULL_MINOR => Err(error::ZERO_LENGTH),   // handle a read from /dev/null
                 pseudo::ZERO_MINOR => {  // handle a read from /dev/zero
 
-                    phys_alloc::alloc_phys(BlockSize::Block4k)
+                    phys_alloc::zero_pool::alloc_zeroed(BlockSize::Block4k)
                         .map_err(|_| { error::OUT_OF_MEMORY })
-                        .and_then(|(new_addr, _)| {
+                        .map(|(new_addr, _)| PhysicalPage::new(new_addr))
+                },
+                _ => {
+                    Err(error::DEVICE_NOT_EXIST)
+                }
+            }
+        },
+        mem::MAJOR => {
+            match minor {
+                mem::PMEM_MINOR => {  // handle a read from /dev/pmem
+                    PhysicalPage::try_from(vpage.offset)
+                        .map_err(|_| error::DEVICE_NOT_EXIST)
+                },
+                _ => {  // handle reads from ramdisk
+                    Err(error::DEVICE_NOT_EXIST)
+                }
+            }
+        }
+        shared::MAJOR => shm::read_page(vpage),
+        _ if file_map::is_driver_backed(vpage) => file_map::read_page(vpage),
+        _ =>
+            Err(error::NOT_IMPLEMENTED)
+    }
+}
+
+/// Returns `true` if the page belongs to /dev/zero
+
+pub fn is_zero_page(vpage: &VirtualPage) -> bool {
+    vpage.device.major == pseudo::MAJOR && vpage.device.minor == pseudo::ZERO_MINOR
+}
+
+/// Returns the frame that backs every read-only page of /dev/zero. It's allocated and
+/// cleared on first use.
+
+pub fn zero_frame() -> Result<PAddr, Error> {
+    unsafe {
+        match ZERO_FRAME {
+            Some(frame) => Ok(frame),
+            None => {
+                let frame = read_page(&VirtualPage::new(DeviceId::new_from_tuple((pseudo::MAJOR, pseudo::ZERO_MINOR)), 0, 0))?
+                    .as_address();
+
+                ZERO_FRAME = Some(frame);
+                Ok(frame)
+            }
+        }
+    }
+}
 
-                            unsafe {
-                                phys::clear_frame(new_addr)
-                                    .map(|_| PhysicalPage::new(new_addr))
-                            }
-                        })
+pub fn is_zero_frame(frame: PAddr) -> bool {
+    unsafe { ZERO_FRAME == Some(frame) }
+}
+
+/// Returns the number of pages that are currently backed by the shared zero frame. Each one
+/// is a frame that didn't have to be allocated.
+
+pub fn zero_frame_mappings() -> usize {
+    unsafe { ZERO_FRAME_MAPPINGS }
+}
+
+/// Read a page that will be mapped read-only. Pages of /dev/zero are backed by the shared zero
+/// frame instead of a new frame.
+
+pub fn read_page_shared(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
+    if is_zero_page(vpage) {
+        zero_frame()
+            .map(|frame| {
+                unsafe { ZERO_FRAME_MAPPINGS += 1; }
+                PhysicalPage::new(frame)
+            })
+    } else {
+        read_page(vpage)
+    }
+}
+
+/// Returns `true` if `read_page()` returns a newly allocated frame for the page, rather than
+/// a frame that belongs to the device itself (as with /dev/pmem)
+
+pub fn is_private_page(vpage: &VirtualPage) -> bool {
+    is_zero_page(vpage)
+}
+
+/// Returns `true` if `frame` is the page cache's frame for the page. A page that was copied
+/// on write is backed by a private frame instead, even though its device is cacheable.
+
+fn is_cached_frame(vpage: &VirtualPage, frame: PAddr) -> bool {
+    is_cacheable(vpage) && page_cache::frame(vpage) == Some(frame)
+}
+
+/// Adds a reference to a page that's about to be mapped into another address space
+
+pub fn share_page(vpage: &VirtualPage, page: &PhysicalPage) {
+    let frame = page.as_address();
+
+    if is_zero_frame(frame) {
+        unsafe { ZERO_FRAME_MAPPINGS += 1; }
+    } else if is_cached_frame(vpage, frame) {
+        page_cache::add_ref(vpage);
+    } else {
+        phys_alloc::share_frame(frame);
+    }
+}
+
+/// Release a physical page that was returned by `read_page()` or `read_page_shared()`, but
+/// was never mapped (or is no longer mapped). Shared pages are only freed once their last
+/// reference is released.
+
+pub fn release_page(vpage: &VirtualPage, page: &PhysicalPage) {
+    let frame = page.as_address();
+
+    if is_zero_frame(frame) {
+        unsafe { ZERO_FRAME_MAPPINGS = ZERO_FRAME_MAPPINGS.saturating_sub(1); }
+    } else if is_cached_frame(vpage, frame) {
+        page_cache::release(vpage);
+    } else if phys_alloc::frame_ref_count(frame) > 1 {
+        phys_alloc::unshare_frame(frame);
+    } else if is_private_page(vpage) || is_cacheable(vpage) {
+        // Either a /dev/zero page or a private copy of a cached page
+
+        phys_alloc::release_phys(frame, BlockSize::Block4k);
+    }
+}
+
+/// Read a block from a device into a page that the caller has already allocated. Unlike
+/// `read_page()`, this bypasses the page cache, so the page remains owned by the caller.
+
+pub fn read_page_into(vpage: &VirtualPage, page: &PhysicalPage) -> Result<(), Error> {
+    let major = vpage.device.major;
+    let minor = vpage.device.minor;
+
+    match major {
+        pseudo::MAJOR => {
+            match minor {
+                pseudo::NULL_MINOR => Err(error::ZERO_LENGTH),   // handle a read from /dev/null
+                pseudo::ZERO_MINOR => unsafe {  // handle a read from /dev/zero
+                    phys::clear_frame(page.as_address())
                 },
                 _ => {
                     Err(error::DEVICE_NOT_EXIST)
@@ -152,12 +469,14 @@ pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
                 mem::PMEM_MINOR => {  // handle a read from /dev/pmem
                     PhysicalPage::try_from(vpage.offset)
                         .map_err(|_| error::DEVICE_NOT_EXIST)
+                        .and_then(|src| unsafe { phys::copy_frame(page.as_address(), src.as_address()) })
                 },
                 _ => {  // handle reads from ramdisk
                     Err(error::DEVICE_NOT_EXIST)
                 }
             }
         }
+        _ if file_map::is_driver_backed(vpage) => file_map::read_pages_into(vpage, &[page.as_address()]),
         _ =>
             Err(error::NOT_IMPLEMENTED)
     }
@@ -165,7 +484,7 @@ pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
 
 /// Write a physical page to a block on a device
 
-pub fn write_page(vpage: &VirtualPage, _page: &PhysicalPage) -> Result<(), Error> {
+pub fn write_page(vpage: &VirtualPage, page: &PhysicalPage) -> Result<(), Error> {
     let major = vpage.device.major;
     let minor = vpage.device.minor;
 
@@ -189,6 +508,7 @@ pub fn write_page(vpage: &VirtualPage, _page: &PhysicalPage) -> Result<(), Error
                 }
             }
         }
+        _ if file_map::is_driver_backed(vpage) => file_map::write_page(vpage, page.as_address()),
         _ =>
             Err(error::NOT_IMPLEMENTED)
     }
@@ -109,10 +109,7 @@ pub mod loader {
                     let pmem_device = DeviceId::new_from_tuple((device::mem::MAJOR, device::mem::PMEM_MINOR));
                     let zero_device = DeviceId::new_from_tuple((device::pseudo::MAJOR, device::pseudo::ZERO_MINOR));
 
-                    addr_space.map(Some((stack_top - stack_size) as VAddr),
-                                   &zero_device, 0, AddrSpace::EXTEND_DOWN | AddrSpace::NO_EXECUTE, stack_size);
-                    addr_space.map(Some((stack_top - stack_size - VirtualPage::SMALL_PAGE_SIZE) as VAddr),
-                                   &zero_device, 0, AddrSpace::GUARD | AddrSpace::NO_EXECUTE, VirtualPage::SMALL_PAGE_SIZE);
+                    addr_space.map_stack(Some(stack_top as VAddr), stack_size);
 
                     for ph_index in 0..header.phnum {
                         pheader_option = unsafe {
@@ -127,7 +124,8 @@ pub mod loader {
                                 AddrSpace::READ_ONLY
                             } else if pheader.flags == RawProgramHeader32::WRITE
                                 || pheader.flags == (RawProgramHeader32::READ | RawProgramHeader32::WRITE) {
-                                AddrSpace::NO_EXECUTE
+                                // Writable segments are backed by the module's pages, so they're private copies
+                                AddrSpace::NO_EXECUTE | AddrSpace::COPY_ON_WRITE
                             } else {
                                 0
                             };
@@ -155,7 +153,7 @@ pub mod loader {
     pub fn load_module(module: &BootModule) -> Result<Tid, ()> {
         let stack_top = 0xC0000000usize;
         let stack_size = 4096*1024usize;
-        let pmap = phys_alloc::alloc_phys(BlockSize::Block4k)
+        let pmap = phys_alloc::alloc_phys_low(BlockSize::Block4k)
             .map(|(addr, _)| addr)
             .map_err(|_| ())?;
 
@@ -181,10 +179,7 @@ pub mod loader {
 
                         addr_space.attach_thread(tid.clone());
 
-                        addr_space.map(Some((stack_top - stack_size + VirtualPage::SMALL_PAGE_SIZE) as VAddr),
-                                       &zero_device, 0, AddrSpace::EXTEND_DOWN | AddrSpace::NO_EXECUTE, stack_size - VirtualPage::SMALL_PAGE_SIZE);
-                        addr_space.map(Some((stack_top - stack_size) as VAddr),
-                                       &zero_device, 0, AddrSpace::GUARD | AddrSpace::NO_EXECUTE, VirtualPage::SMALL_PAGE_SIZE);
+                        addr_space.map_stack(Some(stack_top as VAddr), stack_size - VirtualPage::SMALL_PAGE_SIZE);
 
                         for ph_index in 0..header.phnum {
                             pheader_option = unsafe {
@@ -199,7 +194,8 @@ pub mod loader {
                                     AddrSpace::READ_ONLY
                                 } else if pheader.flags == RawProgramHeader32::WRITE
                                     || pheader.flags == (RawProgramHeader32::READ | RawProgramHeader32::WRITE) {
-                                    AddrSpace::NO_EXECUTE
+                                    // Writable segments are backed by the module's pages, so they're private copies
+                                    AddrSpace::NO_EXECUTE | AddrSpace::COPY_ON_WRITE
                                 } else {
                                     0
                                 };
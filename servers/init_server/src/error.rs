@@ -32,6 +32,8 @@ pub const DEVICE_NOT_EXIST: Error = 271;
 pub const END_OF_FILE: Error = 272;
 pub const PARSE_ERROR: Error = 273;
 pub const BAD_ARGUMENT: Error = 274;
+pub const ACCESS_DENIED: Error = 275;
+pub const IO_PENDING: Error = 276;
 
 pub fn log_error(code: Error, arg: Option<String>) {
     let explanation = match code {
@@ -61,6 +63,8 @@ pub fn log_error(code: Error, arg: Option<String>) {
         END_OF_FILE => "End of file",
         PARSE_ERROR => "Parse error",
         BAD_ARGUMENT => "Bad argument",
+        ACCESS_DENIED => "Access denied",
+        IO_PENDING => "Waiting for a driver to respond",
         _ => "Something went wrong"
     };
 
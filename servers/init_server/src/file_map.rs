@@ -0,0 +1,389 @@
+#![allow(dead_code)]
+
+//! Memory-mapped files. A server that provides files (e.g. a filesystem) registers itself
+//! as the driver of a device major and exposes each file as a minor of that device, so a
+//! file is mapped by mapping its device id. Pages of such a mapping are read from the
+//! driver with DEVICE_READ requests when they're faulted in and are written back with
+//! DEVICE_WRITE requests when they're unmapped or synced.
+//!
+//! Faults never wait for a driver on the main thread. A fault on a page that isn't in the
+//! page cache starts a read on the I/O thread and leaves the faulting thread blocked. When
+//! the I/O thread reports back, the pages go into the page cache and the fault is handled
+//! again.
+
+use crate::error::{self, Error};
+use crate::device::{self, page_cache};
+use crate::mapping::{AddrSpace, AddressMapping};
+use crate::message::{self, RawMessage};
+use crate::message::device::{RawDeviceOpRequest, DEVICE_READ, DEVICE_WRITE};
+use alloc::collections::btree_map::BTreeMap;
+use alloc::vec::Vec;
+use crate::address::{Align, PAddr, VAddr};
+use crate::page::{PhysicalPage, VirtualPage};
+use crate::phys_alloc::{self, BlockSize};
+use crate::lowlevel::phys;
+use crate::reclaim;
+use crate::syscall::{c_types::PageMapping, flags::page_mapping};
+use crate::Tid;
+use core::{cmp, mem};
+
+const PAGE_SIZE: usize = VirtualPage::SMALL_PAGE_SIZE;
+
+/// The default number of pages that are read ahead once faults on a file become sequential
+const DEFAULT_READ_AHEAD_PAGES: usize = 32;
+
+/// A read-ahead request must fit within the page map area along with everything else
+pub const MAX_READ_AHEAD_PAGES: usize = 256;
+
+static mut READ_AHEAD_PAGES: usize = DEFAULT_READ_AHEAD_PAGES;
+
+/// Identifies a read that was handed to the I/O thread
+pub type ReadId = u32;
+
+/// Consecutive pages of a file that the I/O thread is reading. The frames belong to the
+/// main thread; the I/O thread only fills them in.
+struct PendingRead {
+    vpage: VirtualPage,
+    frames: Vec<PAddr>,
+}
+
+static mut PENDING_READS: Option<BTreeMap<ReadId, PendingRead>> = None;
+static mut NEXT_READ_ID: ReadId = 0;
+
+fn pending_reads() -> &'static mut BTreeMap<ReadId, PendingRead> {
+    unsafe {
+        PENDING_READS.get_or_insert_with(BTreeMap::new)
+    }
+}
+
+/// Sets the number of pages that are read ahead of a sequential fault
+
+pub fn set_read_ahead(pages: usize) {
+    unsafe {
+        READ_AHEAD_PAGES = cmp::min(cmp::max(pages, 1), MAX_READ_AHEAD_PAGES);
+    }
+}
+
+pub fn read_ahead_pages() -> usize {
+    unsafe { READ_AHEAD_PAGES }
+}
+
+/// Returns `true` if a page belongs to a device that's provided by a driver (as opposed to
+/// one of the devices that the init server implements itself).
+
+pub fn is_driver_backed(vpage: &VirtualPage) -> bool {
+    vpage.device.major != device::pseudo::MAJOR
+        && vpage.device.major != device::mem::MAJOR
+        && device::manager::lookup(&vpage.device.major).is_some()
+}
+
+fn driver_tid(vpage: &VirtualPage) -> Result<Tid, Error> {
+    device::manager::lookup(&vpage.device.major)
+        .cloned()
+        .ok_or(error::DEVICE_NOT_EXIST)
+}
+
+fn page_offset(vpage: &VirtualPage) -> u64 {
+    vpage.offset - vpage.offset % PAGE_SIZE as u64
+}
+
+fn read_request(vpage: &VirtualPage, page_count: usize) -> RawDeviceOpRequest {
+    RawDeviceOpRequest {
+        device_minor: vpage.device.minor,
+        offset: page_offset(vpage),
+        length: page_count * PAGE_SIZE,
+        flags: 0,
+    }
+}
+
+/// Reads consecutive pages of a file, starting at `vpage`, into `frames` with a single
+/// request. Anything past the end of the file reads as zeros. This waits for the driver,
+/// so page faults go through `start_read()` instead.
+
+pub fn read_pages_into(vpage: &VirtualPage, frames: &[PAddr]) -> Result<(), Error> {
+    let driver = driver_tid(vpage)?;
+
+    read_from_driver(&driver, &read_request(vpage, frames.len()), frames)
+}
+
+fn read_from_driver(driver: &Tid, request: &RawDeviceOpRequest, frames: &[PAddr]) -> Result<(), Error> {
+    let mut buffer = unsafe { phys::PageMapArea::new_from_frames(frames) }
+        .ok_or(error::OPERATION_FAILED)?;
+
+    let (subject, bytes_read) = message::call_buffers(driver, DEVICE_READ, request.as_bytes(),
+                                                      buffer.as_mut())?;
+
+    if subject != RawMessage::RESPONSE_OK {
+        return Err(error::OPERATION_FAILED);
+    }
+
+    let bytes_read = cmp::min(bytes_read, buffer.len());
+    buffer.as_mut()[bytes_read..].fill(0);
+
+    Ok(())
+}
+
+/// Called by the page cache on a miss. The main thread never waits for a driver, so this
+/// only reports `IO_PENDING`; the fault that needed the page waits for `start_read()`.
+
+pub fn read_page(_vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
+    Err(error::IO_PENDING)
+}
+
+/// Returns the pending read that includes `vpage`
+
+fn pending_read_of(vpage: &VirtualPage) -> Option<ReadId> {
+    let offset = page_offset(vpage);
+
+    pending_reads().iter()
+        .find(|(_, read)| read.vpage.device == vpage.device
+            && offset >= page_offset(&read.vpage)
+            && offset - page_offset(&read.vpage) < (read.frames.len() * PAGE_SIZE) as u64)
+        .map(|(&id, _)| id)
+}
+
+/// Hands a read of the page at `fault_page` to the I/O thread. Once faults become
+/// sequential (`window > 1`), the pages that follow are read along with it. Read-ahead
+/// stops at the first page that's already cached or being read, or at the end of the
+/// mapping. If the page is already being read, the id of that read is returned.
+
+pub fn start_read(mapping: &AddressMapping, fault_page: usize, window: usize) -> Result<ReadId, Error> {
+    let vpage_at = |addr: usize| mapping.base_page.add_offset((addr - mapping.region.start()) as u64);
+    let vpage = vpage_at(fault_page);
+
+    if let Some(id) = pending_read_of(&vpage) {
+        return Ok(id);
+    }
+
+    let driver = driver_tid(&vpage)?;
+
+    // Last page of the mapping (a region end of 0 means the end of memory)
+    let last_page = mapping.region.end().wrapping_sub(1).align_trunc(PAGE_SIZE);
+
+    let max_pages = if window > 1 && mapping.flags & AddrSpace::EXTEND_DOWN == 0 {
+        cmp::max(window, read_ahead_pages())
+    } else {
+        1
+    };
+
+    let page_count = 1 + (1..max_pages)
+        .filter_map(|i| fault_page.checked_add(i * PAGE_SIZE))
+        .take_while(|&page| page <= last_page)
+        .map(|page| vpage_at(page))
+        .take_while(|vpage| !page_cache::contains(vpage) && pending_read_of(vpage).is_none())
+        .count();
+
+    let frames = phys_alloc::alloc_phys_many(page_count);
+
+    if frames.is_empty() {
+        return Err(error::OUT_OF_MEMORY);
+    }
+
+    let id = unsafe {
+        NEXT_READ_ID = NEXT_READ_ID.wrapping_add(1);
+        NEXT_READ_ID
+    };
+
+    io::submit(io::IoRequest {
+        id,
+        driver,
+        request: read_request(&vpage, frames.len()),
+        frames: frames.clone(),
+    });
+
+    pending_reads().insert(id, PendingRead {
+        vpage,
+        frames,
+    });
+
+    Ok(id)
+}
+
+/// Finishes a read once the I/O thread reports back. The pages are added to the page cache
+/// without any references, so the faults that waited for them find them there. Returns
+/// `false` if the read failed.
+
+pub fn complete_read(id: ReadId, result: Result<(), Error>) -> bool {
+    let read = match pending_reads().remove(&id) {
+        Some(read) => read,
+        None => return false,
+    };
+
+    for (i, frame) in read.frames.into_iter().enumerate() {
+        let vpage = read.vpage.add_offset((i * PAGE_SIZE) as u64);
+
+        if result.is_err() || !page_cache::insert_unreferenced(&vpage, frame) {
+            phys_alloc::release_phys(frame, BlockSize::Block4k);
+        }
+    }
+
+    result.is_ok()
+}
+
+/// Writes a page of a file back to its driver
+
+pub fn write_page(vpage: &VirtualPage, frame: PAddr) -> Result<(), Error> {
+    let driver = driver_tid(vpage)?;
+    let header_len = mem::size_of::<RawDeviceOpRequest>();
+
+    let request = RawDeviceOpRequest {
+        device_minor: vpage.device.minor,
+        offset: page_offset(vpage),
+        length: PAGE_SIZE,
+        flags: 0,
+    };
+
+    let mut buffer = vec![0u8; header_len + PAGE_SIZE];
+
+    buffer[..header_len].copy_from_slice(request.as_bytes());
+    phys::peek(frame, &mut buffer[header_len..])
+        .map_err(|_| error::OPERATION_FAILED)?;
+
+    let mut bytes_written = [0u8; mem::size_of::<usize>()];
+
+    match message::call_buffers(&driver, DEVICE_WRITE, &buffer, &mut bytes_written)? {
+        (RawMessage::RESPONSE_OK, _) => Ok(()),
+        _ => Err(error::OPERATION_FAILED),
+    }
+}
+
+/// Writes every dirty page of a file mapping in `[start, end)` back to its driver and
+/// marks it clean. Private (copy-on-write) mappings are never written back. Returns the
+/// number of pages that were written.
+
+pub fn write_back(addr_space: &mut AddrSpace, start: VAddr, end: VAddr) -> Result<usize, Error> {
+    let root_pmap = addr_space.root_pmap();
+    let end = (end as usize).align(PAGE_SIZE);
+    let mut next_page = (start as usize).align_trunc(PAGE_SIZE);
+    let mut written = 0;
+
+    while let Some((page, frame)) = addr_space.next_resident(next_page).filter(|&(page, _)| page < end) {
+        next_page = page + PAGE_SIZE;
+
+        let vpage = match addr_space.get_mapping(page as VAddr) {
+            Some(mapping) if mapping.flags & AddrSpace::COPY_ON_WRITE == 0
+                && is_driver_backed(&mapping.base_page) =>
+                mapping.base_page.add_offset((page - mapping.region.start()) as u64),
+            _ => continue,
+        };
+
+        let entry = match reclaim::read_pte(root_pmap, page) {
+            Some(entry) if entry.flags & page_mapping::DIRTY == page_mapping::DIRTY => entry,
+            _ => continue,
+        };
+
+        // Clear the dirty bit first, so that a write made while the page is being written
+        // back marks it dirty again
+
+        reclaim::write_pte(root_pmap, page, PageMapping {
+            frame: entry.frame,
+            flags: entry.flags & !page_mapping::DIRTY,
+        });
+
+        if let Err(code) = write_page(&vpage, frame) {
+            reclaim::write_pte(root_pmap, page, entry);
+            return Err(code);
+        }
+
+        written += 1;
+    }
+
+    Ok(written)
+}
+
+/// The I/O thread. It sends read requests to drivers on behalf of the main thread, so that
+/// a slow (or stuck) driver only holds up the threads that are waiting for its pages.
+
+pub mod io {
+    use super::{read_from_driver, ReadId};
+    use crate::address::PAddr;
+    use crate::message::{self, Message};
+    use crate::message::device::{RawDeviceOpRequest, RawIoComplete};
+    use crate::syscall::{self, INIT_TID};
+    use crate::Tid;
+    use alloc::collections::VecDeque;
+    use alloc::vec::Vec;
+
+    pub struct IoRequest {
+        pub id: ReadId,
+        pub driver: Tid,
+        pub request: RawDeviceOpRequest,
+        pub frames: Vec<PAddr>,
+    }
+
+    static mut QUEUE_LOCK: i32 = 0;
+    static mut QUEUE: Option<VecDeque<IoRequest>> = None;
+    static mut IS_WAITING: bool = false;
+    static mut IO_TID: Option<Tid> = None;
+
+    #[link(name="os_init", kind="static")]
+    extern "C" {
+        fn mutex_lock(lock: *mut i32) -> i32;
+        fn mutex_unlock(lock: *mut i32) -> i32;
+    }
+
+    fn with_queue<T>(f: impl FnOnce(&mut VecDeque<IoRequest>, &mut bool) -> T) -> T {
+        unsafe {
+            while mutex_lock(&mut QUEUE_LOCK) != 0 {
+                syscall::sys_sleep(0);
+            }
+
+            let result = f(QUEUE.get_or_insert_with(VecDeque::new), &mut IS_WAITING);
+
+            while mutex_unlock(&mut QUEUE_LOCK) != 0 {}
+            result
+        }
+    }
+
+    pub fn set_thread(tid: Tid) {
+        unsafe {
+            IO_TID = Some(tid);
+        }
+    }
+
+    pub fn is_io_thread(tid: &Tid) -> bool {
+        unsafe { IO_TID.as_ref() == Some(tid) }
+    }
+
+    /// Queues a request for the I/O thread and wakes it up if it's idle
+
+    pub fn submit(request: IoRequest) {
+        let wake = with_queue(|queue, is_waiting| {
+            queue.push_back(request);
+            core::mem::replace(is_waiting, false)
+        });
+
+        if wake {
+            if let Some(tid) = unsafe { IO_TID.as_ref() } {
+                let _ = Message::<()>::new(0, None, 0).send(tid);
+            }
+        }
+    }
+
+    pub fn io_main() -> ! {
+        let init_tid = Tid::new(INIT_TID);
+
+        loop {
+            let next = with_queue(|queue, is_waiting| {
+                let next = queue.pop_front();
+                *is_waiting = next.is_none();
+                next
+            });
+
+            let request = match next {
+                Some(request) => request,
+                None => {
+                    let _ = message::receive::<()>(&init_tid, 0);
+                    continue;
+                }
+            };
+
+            let status = match read_from_driver(&request.driver, &request.request, &request.frames) {
+                Ok(_) => 0,
+                Err(code) => code,
+            };
+
+            let _ = RawIoComplete::new_message(request.id, status).send(&init_tid);
+        }
+    }
+}
@@ -0,0 +1,353 @@
+#![allow(dead_code)]
+
+use crate::error;
+use crate::syscall;
+use crate::syscall::flags::map::{READ_ONLY, READ_WRITE, NO_EXECUTE, OVERWRITE, PM_LARGE_PAGE};
+use crate::mapping::{self, AddrSpace, AddressMapping};
+use crate::address::{Align, PAddr, VAddr};
+use crate::device;
+use crate::page::{PhysicalPage, VirtualPage};
+use crate::phys_alloc::{self, BlockSize};
+use crate::lowlevel::phys;
+use alloc::collections::btree_set::BTreeSet;
+use alloc::string::String;
+use alloc::vec::Vec;
+use core::ffi::c_void;
+
+/// Anonymous memory is promoted in blocks of this size. A block is mapped with one large
+/// page when using PSE and two when using PAE.
+pub const LARGE_BLOCK_SIZE: usize = BlockSize::Block4M.bytes() as usize;
+
+const LARGE_PAGES_PER_BLOCK: usize = LARGE_BLOCK_SIZE / VirtualPage::LARGE_PAGE_SIZE;
+const SMALL_PAGES_PER_BLOCK: usize = LARGE_BLOCK_SIZE / VirtualPage::SMALL_PAGE_SIZE;
+
+/// Blocks (root page map, block address) that have been faulted in with small pages and
+/// may be collapsed into large pages once they're fully populated.
+static mut COLLAPSE_CANDIDATES: Option<BTreeSet<(PAddr, usize)>> = None;
+
+fn candidates() -> &'static mut BTreeSet<(PAddr, usize)> {
+    unsafe {
+        COLLAPSE_CANDIDATES.get_or_insert_with(BTreeSet::new)
+    }
+}
+
+/// Returns `true` if a mapping can be backed by large pages. Only private, writable
+/// anonymous memory qualifies.
+
+fn is_eligible(mapping: &AddressMapping) -> bool {
+    mapping.flags & (AddrSpace::READ_ONLY | AddrSpace::COPY_ON_WRITE | AddrSpace::GUARD
+        | AddrSpace::EXTEND_DOWN) == 0
+        && device::is_zero_page(&mapping.base_page)
+}
+
+/// Returns the address of the block that contains `addr` if the block lies entirely
+/// within the mapping.
+
+fn block_in_mapping(mapping: &AddressMapping, addr: usize) -> Option<usize> {
+    let block = addr.align_trunc(LARGE_BLOCK_SIZE);
+    let block_last = block.checked_add(LARGE_BLOCK_SIZE - 1)?;
+
+    if is_eligible(mapping) && mapping.region.contains(block) && mapping.region.contains(block_last) {
+        Some(block)
+    } else {
+        None
+    }
+}
+
+fn page_flags(mapping: &AddressMapping) -> u32 {
+    if mapping.flags & AddrSpace::NO_EXECUTE == AddrSpace::NO_EXECUTE {
+        NO_EXECUTE
+    } else {
+        0
+    }
+}
+
+/// Handles a write fault by backing the whole block around `fault_page` with a zeroed
+/// large frame. Returns `Ok(false)` if the block isn't eligible or no large frame is
+/// available, in which case the fault should be handled with small pages.
+
+pub fn fault_large(addr_space: &mut AddrSpace, mapping: &AddressMapping, fault_page: usize)
+                   -> Result<bool, (error::Error, Option<String>)> {
+    let block = match block_in_mapping(mapping, fault_page) {
+        Some(block) => block,
+        None => return Ok(false),
+    };
+
+    // Pages that are already resident (or swapped out) would have to be copied
+
+    if addr_space.swapped_pages > 0 || addr_space.resident_count(block, block + LARGE_BLOCK_SIZE) > 0 {
+        return Ok(false);
+    }
+
+    let frame = match phys_alloc::zero_pool::alloc_zeroed(BlockSize::Block4M) {
+        Ok((frame, _)) => frame,
+        Err(_) => return Ok(false),
+    };
+
+    let result = unsafe {
+        syscall::map(Some(addr_space.root_pmap()),
+                     block as *mut c_void,
+                     frame,
+                     LARGE_PAGES_PER_BLOCK as i32,
+                     page_flags(mapping) | READ_WRITE | PM_LARGE_PAGE)
+    };
+
+    match result {
+        Ok(mapped) if mapped as usize == LARGE_PAGES_PER_BLOCK => {
+            addr_space.set_large_resident(block, frame);
+            Ok(true)
+        },
+        _ => {
+            phys_alloc::release_phys(frame, BlockSize::Block4M);
+            Ok(false)
+        }
+    }
+}
+
+/// Records that a page of an eligible block was faulted in with a small page, so that the
+/// block can be collapsed later on.
+
+pub fn note_small_fault(addr_space: &AddrSpace, mapping: &AddressMapping, page: usize) {
+    if let Some(block) = block_in_mapping(mapping, page) {
+        candidates().insert((addr_space.root_pmap(), block));
+    }
+}
+
+pub fn has_candidates() -> bool {
+    !candidates().is_empty()
+}
+
+/// Returns the addresses of the 4 kB frames that make up a large frame.
+
+fn block_frames(large_frame: PAddr) -> Vec<PAddr> {
+    (0..SMALL_PAGES_PER_BLOCK)
+        .map(|i| large_frame + (i * VirtualPage::SMALL_PAGE_SIZE) as PAddr)
+        .collect()
+}
+
+/// Collapses the small pages of a fully populated block into a large frame. The small
+/// pages are write-protected while they're being copied, so a write in the meantime
+/// faults and waits for the collapse to finish.
+
+fn collapse_block(addr_space: &mut AddrSpace, mapping: &AddressMapping, block: usize) -> bool {
+    let root_pmap = addr_space.root_pmap();
+    let page_size = VirtualPage::SMALL_PAGE_SIZE;
+
+    let frames = (0..SMALL_PAGES_PER_BLOCK)
+        .map(|i| addr_space.resident_frame(block + i * page_size))
+        .collect::<Option<Vec<PAddr>>>();
+
+    // Every page must be resident and belong to this address space alone
+
+    let frames = match frames {
+        Some(frames) if frames.iter().all(|&frame| !device::is_zero_frame(frame)
+            && phys_alloc::frame_ref_count(frame) == 1) => frames,
+        _ => return false,
+    };
+
+    let (large_frame, _) = match phys_alloc::alloc_phys(BlockSize::Block4M) {
+        Ok(block) => block,
+        Err(_) => return false,
+    };
+
+    let flags = page_flags(mapping);
+
+    let remap_small = |access: u32| unsafe {
+        syscall::map_frames(Some(root_pmap), block as *mut c_void, &frames, frames.len() as i32,
+                            flags | access | OVERWRITE)
+    };
+
+    let copied = remap_small(READ_ONLY).is_ok()
+        && unsafe { phys::copy_frames(&block_frames(large_frame), &frames).is_ok() };
+
+    let mapped = copied && match unsafe {
+        syscall::map(Some(root_pmap), block as *mut c_void, large_frame, LARGE_PAGES_PER_BLOCK as i32,
+                     flags | READ_WRITE | PM_LARGE_PAGE | OVERWRITE)
+    } {
+        Ok(mapped) => mapped as usize == LARGE_PAGES_PER_BLOCK,
+        Err(_) => false,
+    };
+
+    if !mapped {
+        let _ = remap_small(READ_WRITE);
+        phys_alloc::release_phys(large_frame, BlockSize::Block4M);
+        return false;
+    }
+
+    for (i, frame) in frames.into_iter().enumerate() {
+        let page = block + i * page_size;
+        let vpage = mapping.base_page.add_offset((page - mapping.region.start()) as u64);
+
+        addr_space.remove_resident(page);
+        device::release_page(&vpage, &PhysicalPage::new(frame));
+    }
+
+    addr_space.set_large_resident(block, large_frame);
+    true
+}
+
+/// Tries to collapse the next candidate block. This is meant to be called when the
+/// init server has nothing else to do. Returns `true` if a block was collapsed.
+
+pub fn collapse_next() -> bool {
+    let (pmap, block) = match candidates().iter().next().cloned() {
+        Some(candidate) => candidate,
+        None => return false,
+    };
+
+    candidates().remove(&(pmap, block));
+
+    let addr_space = match mapping::manager::lookup_pmap_mut(pmap) {
+        Some(addr_space) => addr_space,
+        None => return false,
+    };
+
+    // A block that isn't fully populated yet is added back on its next fault
+
+    match addr_space.get_mapping(block as VAddr).cloned() {
+        Some(mapping) if block_in_mapping(&mapping, block) == Some(block)
+            && addr_space.resident_count(block, block + LARGE_BLOCK_SIZE) == SMALL_PAGES_PER_BLOCK =>
+            collapse_block(addr_space, &mapping, block),
+        _ => false,
+    }
+}
+
+/// Remaps a large block with small pages. From then on, each 4 kB piece of the large frame
+/// is an ordinary resident page that can be unmapped and released on its own.
+
+fn split_block(addr_space: &mut AddrSpace, block: usize, large_frame: PAddr) -> bool {
+    let root_pmap = addr_space.root_pmap();
+
+    let flags = match addr_space.get_mapping(block as VAddr) {
+        Some(mapping) => page_flags(mapping),
+        None => return false,
+    };
+
+    let frames = block_frames(large_frame);
+
+    let mapped = match unsafe {
+        syscall::map_frames(Some(root_pmap), block as *mut c_void, &frames, frames.len() as i32,
+                            flags | READ_WRITE | OVERWRITE)
+    } {
+        Ok(mapped) => mapped as usize == SMALL_PAGES_PER_BLOCK,
+        Err(_) => false,
+    };
+
+    if !mapped {
+        let _ = unsafe {
+            syscall::map(Some(root_pmap), block as *mut c_void, large_frame, LARGE_PAGES_PER_BLOCK as i32,
+                         flags | READ_WRITE | PM_LARGE_PAGE | OVERWRITE)
+        };
+        return false;
+    }
+
+    addr_space.split_large_resident(block)
+}
+
+/// Splits the large blocks that `[start, end)` only partly covers, so that the region can be
+/// unmapped without losing the rest of each block. Returns `false` if a block couldn't be
+/// split, in which case the region must not be unmapped.
+
+pub fn split_blocks(addr_space: &mut AddrSpace, start: usize, end: usize) -> bool {
+    let start = start.align_trunc(VirtualPage::SMALL_PAGE_SIZE);
+    let end = end.align(VirtualPage::SMALL_PAGE_SIZE);
+
+    let blocks = addr_space.large_pages()
+        .filter(|&(block, _)| block < end && block.saturating_add(LARGE_BLOCK_SIZE) > start
+            && (block < start || block.saturating_add(LARGE_BLOCK_SIZE) > end))
+        .collect::<Vec<(usize, PAddr)>>();
+
+    blocks.into_iter()
+        .all(|(block, frame)| split_block(addr_space, block, frame))
+}
+
+/// Unmaps the large blocks that lie entirely within `[start, end)` and releases their
+/// frames. This must be done before the region is unmapped. Blocks that are only partly
+/// unmapped must be split with `split_blocks()` beforehand.
+
+pub fn release_blocks(addr_space: &mut AddrSpace, start: usize, end: usize) {
+    let root_pmap = addr_space.root_pmap();
+
+    for (block, frame) in blocks_within(addr_space, start, end) {
+        let unmapped = unsafe {
+            syscall::unmap(Some(root_pmap), block as *const c_void, LARGE_PAGES_PER_BLOCK as i32, None)
+        };
+
+        if let Ok(count) = unmapped {
+            if count as usize == LARGE_PAGES_PER_BLOCK {
+                addr_space.remove_large_resident(block);
+                phys_alloc::release_phys(frame, BlockSize::Block4M);
+            }
+        }
+    }
+}
+
+/// Returns the large blocks that lie entirely within `[start, end)`
+
+fn blocks_within(addr_space: &AddrSpace, start: usize, end: usize) -> Vec<(usize, PAddr)> {
+    addr_space.large_pages()
+        .filter(|&(block, _)| block >= start
+            && block.checked_add(LARGE_BLOCK_SIZE).map_or(false, |block_end| block_end <= end))
+        .collect()
+}
+
+/// Gives a cloned address space its own copy of every large block of the parent. Large
+/// blocks aren't shared copy-on-write, since a single write would copy the whole block.
+
+pub fn copy_large_pages(parent: &AddrSpace, child: &mut AddrSpace) -> Result<(), (error::Error, Option<String>)> {
+    for (block, frame) in parent.large_pages() {
+        let flags = match parent.get_mapping(block as VAddr) {
+            Some(mapping) => page_flags(mapping),
+            None => continue,
+        };
+
+        let (new_frame, _) = phys_alloc::alloc_phys(BlockSize::Block4M)
+            .map_err(|_| (error::OUT_OF_MEMORY, None))?;
+
+        let copied = unsafe { phys::copy_frames(&block_frames(new_frame), &block_frames(frame)).is_ok() };
+
+        let mapped = copied && unsafe {
+            syscall::map(Some(child.root_pmap()), block as *mut c_void, new_frame,
+                         LARGE_PAGES_PER_BLOCK as i32, flags | READ_WRITE | PM_LARGE_PAGE)
+        }.is_ok();
+
+        if !mapped {
+            phys_alloc::release_phys(new_frame, BlockSize::Block4M);
+            return Err((error::OPERATION_FAILED, Some(format!("Unable to copy large block {:#x}", block))));
+        }
+
+        child.set_large_resident(block, new_frame);
+    }
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::{blocks_within, LARGE_BLOCK_SIZE};
+    use crate::address::VAddr;
+    use crate::device::DeviceId;
+    use crate::mapping::AddrSpace;
+
+    const BASE_ADDR: usize = 0x10000000;
+
+    #[test]
+    fn test_blocks_within() {
+        let mut addr_space = AddrSpace::new(0x1000);
+        let dev = DeviceId::new(1);
+
+        addr_space.map(Some(BASE_ADDR as VAddr), &dev, 0, 0, 3 * LARGE_BLOCK_SIZE);
+        addr_space.set_large_resident(BASE_ADDR, 0x800000);
+        addr_space.set_large_resident(BASE_ADDR + LARGE_BLOCK_SIZE, 0xC00000);
+        addr_space.set_large_resident(BASE_ADDR + 2 * LARGE_BLOCK_SIZE, 0x1000000);
+
+        assert_eq!(blocks_within(&addr_space, BASE_ADDR, BASE_ADDR + 3 * LARGE_BLOCK_SIZE).len(), 3);
+
+        // Blocks that are only partly in the range are left alone
+
+        assert_eq!(blocks_within(&addr_space, BASE_ADDR + 1, BASE_ADDR + 3 * LARGE_BLOCK_SIZE - 1),
+                   vec![(BASE_ADDR + LARGE_BLOCK_SIZE, 0xC00000)]);
+
+        assert!(blocks_within(&addr_space, BASE_ADDR, BASE_ADDR + LARGE_BLOCK_SIZE - 1).is_empty());
+    }
+}
@@ -1,16 +1,12 @@
 use core::panic::PanicInfo;
-use core::alloc::{Layout, GlobalAlloc};
-use core::ffi::c_void;
+use core::alloc::Layout;
+use crate::slab::SlabAllocator;
 use alloc::string::ToString;
 
 static BASE_CHARS: &'static [u8] = b"0123456789abcdefghijklmnopqrstuvwxyz";
 
 #[link(name="c", kind="static")]
 extern "C" {
-    fn malloc(length: usize) -> *mut c_void;
-    fn calloc(num_blocks: usize, block_size: usize) -> *mut c_void;
-    fn free(buffer: *mut c_void);
-    fn realloc(buffer: *mut c_void, new_length: usize) -> *mut c_void;
     fn abort() -> !;
 }
 
@@ -130,6 +126,17 @@ pub fn print_debug_i32(num: i32, base: u32) {
     print_debug_num(i32_to_bytes(num, base));
 }
 
+/// Picks one of `count` slots for the calling thread. The init server has no thread-local
+/// storage, but each of its threads runs on its own 4 MB stack, so the stack address
+/// tells the threads apart.
+
+pub fn stack_slot(count: usize) -> usize {
+    const STACK_SPAN: usize = 4096 * 1024;
+
+    let marker = 0u8;
+    (&marker as *const u8 as usize / STACK_SPAN) % count
+}
+
 pub mod phys {
     use crate::syscall;
     use crate::page::{PhysicalPage, VirtualPage};
@@ -161,8 +168,108 @@ pub mod phys {
         static mut PAGE_MAP_AREA: [u8; 0x400000];
     }
 
+    const SLOT_COUNT: usize = 1024;
+    const SLOT_WORDS: usize = SLOT_COUNT / 32;
+
+    /// Each thread has a small window of its own at the start of the page map area, so that
+    /// the one or two page mappings made while handling faults don't need the global lock.
+    const WINDOW_COUNT: usize = 8;
+    const WINDOW_PAGES: usize = 2;
+    const RESERVED_SLOTS: usize = WINDOW_COUNT * WINDOW_PAGES;
+
     static mut PMAP_LOCK: i32 = 0;
-    static mut PMAP_STATUS: [bool; 1024] = [false; 1024];
+    static mut WINDOW_LOCKS: [i32; WINDOW_COUNT] = [0; WINDOW_COUNT];
+
+    // A set bit marks a free slot of the page map area. Bit i of PMAP_FREE_WORDS is set if
+    // PMAP_FREE[i] has at least one free slot.
+    static mut PMAP_FREE: [u32; SLOT_WORDS] = initial_free_slots();
+    static mut PMAP_FREE_WORDS: u32 = u32::MAX;
+
+    const fn initial_free_slots() -> [u32; SLOT_WORDS] {
+        let mut words = [u32::MAX; SLOT_WORDS];
+        words[0] = u32::MAX << RESERVED_SLOTS;
+        words
+    }
+
+    /// Returns the first slot at or after `start` that's free (or used, if `free` is false).
+    /// Returns `SLOT_COUNT` if there's none.
+
+    unsafe fn next_slot(start: usize, free: bool) -> usize {
+        let mut word_index = start / 32;
+        let mut mask = u32::MAX << (start % 32);
+
+        while word_index < SLOT_WORDS {
+            let word = if free {
+                PMAP_FREE[word_index]
+            } else {
+                !PMAP_FREE[word_index]
+            } & mask;
+
+            if word != 0 {
+                return word_index * 32 + word.trailing_zeros() as usize;
+            }
+
+            word_index += 1;
+            mask = u32::MAX;
+        }
+
+        SLOT_COUNT
+    }
+
+    unsafe fn mark_slots(start: usize, count: usize, free: bool) {
+        for slot in start..start + count {
+            if free {
+                PMAP_FREE[slot / 32] |= 1 << (slot % 32);
+            } else {
+                PMAP_FREE[slot / 32] &= !(1 << (slot % 32));
+            }
+
+            if PMAP_FREE[slot / 32] == 0 {
+                PMAP_FREE_WORDS &= !(1 << (slot / 32));
+            } else {
+                PMAP_FREE_WORDS |= 1 << (slot / 32);
+            }
+        }
+    }
+
+    /// Allocates a run of `count` slots. A single slot is found with two bit scans;
+    /// longer runs go to the smallest free run that fits. Must be called with `PMAP_LOCK`
+    /// held.
+
+    unsafe fn alloc_slots(count: usize) -> Option<usize> {
+        let start = if count == 1 {
+            let word_index = PMAP_FREE_WORDS.trailing_zeros() as usize;
+
+            if word_index >= SLOT_WORDS {
+                return None;
+            }
+
+            word_index * 32 + PMAP_FREE[word_index].trailing_zeros() as usize
+        } else {
+            let mut best: Option<(usize, usize)> = None;
+            let mut run_start = next_slot(0, true);
+
+            while run_start < SLOT_COUNT {
+                let run_end = next_slot(run_start, false);
+                let run_len = run_end - run_start;
+
+                if run_len >= count && best.map_or(true, |(_, best_len)| run_len < best_len) {
+                    best = Some((run_start, run_len));
+
+                    if run_len == count {
+                        break;
+                    }
+                }
+
+                run_start = next_slot(run_end, true);
+            }
+
+            best?.0
+        };
+
+        mark_slots(start, count, false);
+        Some(start)
+    }
 
     pub struct PageMapArea {
         slice: &'static mut [u8],
@@ -177,18 +284,14 @@ pub mod phys {
            if size > BlockSize::Block4M.bytes() as usize {
                None
            } else {
-               let mut frames = Vec::new();
-
-               for i in 0..num_pages {
-                   match phys_alloc::alloc_phys(BlockSize::Block4k) {
-                       Ok(addr) => frames.push(addr.0),
-                       Err(_) => {
-                           for j in 0..i {
-                               phys_alloc::release_phys(frames[j], BlockSize::Block4k);
-                               return None;
-                           }
-                       }
+               let frames = phys_alloc::alloc_phys_many(num_pages);
+
+               if frames.len() < num_pages {
+                   for frame in frames {
+                       phys_alloc::release_phys(frame, BlockSize::Block4k);
                    }
+
+                   return None;
                }
 
                unsafe {
@@ -206,48 +309,51 @@ pub mod phys {
        }
 
        fn acquire_buffer(size: usize) -> Option<&'static mut [u8]> {
-           let mut buffer_option = None;
+           let pages = size.align(VirtualPage::SMALL_PAGE_SIZE) / VirtualPage::SMALL_PAGE_SIZE;
+
+           if pages == 0 || pages > SLOT_COUNT {
+               return None;
+           }
 
            unsafe {
-               if size <= PAGE_MAP_AREA.len() {
-                   while mutex_lock(&mut PMAP_LOCK) != 0 {}
-
-                   let mut len = 0;
-                   let mut offset = 0;
-
-                   for i in 0..PMAP_STATUS.len() {
-                       if !PMAP_STATUS[i] {
-                           len += 1;
-                       } else {
-                           len = 0;
-                           offset = i + 1;
-                           continue;
-                       };
-
-                       if len * VirtualPage::SMALL_PAGE_SIZE >= size {
-                           buffer_option = Some(&mut PAGE_MAP_AREA[offset*VirtualPage::SMALL_PAGE_SIZE..(offset+len)*VirtualPage::SMALL_PAGE_SIZE]);
-                           break;
-                       }
+               // Use this thread's own window if it's free (it won't be if the thread is
+               // already using it further up the stack)
+
+               let window = super::stack_slot(WINDOW_COUNT);
+
+               let start = if pages <= WINDOW_PAGES && mutex_lock(&mut WINDOW_LOCKS[window]) == 0 {
+                   Some(window * WINDOW_PAGES)
+               } else {
+                   while mutex_lock(&mut PMAP_LOCK) != 0 {
+                       syscall::sys_sleep(0);
                    }
 
+                   let start = alloc_slots(pages);
+
                    while mutex_unlock(&mut PMAP_LOCK) != 0 {}
-               }
+                   start
+               };
+
+               start.map(|slot| &mut PAGE_MAP_AREA[slot * VirtualPage::SMALL_PAGE_SIZE
+                   ..(slot + pages) * VirtualPage::SMALL_PAGE_SIZE])
            }
-           buffer_option
        }
 
        fn release_buffer(buffer: &mut [u8]) {
            unsafe {
-               while mutex_lock(&mut PMAP_LOCK) != 0 {}
+               let start = (buffer.as_ptr() as usize - PAGE_MAP_AREA.as_ptr() as usize) / VirtualPage::SMALL_PAGE_SIZE;
 
-               let buffer_start = (buffer.as_ptr() as usize) - (PAGE_MAP_AREA.as_ptr() as usize);
-               let buffer_end = buffer_start + buffer.len();
+               if start < RESERVED_SLOTS {
+                   while mutex_unlock(&mut WINDOW_LOCKS[start / WINDOW_PAGES]) != 0 {}
+               } else {
+                   while mutex_lock(&mut PMAP_LOCK) != 0 {
+                       syscall::sys_sleep(0);
+                   }
 
-               for i in (buffer_start / VirtualPage::SMALL_PAGE_SIZE)..(buffer_end / VirtualPage::SMALL_PAGE_SIZE) {
-                   PMAP_STATUS[i] = false;
-               }
+                   mark_slots(start, buffer.len() / VirtualPage::SMALL_PAGE_SIZE, true);
 
-               while mutex_unlock(&mut PMAP_LOCK) != 0 {}
+                   while mutex_unlock(&mut PMAP_LOCK) != 0 {}
+               }
            }
        }
 
@@ -277,11 +383,17 @@ pub mod phys {
                                                      base_ref.as_ptr() as *mut c_void,
                                                      pages_mapped,
                                                      None) {
-                                    Ok(pages_unmapped) if pages_unmapped == pages_mapped => None,
+                                    Ok(pages_unmapped) if pages_unmapped == pages_mapped => {
+                                        Self::release_buffer(base_ref);
+                                        None
+                                    },
                                     _ => panic!("Unable to unmap memory."),
                                 }
                             },
-                            Err(_) => None
+                            Err(_) => {
+                                Self::release_buffer(base_ref);
+                                None
+                            }
                         }
                     })
             } else {
@@ -319,8 +431,6 @@ pub mod phys {
 
     impl Drop for PageMapArea {
         fn drop(&mut self) {
-            Self::release_buffer(self.slice.as_mut());
-
             unsafe {
                 let len = self.slice.len() / VirtualPage::SMALL_PAGE_SIZE;
 
@@ -344,6 +454,10 @@ pub mod phys {
                     _ => panic!("Unable to unmap memory.")
                 }
             }
+
+            // Only hand out the slots again once the frames are no longer mapped there
+
+            Self::release_buffer(self.slice.as_mut());
         }
     }
 
@@ -393,14 +507,182 @@ pub mod phys {
         }
     }
 
+    /// Contention benchmark for the page map area, built with the `pmap_bench` feature. Each
+    /// benchmark thread maps a scratch frame (and every so often a run of frames) over and
+    /// over again and reports the average number of cycles per mapping.
+
+    #[cfg(feature = "pmap_bench")]
+    pub mod bench {
+        use super::PageMapArea;
+        use crate::lowlevel::{print_debug, print_debug_u32, print_debugln};
+        use crate::phys_alloc;
+        use crate::syscall;
+        use core::arch::x86::_rdtsc;
+
+        pub const THREAD_COUNT: usize = 4;
+
+        const ITERATIONS: u32 = 100000;
+        const RUN_FRAMES: usize = 8;
+
+        pub fn contention_main() -> ! {
+            let frames = phys_alloc::alloc_phys_many(RUN_FRAMES);
+            let mut failures = 0;
+
+            if frames.len() == RUN_FRAMES {
+                let start = unsafe { _rdtsc() };
+
+                for i in 0..ITERATIONS {
+                    let count = if i % 16 == 0 { RUN_FRAMES } else { 1 };
+
+                    match unsafe { PageMapArea::new_from_frames(&frames[..count]) } {
+                        Some(mut pmap_area) => pmap_area.as_mut()[0] = i as u8,
+                        None => failures += 1,
+                    }
+                }
+
+                let cycles = unsafe { _rdtsc() } - start;
+
+                print_debug("pmap_bench: ");
+                print_debug_u32(ITERATIONS, 10);
+                print_debug(" mappings (");
+                print_debug_u32(failures, 10);
+                print_debug(" failed), ");
+                print_debug_u32((cycles / ITERATIONS as u64) as u32, 10);
+                print_debugln(" cycles per mapping");
+            } else {
+                print_debugln("pmap_bench: unable to allocate frames");
+            }
+
+            loop {
+                let _ = syscall::sleep(u32::MAX);
+            }
+        }
+    }
+
+    /// Most frames that a bulk operation maps at once. Larger operations are split into
+    /// runs of this size, so that one of them can't take up the whole page map area.
+    const BULK_FRAMES: usize = 256;
+
+    /// Maps `frames` a run at a time with one map_frames() call per run and calls `f` with
+    /// the index of each run's first frame and its mapped pages. A run is halved if the
+    /// page map area doesn't have room for it. Returns the number of frames that were
+    /// handled if a frame couldn't be mapped.
+
+    unsafe fn for_each_mapped(frames: &[PAddr], mut f: impl FnMut(usize, &mut [u8])) -> Result<(), usize> {
+        let mut done = 0;
+        let mut run_len = BULK_FRAMES;
+
+        while done < frames.len() {
+            run_len = cmp::min(run_len, frames.len() - done);
+
+            match PageMapArea::new_from_frames(&frames[done..done + run_len]) {
+                Some(mut pmap_area) => {
+                    f(done, pmap_area.as_mut());
+                    done += run_len;
+                },
+                None if run_len > 1 => run_len /= 2,
+                None => return Err(done),
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Maps the physical memory in `[paddr, paddr + length)` and calls `f` with the offset
+    /// of each mapped run into the range and the run's bytes. Returns the number of bytes
+    /// that were handled if some of the memory couldn't be mapped.
+
+    unsafe fn for_each_phys_run(paddr: PAddr, length: usize, mut f: impl FnMut(usize, &mut [u8])) -> Result<(), usize> {
+        let page_size = VirtualPage::SMALL_PAGE_SIZE;
+        let first_frame = paddr.align_trunc(PhysicalPage::SMALL_PAGE_SIZE);
+        let start_offset = (paddr - first_frame) as usize;
+        let end_offset = start_offset + length;
+        let frame_count = end_offset.align(page_size) / page_size;
+        let mut frames = [0 as PAddr; BULK_FRAMES];
+
+        if length == 0 {
+            return Ok(());
+        }
+
+        for chunk_start in (0..frame_count).step_by(BULK_FRAMES) {
+            let chunk_len = cmp::min(BULK_FRAMES, frame_count - chunk_start);
+
+            for i in 0..chunk_len {
+                frames[i] = first_frame + ((chunk_start + i) * page_size) as PAddr;
+            }
+
+            for_each_mapped(&frames[..chunk_len], |run_start, pages| {
+                let run_offset = (chunk_start + run_start) * page_size;
+                let start = cmp::max(run_offset, start_offset);
+                let end = cmp::min(run_offset + pages.len(), end_offset);
+
+                f(start - start_offset, &mut pages[start - run_offset..end - run_offset]);
+            }).map_err(|frames_done| ((chunk_start + frames_done) * page_size).saturating_sub(start_offset))?;
+        }
+
+        Ok(())
+    }
+
+    /// Copies the contents of each frame in `src` into the corresponding frame in `dest`.
+    /// The frames don't need to be contiguous. Up to half of a run is mapped for each side,
+    /// so that every run is copied with a single map_frames() call.
+
+    pub unsafe fn copy_frames(dest: &[PAddr], src: &[PAddr]) -> Result<(), Error> {
+        if dest.len() != src.len() {
+            return Err(error::BAD_ARGUMENT);
+        }
+
+        let mut frames = [0 as PAddr; BULK_FRAMES];
+        let mut done = 0;
+        let mut run_len = BULK_FRAMES / 2;
+
+        while done < dest.len() {
+            run_len = cmp::min(run_len, dest.len() - done);
+
+            frames[..run_len].copy_from_slice(&dest[done..done + run_len]);
+            frames[run_len..2 * run_len].copy_from_slice(&src[done..done + run_len]);
+
+            match PageMapArea::new_from_frames(&frames[..2 * run_len]) {
+                Some(mut pmap_area) => {
+                    let (dest_slice, src_slice) = pmap_area.as_mut().split_at_mut(run_len * VirtualPage::SMALL_PAGE_SIZE);
+
+                    dest_slice.copy_from_slice(src_slice);
+                    done += run_len;
+                },
+                None if run_len > 1 => run_len /= 2,
+                None => return Err(error::OPERATION_FAILED),
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Copies the contents of one 4 kB frame into another.
+
+    pub unsafe fn copy_frame(dest: PAddr, src: PAddr) -> Result<(), Error> {
+        copy_frames(&[dest], &[src])
+    }
+
+    /// Sets every byte of the (possibly discontiguous) frames in `frames` to `value`.
+
+    pub unsafe fn fill_frames(frames: &[PAddr], value: u8) -> Result<(), Error> {
+        for_each_mapped(frames, |_, pages| pages.fill(value))
+            .map_err(|_| error::OPERATION_FAILED)
+    }
+
     pub unsafe fn clear_frame(frame: PAddr) -> Result<(), Error> {
         fill_frame(frame, 0)
     }
 
+    /// Clears `count` physically contiguous 4 kB frames.
+
+    pub unsafe fn clear_frames(base: PAddr, count: usize) -> Result<(), Error> {
+        for_each_phys_run(base, count * VirtualPage::SMALL_PAGE_SIZE, |_, bytes| bytes.fill(0))
+            .map_err(|_| error::OPERATION_FAILED)
+    }
+
     pub unsafe fn fill_frame(addr: PAddr, value: u8) -> Result<(), Error> {
-        PageMapArea::new_from_addr(addr)
-            .ok_or_else(|| error::OPERATION_FAILED)
-            .map(|mut pmap_area| pmap_area.as_mut().fill(value) )
+        fill_frames(&[addr], value)
     }
 
     pub fn peek(paddr: PAddr, buffer: &mut [u8]) -> Result<(), usize> {
@@ -419,79 +701,27 @@ pub mod phys {
         read_phys_mem(paddr, buffer.cast(), bytes)
     }
 
-    unsafe fn read_phys_mem(mut paddr: PAddr, buffer: *mut u8, mut length: usize) -> Result<(), usize> {
+    unsafe fn read_phys_mem(paddr: PAddr, buffer: *mut u8, length: usize) -> Result<(), usize> {
         if buffer.is_null() {
             Err(0)
         } else {
-            let mut bytes_read = 0;
-
-            while length > 0 {
-                let phys_offset = (paddr - paddr.align_trunc(PhysicalPage::SMALL_PAGE_SIZE)) as usize;
-                let bytes = cmp::min(VirtualPage::SMALL_PAGE_SIZE - phys_offset, length);
-
-                PageMapArea::new_from_addr(paddr)
-                    .ok_or_else(|| bytes_read)
-                    .map(|mapping_area| {
-                        memcpy(buffer.wrapping_add(bytes_read).cast(),
-                               mapping_area.as_ptr().wrapping_add(phys_offset).cast(),
-                               bytes)
-                    })?;
-
-                paddr += bytes as PSize;
-                bytes_read += bytes;
-                length -= bytes;
-            }
-
-            Ok(())
+            for_each_phys_run(paddr, length, |offset, bytes| {
+                memcpy(buffer.wrapping_add(offset).cast(), bytes.as_ptr().cast(), bytes.len());
+            })
         }
     }
 
-    unsafe fn write_phys_mem(mut paddr: PAddr, buffer: *const u8, mut length: usize) -> Result<(), usize> {
+    unsafe fn write_phys_mem(paddr: PAddr, buffer: *const u8, length: usize) -> Result<(), usize> {
         if buffer.is_null() {
             Err(0)
         } else {
-            let mut bytes_written = 0;
-
-            while length > 0 {
-                let phys_offset = (paddr - paddr.align_trunc(PhysicalPage::SMALL_PAGE_SIZE)) as usize;
-                let bytes = cmp::min(VirtualPage::SMALL_PAGE_SIZE - phys_offset, length);
-
-                PageMapArea::new_from_frames(&[paddr])
-                    .ok_or_else(|| bytes_written)
-                    .map(|mut mapping_area| {
-                        memcpy(mapping_area.as_mut_ptr().wrapping_add(phys_offset).cast(),
-                               buffer.wrapping_add(bytes_written).cast(),
-                               bytes)
-                    })?;
-
-                paddr += bytes as PSize;
-                bytes_written += bytes;
-                length -= bytes;
-            }
-
-            Ok(())
+            for_each_phys_run(paddr, length, |offset, bytes| {
+                memcpy(bytes.as_mut_ptr().cast(), buffer.wrapping_add(offset).cast(), bytes.len());
+            })
         }
     }
 }
 
-unsafe impl GlobalAlloc for InitialAllocator {
-    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        malloc(layout.size()) as *mut u8
-    }
-
-    unsafe fn dealloc(&self, ptr: *mut u8, _layout: Layout) {
-        free(ptr as *mut c_void)
-    }
-
-    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
-       calloc(1, layout.size()) as *mut u8
-    }
-
-    unsafe fn realloc(&self, ptr: *mut u8, _layout: Layout, new_size: usize) -> *mut u8 {
-        realloc(ptr as *mut c_void, new_size) as *mut u8
-   }
-}
-
 #[panic_handler]
 fn handle_panic(info: &PanicInfo) -> ! {
     print_debug("Panic occurred ");
@@ -535,7 +765,5 @@ fn handle_alloc_error(layout: Layout) -> ! {
     loop {}
 }
 
-struct InitialAllocator;
-
 #[global_allocator]
-static mut GLOBAL_ALLOCATOR: InitialAllocator = InitialAllocator;
\ No newline at end of file
+static mut GLOBAL_ALLOCATOR: SlabAllocator = SlabAllocator;
\ No newline at end of file
@@ -44,9 +44,14 @@ mod types;
 mod multiboot;
 mod region;
 mod phys_alloc;
+mod reclaim;
+mod large_page;
+mod file_map;
+mod shm;
 mod vfs;
 mod fat;
 mod mutex;
+mod slab;
 
 use address::PAddr;
 use message::RawMessage;
@@ -54,8 +59,12 @@ use message::{init, kernel};
 use crate::message::init::{RegisterNameRequest, LookupNameRequest, UnregisterNameRequest,
                            MapResponse, UnmapResponse, MapRequest, UnmapRequest, LookupNameResponse,
                            RegisterNameResponse, UnregisterNameResponse, RegisterServerRequest,
-                           RegisterServerResponse};
+                           RegisterServerResponse, AllocStackRequest, FreeStackRequest,
+                           SyncRequest, CreateShmRequest, AttachShmRequest, DetachShmRequest,
+                           DeleteShmRequest, MemoryStatsRequest, MemoryStatsResponse,
+                           RawMemoryStats, CloneRequest, CloneResponse};
 use crate::message::kernel::{ExceptionMessage, ExitMessage};
+use crate::message::device::RawIoComplete;
 use syscall::c_types::{CTid, NULL_TID};
 use alloc::string::String;
 use crate::multiboot::{RawMultibootInfo, MultibootInfo};
@@ -64,13 +73,11 @@ use crate::syscall::c_types::ThreadInfo;
 use crate::syscall::{ThreadStruct, INIT_TID};
 use core::ffi::c_void;
 use crate::address::VAddr;
-use crate::device::DeviceId;
-use crate::mapping::AddrSpace;
 use crate::page::VirtualPage;
 use crate::message::Message;
 use core::convert::TryFrom;
 use crate::message::init::{SimpleResponse, NameString};
-use core::cmp::Ordering;
+use core::cmp::{self, Ordering};
 use alloc::vec::Vec;
 use crate::phys_alloc::PhysPageAllocator;
 
@@ -190,7 +197,15 @@ fn init(multiboot_info: PAddr, first_free_page: PAddr) -> Option<Box<MultibootIn
     device::manager::init();
 
     eprintln!("Initializing idle thread...");
-    init_threads(vec![idle_main, ramdisk::ramdisk_main]);
+    #[allow(unused_mut)]
+    let mut thread_entries: Vec<fn() -> !> = vec![idle_main, ramdisk::ramdisk_main, phys_alloc::zero_pool::zero_pool_main,
+                                                  file_map::io::io_main];
+
+    #[cfg(feature = "pmap_bench")]
+    thread_entries.extend((0..lowlevel::phys::bench::THREAD_COUNT)
+        .map(|_| lowlevel::phys::bench::contention_main as fn() -> !));
+
+    init_threads(thread_entries);
 
     eprintln!("Loading modules...");
     let multiboot_box = unsafe {
@@ -228,6 +243,64 @@ fn load_modules(multiboot_info: &Option<Box<MultibootInfo>>) {
     }
 }
 
+/// Collects a memory report. The per-address-space counts are those of `tid`'s address
+/// space. Returns `None` if `tid` isn't attached to one.
+
+fn memory_stats(tid: &Tid) -> Option<RawMemoryStats> {
+    let addr_space = mapping::manager::lookup_tid(tid)?;
+    let alloc_stats = phys_alloc::stats();
+    let zero_stats = phys_alloc::zero_pool::stats();
+    let (cached_pages, _, _) = device::page_cache::stats();
+    let (swap_used, swap_total) = reclaim::swap_usage();
+    let (shm_regions, shm_frames) = shm::stats();
+    let (total_resident_pages, total_large_pages) = mapping::manager::resident_totals();
+    let heap_stats = slab::stats();
+
+    Some(RawMemoryStats {
+        total_blocks: alloc_stats.total_blocks,
+        free_blocks: alloc_stats.free_blocks,
+        used_blocks: alloc_stats.used_blocks,
+        free_frames: alloc_stats.free_frames,
+        largest_free_run: alloc_stats.largest_free_run,
+        zeroed_frames: zero_stats.free_4k,
+        zeroed_large_frames: zero_stats.free_4m,
+        cached_pages,
+        swap_used,
+        swap_total,
+        shm_regions,
+        shm_frames,
+        address_spaces: mapping::manager::count(),
+        total_resident_pages,
+        total_large_pages,
+        resident_pages: addr_space.resident_page_count(),
+        large_pages: addr_space.large_page_count(),
+        swapped_pages: addr_space.swapped_pages,
+        heap_bytes: heap_stats.chunk_bytes,
+        heap_bytes_in_use: heap_stats.bytes_in_use(),
+        zero_frame_mappings: device::zero_frame_mappings(),
+        zero_pages: addr_space.resident_pages()
+            .filter(|&(_, frame)| device::is_zero_frame(frame))
+            .count(),
+    })
+}
+
+/// Responds to an exception message. A page fault that's waiting for the I/O thread gets
+/// its response once its page has been read in.
+
+fn respond_to_fault(sender: &Tid, result: Result<(), (error::Error, Option<String>)>) -> Result<(), (error::Error, Option<String>)> {
+    let subject = match result {
+        Err((error::IO_PENDING, _)) => return Ok(()),
+        Ok(_) => RawMessage::RESPONSE_OK,
+        Err(_) => RawMessage::RESPONSE_FAIL,
+    };
+
+    let mut response: Message<()> = Message::new(subject, None, RawMessage::MSG_SYSTEM | RawMessage::MSG_NOBLOCK);
+
+    response.send(sender)
+        .map_err(|code| (code, None))
+        .and(result)
+}
+
 fn handle_message<T>(message: Message<T>) -> Result<(), (error::Error, Option<String>)> {
     let msg = message.raw_message();
 
@@ -238,23 +311,13 @@ fn handle_message<T>(message: Message<T>) -> Result<(), (error::Error, Option<St
                     .map_err(|_| (error::OPERATION_FAILED, Some(String::from("Failed to respond to kernel message."))))
                     .and_then(|ex_msg| {
                         let result = if ex_msg.int_num == 14 {
-                            pager::handle_page_fault(&ex_msg)
+                            pager::handle_page_fault(&message.sender, &ex_msg)
                         } else {
                             error::dump_state(&message.sender);
                             Err((error::NOT_IMPLEMENTED, None))
                         };
 
-                        let subject = if result.is_ok() {
-                            RawMessage::RESPONSE_OK
-                        } else {
-                            RawMessage::RESPONSE_FAIL
-                        };
-
-                        let mut response: Message<()> = Message::new(subject, None, RawMessage::MSG_SYSTEM | RawMessage::MSG_NOBLOCK);
-
-                        response.send(&message.sender)
-                            .map_err(|code| (code, None))
-                            .and(result)
+                        respond_to_fault(&message.sender, result)
                     })
             },
             kernel::EXIT => {
@@ -346,12 +409,15 @@ fn handle_message<T>(message: Message<T>) -> Result<(), (error::Error, Option<St
             init::MAP => {
                 MapRequest::try_from(msg)
                     .and_then(|request| {
+                        // Shared memory can only be mapped with ATTACH_SHM
+
                         let addr_option = mapping::manager::lookup_tid_mut(&message.sender)
+                            .filter(|_| request.device.major != device::shared::MAJOR)
                             .and_then(|addr_space|
                                 addr_space.map(request.address,
                                                &request.device,
                                                request.offset,
-                                               request.flags,
+                                               request.flags & !mapping::AddrSpace::SHARED,
                                                request.length));
 
                         let mut response = MapResponse::new_message(message.sender.clone(),
@@ -366,12 +432,42 @@ fn handle_message<T>(message: Message<T>) -> Result<(), (error::Error, Option<St
             init::UNMAP => {
                 UnmapRequest::try_from(msg)
                     .and_then(|request| {
+                        // Nothing may be released unless there's a mapping at the address to
+                        // remove the pages from, and nothing past the end of that mapping is
+                        // touched. Shared memory can only be unmapped with DETACH_SHM.
+
                         let unmap_option = mapping::manager::lookup_tid_mut(&message.sender)
-                            .and_then(|addr_space|
-                                match addr_space.unmap(request.address, request.length) {
+                            .filter(|_| request.length > 0)
+                            .and_then(|addr_space| {
+                                let region_end = addr_space.get_mapping(request.address)
+                                    .filter(|m| m.flags & mapping::AddrSpace::SHARED == 0)
+                                    .map(|m| m.region.end())?;
+                                let requested_end = (request.address as usize).saturating_add(request.length);
+
+                                // A region end of 0 means that the mapping extends to the end of memory
+
+                                let end = match region_end {
+                                    0 => requested_end,
+                                    region_end => cmp::min(requested_end, region_end),
+                                };
+
+                                if !large_page::split_blocks(addr_space, request.address as usize, end) {
+                                    return None;
+                                }
+
+                                if let Err(code) = file_map::write_back(addr_space, request.address, end as VAddr) {
+                                    error::log_error(code, Some(String::from("Unable to write back file pages")));
+                                }
+
+                                reclaim::release_swap(addr_space, request.address as usize, end);
+                                pager::release_resident(addr_space, request.address as usize, end);
+                                large_page::release_blocks(addr_space, request.address as usize, end);
+
+                                match addr_space.unmap(request.address, end - request.address as usize) {
                                     true => Some(()),
                                     false => None,
-                                });
+                                }
+                            });
                         let mut response = UnmapResponse::new_message(message.sender.clone(),
                                                                       unmap_option.is_some(),
                                                                       RawMessage::MSG_NOBLOCK);
@@ -381,6 +477,184 @@ fn handle_message<T>(message: Message<T>) -> Result<(), (error::Error, Option<St
                     })
                     .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
             },
+            init::ALLOC_STACK => {
+                AllocStackRequest::try_from(msg)
+                    .and_then(|request| {
+                        let stack_option = mapping::manager::lookup_tid_mut(&message.sender)
+                            .and_then(|addr_space| addr_space.allocate_stack_memory(request.length))
+                            .map(|(stack_top, _)| stack_top);
+
+                        let mut response = MapResponse::new_message(message.sender.clone(),
+                                                                    stack_option,
+                                                                    RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::FREE_STACK => {
+                FreeStackRequest::try_from(msg)
+                    .and_then(|request| {
+                        let is_released = mapping::manager::lookup_tid_mut(&message.sender)
+                            .map_or(false, |addr_space| {
+                                match addr_space.stack_range(request.address, request.length) {
+                                    Some((start, end)) => {
+                                        reclaim::release_swap(addr_space, start, end);
+                                        pager::release_resident(addr_space, start, end);
+                                        addr_space.release_stack_memory(request.address, request.length)
+                                    },
+                                    None => false,
+                                }
+                            });
+
+                        let mut response = UnmapResponse::new_message(message.sender.clone(),
+                                                                      is_released,
+                                                                      RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::SYNC => {
+                SyncRequest::try_from(msg)
+                    .and_then(|request| {
+                        let end = (request.address as usize).saturating_add(request.length);
+
+                        let is_synced = mapping::manager::lookup_tid_mut(&message.sender)
+                            .map_or(false, |addr_space|
+                                file_map::write_back(addr_space, request.address, end as VAddr).is_ok());
+
+                        let mut response = UnmapResponse::new_message(message.sender.clone(),
+                                                                      is_synced,
+                                                                      RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::CREATE_SHM => {
+                CreateShmRequest::try_from(msg)
+                    .and_then(|request| {
+                        let name = request.name_string()
+                            .expect("A request with an invalid name was marked as valid.");
+
+                        let is_created = mapping::manager::lookup_tid_mut(&message.sender)
+                            .ok_or(error::NOT_REGISTERED)
+                            .and_then(|addr_space| shm::create(addr_space.root_pmap(), &name,
+                                                               request.length, request.flags));
+
+                        if let Err(code) = is_created {
+                            error::log_error(code, Some(format!("Unable to create shared region {}", name)));
+                        }
+
+                        let mut response = UnmapResponse::new_message(message.sender.clone(),
+                                                                      is_created.is_ok(),
+                                                                      RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::ATTACH_SHM => {
+                AttachShmRequest::try_from(msg)
+                    .and_then(|request| {
+                        let name = request.name_string()
+                            .expect("A request with an invalid name was marked as valid.");
+                        let read_only = request.flags & AttachShmRequest::READ_ONLY == AttachShmRequest::READ_ONLY;
+
+                        let addr_option = mapping::manager::lookup_tid_mut(&message.sender)
+                            .ok_or(error::NOT_REGISTERED)
+                            .and_then(|addr_space| shm::attach(addr_space, &name, request.address, read_only))
+                            .map(|(addr, _)| addr)
+                            .map_err(|code| error::log_error(code, Some(format!("Unable to attach shared region {}", name))))
+                            .ok();
+
+                        let mut response = MapResponse::new_message(message.sender.clone(),
+                                                                    addr_option,
+                                                                    RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::DETACH_SHM => {
+                DetachShmRequest::try_from(msg)
+                    .and_then(|request| {
+                        let is_detached = mapping::manager::lookup_tid_mut(&message.sender)
+                            .map_or(false, |addr_space| shm::detach(addr_space, request.address).is_ok());
+
+                        let mut response = UnmapResponse::new_message(message.sender.clone(),
+                                                                      is_detached,
+                                                                      RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::DELETE_SHM => {
+                DeleteShmRequest::try_from(msg)
+                    .and_then(|request| {
+                        let is_deleted = match (request.name_string(), mapping::manager::lookup_tid_mut(&message.sender)) {
+                            (Ok(name), Some(addr_space)) => shm::delete(addr_space.root_pmap(), &name).is_ok(),
+                            _ => false,
+                        };
+
+                        let mut response = UnmapResponse::new_message(message.sender.clone(),
+                                                                      is_deleted,
+                                                                      RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::MEMORY_STATS => {
+                MemoryStatsRequest::try_from(msg)
+                    .and_then(|request| {
+                        let tid = if request.tid.is_null() {
+                            &message.sender
+                        } else {
+                            &request.tid
+                        };
+
+                        let mut response = MemoryStatsResponse::new_message(message.sender.clone(),
+                                                                            memory_stats(tid),
+                                                                            RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
+            init::CLONE => {
+                CloneRequest::try_from(msg)
+                    .and_then(|request| {
+                        let tid_option = mapping::manager::lookup_tid_mut(&message.sender)
+                            .map(|addr_space| addr_space.root_pmap())
+                            .and_then(|parent_pmap| {
+                                pager::spawn_clone(parent_pmap, request.entry, request.stack_top)
+                                    .map_err(|(code, err_msg)| {
+                                        eprintln!("Unable to clone the address space of {}: {} {}", CTid::from(&message.sender), code,
+                                                  err_msg.unwrap_or(String::new()));
+                                    })
+                                    .ok()
+                            });
+
+                        let mut response = CloneResponse::new_message(message.sender.clone(),
+                                                                      tid_option,
+                                                                      RawMessage::MSG_NOBLOCK);
+
+                        message::send(&message.sender, &mut response)
+                            .map(|_| ())
+                    })
+                    .map_err(|code| (error::OPERATION_FAILED, Some(format!("Failed to respond to request {} failed due to code: {}", message.subject, code))))
+            },
             init::CREATE_PORT => {
                 Err((error::NOT_IMPLEMENTED, Some(format!("Request {}", msg.subject()))))
             },
@@ -410,6 +684,17 @@ fn handle_message<T>(message: Message<T>) -> Result<(), (error::Error, Option<St
             init::UNREGISTER_SERVER => {
                 Err((error::NOT_IMPLEMENTED, Some(format!("Request {}", msg.subject()))))
             },
+            message::device::IO_COMPLETE if file_map::io::is_io_thread(&message.sender) => {
+                RawIoComplete::try_from(msg)
+                    .map_err(|code| (code, None))
+                    .map(|complete| {
+                        for (sender, result) in pager::complete_read(complete.id, complete.status) {
+                            if let Err((code, arg)) = respond_to_fault(&sender, result) {
+                                error::log_error(code, arg);
+                            }
+                        }
+                    })
+            },
             _ => Err((error::BAD_REQUEST, Some(format!("Request {:#x} sender: {} flags: {}", message.subject, msg.sender(), msg.flags())))),
         }
     }
@@ -425,7 +710,6 @@ fn init_threads(thread_entries: Vec<fn() -> !>) {
         .expect("Unable to get the initial address space");
     let stack_size = 4096 * 1024;
     let pmap = syscall::get_init_pmap().unwrap().as_address();
-    let zero_device = DeviceId::new_from_tuple((device::pseudo::MAJOR, device::pseudo::ZERO_MINOR));
 
     for (i, entry) in thread_entries.into_iter().enumerate() {
         let stack_top = 0xC0000000 - (i + 1) * stack_size;
@@ -440,11 +724,8 @@ fn init_threads(thread_entries: Vec<fn() -> !>) {
             t => Tid::new(t)
         };
 
-        addr_space.attach_thread(tid.clone());
-        addr_space.map(Some((stack_top - stack_size + VirtualPage::SMALL_PAGE_SIZE) as VAddr),
-                       &zero_device, 0, AddrSpace::EXTEND_DOWN | AddrSpace::NO_EXECUTE, stack_size - VirtualPage::SMALL_PAGE_SIZE);
-        addr_space.map(Some((stack_top - stack_size) as VAddr),
-                       &zero_device, 0, AddrSpace::GUARD | AddrSpace::NO_EXECUTE, VirtualPage::SMALL_PAGE_SIZE);
+        mapping::manager::attach_thread(addr_space.root_pmap(), tid.clone());
+        addr_space.map_stack(Some(stack_top as VAddr), stack_size - VirtualPage::SMALL_PAGE_SIZE);
 
         let mut thread_info = ThreadInfo::default();
         let mut flags = ThreadInfo::STATUS;
@@ -453,7 +734,9 @@ fn init_threads(thread_entries: Vec<fn() -> !>) {
         if entry == idle_main {
             thread_info.priority = 0;
             flags |= ThreadInfo::PRIORITY;
-        };
+        } else if entry == file_map::io::io_main {
+            file_map::io::set_thread(tid.clone());
+        }
 
         let thread_struct = ThreadStruct::new(thread_info, flags);
         match syscall::update_thread(&tid, &thread_struct) {
@@ -467,13 +750,24 @@ fn main(_multiboot_info: Option<Box<MultibootInfo>>) {
     let any_sender = Tid::new(RawMessage::ANY_SENDER);
 
     loop {
-        match message::receive::<[u8; DATA_BUF_SIZE]>(&any_sender, 0) {
+        // Small pages are only collapsed into large pages when no messages are pending
+
+        let flags = if large_page::has_candidates() {
+            RawMessage::MSG_NOBLOCK
+        } else {
+            0
+        };
+
+        match message::receive::<[u8; DATA_BUF_SIZE]>(&any_sender, flags) {
             Ok((msg, _)) => {
                 match handle_message(msg) {
                     Ok(_) => {},
                     Err((code, arg)) => error::log_error(code, arg),
                 }
             },
+            Err(syscall::status::NOTREADY) => {
+                large_page::collapse_next();
+            },
             Err(code) => {
                 error::log_error(code, None);
             }
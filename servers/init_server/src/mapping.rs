@@ -1,22 +1,75 @@
 use crate::page::VirtualPage;
-use crate::address::{VAddr, PAddr, Align};
+use crate::address::{VAddr, PAddr, Align, USER_VEND};
 use alloc::collections::btree_set::BTreeSet;
+use alloc::collections::btree_map::BTreeMap;
+use alloc::vec::Vec;
 use crate::Tid;
-use crate::device::DeviceId;
+use crate::device::{self, DeviceId};
 use core::prelude::v1::*;
-use crate::region::{MemoryRegion, RegionSet};
-use core::cmp::Ordering;
+use crate::region::MemoryRegion;
+use core::cmp::{self, Ordering};
 use crate::eprintln;
+use crate::pager::FaultHistory;
+use crate::large_page::LARGE_BLOCK_SIZE;
 
 pub mod manager {
     use crate::address::PAddr;
     use super::AddrSpace;
     use crate::Tid;
     use crate::syscall::{self, INIT_TID};
+    use crate::syscall::c_types::CTid;
     use crate::error;
     use alloc::collections::btree_map::BTreeMap;
+    use alloc::vec::Vec;
+
+    /// A flat table that maps TIDs to the root page maps of their address spaces.
+    /// It grows to fit the highest TID that has been attached so far.
+
+    pub(super) struct TidIndex {
+        entries: Vec<Option<PAddr>>,
+    }
+
+    impl TidIndex {
+        pub(super) const fn new() -> Self {
+            Self {
+                entries: Vec::new(),
+            }
+        }
+
+        pub(super) fn get(&self, tid: &Tid) -> Option<PAddr> {
+            if tid.is_null() {
+                None
+            } else {
+                self.entries
+                    .get(CTid::from(tid) as usize)
+                    .cloned()
+                    .flatten()
+            }
+        }
+
+        pub(super) fn insert(&mut self, tid: &Tid, pmap: PAddr) {
+            if !tid.is_null() {
+                let index = CTid::from(tid) as usize;
+
+                if index >= self.entries.len() {
+                    self.entries.resize(index + 1, None);
+                }
+
+                self.entries[index] = Some(pmap);
+            }
+        }
+
+        pub(super) fn remove(&mut self, tid: &Tid) {
+            if !tid.is_null() {
+                if let Some(entry) = self.entries.get_mut(CTid::from(tid) as usize) {
+                    *entry = None;
+                }
+            }
+        }
+    }
 
     static mut ADDRESS_SPACES: Option<BTreeMap<PAddr, AddrSpace>> = None;
+    static mut TID_INDEX: TidIndex = TidIndex::new();
 
     pub fn init() {
         unsafe {
@@ -56,22 +109,33 @@ pub mod manager {
         }
     }
 
+    fn tid_index() -> &'static mut TidIndex {
+        unsafe { &mut TID_INDEX }
+    }
+
     pub fn lookup_tid<'a>(tid: &Tid) -> Option<&'a AddrSpace> {
-        addr_space_map()
-            .values()
-            .find(|addr_space| addr_space.thread_exists(tid))
+        tid_index()
+            .get(tid)
+            .and_then(|pmap| addr_space_map().get(&pmap))
     }
 
     pub fn lookup_tid_mut<'a>(tid: &Tid) -> Option<&'a mut AddrSpace> {
-        addr_space_map_mut()
-            .values_mut()
-            .find(|addr_space| addr_space.thread_exists(tid))
+        tid_index()
+            .get(tid)
+            .and_then(|pmap| addr_space_map_mut().get_mut(&pmap))
     }
 
+    /// Registers an address space along with the threads that have already
+    /// been attached to it.
+
     pub fn register(addr_space: AddrSpace) -> bool {
         let aspace_map = addr_space_map_mut();
 
         if aspace_map.get(&addr_space.root_page_map).is_none() {
+            for tid in addr_space.attached_threads.iter() {
+                tid_index().insert(tid, addr_space.root_page_map);
+            }
+
             aspace_map.insert(addr_space.root_page_map, addr_space);
             true
         } else {
@@ -79,8 +143,79 @@ pub mod manager {
         }
     }
 
+    pub fn lookup_pmap_mut<'a>(pmap: PAddr) -> Option<&'a mut AddrSpace> {
+        addr_space_map_mut().get_mut(&pmap)
+    }
+
+    /// Returns the number of registered address spaces.
+
+    pub fn count() -> usize {
+        addr_space_map().len()
+    }
+
+    /// Returns the total number of small and large pages that are resident in all
+    /// address spaces. Pages that are shared are counted once for each address space.
+
+    pub fn resident_totals() -> (usize, usize) {
+        addr_space_map()
+            .values()
+            .fold((0, 0), |(small, large), addr_space| {
+                (small + addr_space.resident_page_count(), large + addr_space.large_page_count())
+            })
+    }
+
+    /// Returns the root page map of the address space that follows `pmap` (or the first
+    /// address space if `pmap` is `None`).
+
+    pub fn next_pmap(pmap: Option<PAddr>) -> Option<PAddr> {
+        match pmap {
+            Some(pmap) => addr_space_map().range(pmap+1..).next(),
+            None => addr_space_map().iter().next(),
+        }.map(|(&pmap, _)| pmap)
+    }
+
     pub fn unregister(pmap: PAddr) -> Option<AddrSpace> {
-        addr_space_map_mut().remove(&pmap)
+        addr_space_map_mut()
+            .remove(&pmap)
+            .map(|addr_space| {
+                for tid in addr_space.attached_threads.iter() {
+                    tid_index().remove(tid);
+                }
+
+                addr_space
+            })
+    }
+
+    /// Attaches a thread to a registered address space.
+
+    pub fn attach_thread(pmap: PAddr, tid: Tid) -> bool {
+        match addr_space_map_mut().get_mut(&pmap) {
+            Some(addr_space) => {
+                if addr_space.attach_thread(tid.clone()) {
+                    tid_index().insert(&tid, pmap);
+                    true
+                } else {
+                    false
+                }
+            },
+            None => false,
+        }
+    }
+
+    /// Detaches a thread from whichever registered address space it belongs to.
+
+    pub fn detach_thread(tid: &Tid) -> bool {
+        match lookup_tid_mut(tid) {
+            Some(addr_space) => {
+                if addr_space.detach_thread(tid) {
+                    tid_index().remove(tid);
+                    true
+                } else {
+                    false
+                }
+            },
+            None => false,
+        }
     }
 }
 
@@ -125,10 +260,137 @@ impl AddressMapping {
     }
 }
 
+/// Keeps track of the unmapped gaps of an address space, ordered both by address (to
+/// coalesce neighbors) and by size (for best-fit placement). Gaps are stored as start and
+/// last byte pairs.
+///
+/// The first page is never considered free, so that a mapping placed at any address can
+/// never start at the null address. Neither is anything at or above `USER_VEND`, which
+/// belongs to the kernel.
+
+#[derive(Clone)]
+struct FreeGaps {
+    by_addr: BTreeMap<usize, usize>,
+    by_size: BTreeSet<(usize, usize)>,
+}
+
+impl FreeGaps {
+    const LOWEST_ADDR: usize = VirtualPage::SMALL_PAGE_SIZE;
+    const HIGHEST_ADDR: usize = USER_VEND - 1;
+
+    fn new() -> Self {
+        let mut gaps = Self {
+            by_addr: BTreeMap::new(),
+            by_size: BTreeSet::new(),
+        };
+
+        gaps.insert(Self::LOWEST_ADDR, Self::HIGHEST_ADDR);
+        gaps
+    }
+
+    fn insert(&mut self, start: usize, last: usize) {
+        self.by_addr.insert(start, last);
+        self.by_size.insert((last - start, start));
+    }
+
+    fn remove(&mut self, start: usize) -> Option<usize> {
+        let last = self.by_addr.remove(&start)?;
+
+        self.by_size.remove(&(last - start, start));
+        Some(last)
+    }
+
+    /// Returns the start of the smallest gap that can hold `length` bytes. Ties go to
+    /// the lowest address.
+
+    fn best_fit(&self, length: usize) -> Option<usize> {
+        if length == 0 {
+            return None;
+        }
+
+        self.by_size
+            .range((length - 1, Self::LOWEST_ADDR)..)
+            .next()
+            .map(|&(_, start)| start)
+    }
+
+    /// Removes `start` through `last` from the free gaps. The range must lie entirely
+    /// within one gap.
+
+    fn reserve(&mut self, start: usize, last: usize) {
+        let start = cmp::max(start, Self::LOWEST_ADDR);
+        let last = cmp::min(last, Self::HIGHEST_ADDR);
+
+        if last < start {
+            return;
+        }
+
+        let gap = self.by_addr
+            .range(..=start)
+            .next_back()
+            .map(|(&gap_start, &gap_last)| (gap_start, gap_last));
+
+        match gap {
+            Some((gap_start, gap_last)) if gap_last >= last => {
+                self.remove(gap_start);
+
+                if gap_start < start {
+                    self.insert(gap_start, start - 1);
+                }
+
+                if last < gap_last {
+                    self.insert(last + 1, gap_last);
+                }
+            },
+            _ => eprintln!("Region {:#x}-{:#x} is not free.", start, last),
+        }
+    }
+
+    /// Returns `start` through `last` to the free gaps, merging it with any adjacent gaps.
+
+    fn release(&mut self, start: usize, last: usize) {
+        let mut start = cmp::max(start, Self::LOWEST_ADDR);
+        let mut last = cmp::min(last, Self::HIGHEST_ADDR);
+
+        if last < start {
+            return;
+        }
+
+        let prev = self.by_addr
+            .range(..start)
+            .next_back()
+            .map(|(&prev_start, &prev_last)| (prev_start, prev_last));
+
+        if let Some((prev_start, prev_last)) = prev {
+            if prev_last == start - 1 {
+                self.remove(prev_start);
+                start = prev_start;
+            }
+        }
+
+        if last < Self::HIGHEST_ADDR {
+            if let Some(next_last) = self.remove(last + 1) {
+                last = next_last;
+            }
+        }
+
+        self.insert(start, last);
+    }
+}
+
 pub struct AddrSpace {
     root_page_map: PAddr,
-    vaddr_map: BTreeSet<AddressMapping>,
+    /// Non-overlapping mappings keyed by the start address of their regions
+    vaddr_map: BTreeMap<usize, AddressMapping>,
+    free_gaps: FreeGaps,
+    /// Frames that the pager has mapped, keyed by page address
+    resident: BTreeMap<usize, PAddr>,
+    /// Large blocks that are mapped with large pages, keyed by block address
+    large_resident: BTreeMap<usize, PAddr>,
     attached_threads: BTreeSet<Tid>,
+    pub fault_history: FaultHistory,
+    /// Number of pages whose contents have been written to swap
+    pub swapped_pages: usize,
 }
 
 impl AddrSpace {
@@ -137,25 +399,213 @@ impl AddrSpace {
     pub const COPY_ON_WRITE: u32 = 0x00000004;
     pub const GUARD: u32 = 0x00000008;
     pub const EXTEND_DOWN: u32 = 0x00000010;
+    pub const SHARED: u32 = 0x00000020;
 
     pub fn new(root_pmap: PAddr) -> Self {
         Self {
             root_page_map: root_pmap,
-            vaddr_map: BTreeSet::new(),
+            vaddr_map: BTreeMap::new(),
+            free_gaps: FreeGaps::new(),
+            resident: BTreeMap::new(),
+            large_resident: BTreeMap::new(),
             attached_threads: BTreeSet::new(),
+            fault_history: FaultHistory::new(),
+            swapped_pages: 0,
         }
     }
 
-    // todo: to be implemented
+    /// Reserves a stack of `stack_size` bytes along with a guard page just below it. If
+    /// `stack_top` is `None`, then any free address range is used. No memory is committed
+    /// until the stack is touched: pages are faulted in from the top down, until the
+    /// stack runs into the guard page.
+    ///
+    /// Returns the top of the stack and its size.
+
+    pub fn map_stack(&mut self, stack_top: Option<VAddr>, stack_size: usize) -> Option<(VAddr, usize)> {
+        let page_size = VirtualPage::SMALL_PAGE_SIZE;
+        let zero_device = DeviceId::new_from_tuple((device::pseudo::MAJOR, device::pseudo::ZERO_MINOR));
+        let stack_size = cmp::max(stack_size.align(page_size), page_size);
+
+        let guard_start = match stack_top {
+            Some(top) => (top as usize).checked_sub(stack_size + page_size)?,
+            None => self.free_gaps.best_fit(stack_size + page_size)?,
+        };
 
-    pub fn allocate_stack_memory(&mut self, _stack_size: usize) -> Option<(VAddr, usize)> {
-        None
+        self.map(Some(guard_start as VAddr), &zero_device, 0,
+                 AddrSpace::GUARD | AddrSpace::NO_EXECUTE, page_size)?;
+
+        if self.map(Some((guard_start + page_size) as VAddr), &zero_device, 0,
+                    AddrSpace::EXTEND_DOWN | AddrSpace::NO_EXECUTE, stack_size).is_none() {
+            self.unmap(guard_start as VAddr, page_size);
+            return None;
+        }
+
+        Some(((guard_start + page_size + stack_size) as VAddr, stack_size))
+    }
+
+    pub fn allocate_stack_memory(&mut self, stack_size: usize) -> Option<(VAddr, usize)> {
+        self.map_stack(None, stack_size)
+    }
+
+    /// Returns the range `[start, stack_top)` of a stack that was reserved by `map_stack()`,
+    /// or `None` if there's no such stack. The guard page lies just below `start`.
+
+    pub fn stack_range(&self, stack_top: VAddr, stack_size: usize) -> Option<(usize, usize)> {
+        let page_size = VirtualPage::SMALL_PAGE_SIZE;
+        let stack_size = cmp::max(stack_size.align(page_size), page_size);
+
+        let stack_start = match (stack_top as usize).checked_sub(stack_size) {
+            Some(start) if start >= page_size => start,
+            _ => return None,
+        };
+
+        let is_stack = self.get_mapping(stack_start as VAddr)
+            .map_or(false, |m| m.flags & AddrSpace::EXTEND_DOWN == AddrSpace::EXTEND_DOWN
+                && m.region.start() == stack_start)
+            && self.get_mapping((stack_start - page_size) as VAddr)
+            .map_or(false, |m| m.flags & AddrSpace::GUARD == AddrSpace::GUARD);
+
+        if is_stack {
+            Some((stack_start, stack_top as usize))
+        } else {
+            None
+        }
+    }
+
+    /// Releases a stack (and its guard page) that was reserved by `map_stack()`
+
+    pub fn release_stack_memory(&mut self, stack_top: VAddr, stack_size: usize) -> bool {
+        let page_size = VirtualPage::SMALL_PAGE_SIZE;
+
+        // Make sure that this is actually a stack before unmapping anything
+
+        match self.stack_range(stack_top, stack_size) {
+            Some((stack_start, stack_end)) => self.unmap(stack_start as VAddr, stack_end - stack_start)
+                && self.unmap((stack_start - page_size) as VAddr, page_size),
+            None => false,
+        }
     }
 
     pub fn root_pmap(&self) -> PAddr {
         self.root_page_map
     }
 
+    /// Creates a new address space with the same mappings. Writable mappings in both
+    /// address spaces become copy-on-write. The caller is responsible for sharing the
+    /// resident frames.
+
+    pub fn clone_mappings(&mut self, root_pmap: PAddr) -> AddrSpace {
+        for mapping in self.vaddr_map.values_mut() {
+            if mapping.flags & (AddrSpace::READ_ONLY | AddrSpace::SHARED) == 0 {
+                mapping.flags |= AddrSpace::COPY_ON_WRITE;
+            }
+        }
+
+        let mut addr_space = AddrSpace::new(root_pmap);
+
+        addr_space.vaddr_map = self.vaddr_map.clone();
+        addr_space.free_gaps = self.free_gaps.clone();
+        addr_space
+    }
+
+    pub fn resident_frame(&self, page: usize) -> Option<PAddr> {
+        self.resident.get(&page).cloned()
+    }
+
+    pub fn resident_pages<'a>(&'a self) -> impl Iterator<Item=(usize, PAddr)> + 'a {
+        self.resident.iter().map(|(&page, &frame)| (page, frame))
+    }
+
+    pub fn set_resident(&mut self, page: usize, frame: PAddr) {
+        self.resident.insert(page, frame);
+    }
+
+    pub fn remove_resident(&mut self, page: usize) -> Option<PAddr> {
+        self.resident.remove(&page)
+    }
+
+    /// Returns the first resident page at or above `page`
+
+    pub fn next_resident(&self, page: usize) -> Option<(usize, PAddr)> {
+        self.resident
+            .range(page..)
+            .next()
+            .map(|(&page, &frame)| (page, frame))
+    }
+
+    /// Returns the number of resident small pages in `[start, end)`
+
+    pub fn resident_count(&self, start: usize, end: usize) -> usize {
+        self.resident.range(start..end).count()
+    }
+
+    /// Returns the address and frame of the large block that contains `addr`, if any
+
+    pub fn large_frame(&self, addr: usize) -> Option<(usize, PAddr)> {
+        self.large_resident
+            .range(..=addr)
+            .next_back()
+            .filter(|(&block, _)| addr - block < LARGE_BLOCK_SIZE)
+            .map(|(&block, &frame)| (block, frame))
+    }
+
+    /// Returns the number of small pages that the pager has mapped
+
+    pub fn resident_page_count(&self) -> usize {
+        self.resident.len()
+    }
+
+    /// Returns the number of large blocks that are mapped with large pages
+
+    pub fn large_page_count(&self) -> usize {
+        self.large_resident.len()
+    }
+
+    pub fn large_pages<'a>(&'a self) -> impl Iterator<Item=(usize, PAddr)> + 'a {
+        self.large_resident.iter().map(|(&block, &frame)| (block, frame))
+    }
+
+    pub fn set_large_resident(&mut self, block: usize, frame: PAddr) {
+        self.large_resident.insert(block, frame);
+    }
+
+    pub fn remove_large_resident(&mut self, block: usize) -> Option<PAddr> {
+        self.large_resident.remove(&block)
+    }
+
+    /// Records that a large block is now mapped with small pages. Each page keeps its
+    /// 4 kB piece of the large frame. Returns `false` if the block wasn't resident.
+
+    pub fn split_large_resident(&mut self, block: usize) -> bool {
+        match self.large_resident.remove(&block) {
+            Some(frame) => {
+                for offset in (0..LARGE_BLOCK_SIZE).step_by(VirtualPage::SMALL_PAGE_SIZE) {
+                    self.resident.insert(block + offset, frame + offset as PAddr);
+                }
+
+                true
+            },
+            None => false,
+        }
+    }
+
+    /// Returns `true` if a large block overlaps `[start, end)` without lying entirely
+    /// within it.
+
+    pub fn has_partial_large_block(&self, start: usize, end: usize) -> bool {
+        self.large_resident
+            .range(start.saturating_sub(LARGE_BLOCK_SIZE - 1)..end)
+            .any(|(&block, _)| block < start || block.saturating_add(LARGE_BLOCK_SIZE) > end)
+    }
+
+    pub fn mappings<'a>(&'a self) -> impl Iterator<Item=&'a AddressMapping> + 'a {
+        self.vaddr_map.values()
+    }
+
+    /// Attaches a thread to an address space that hasn't been registered yet. Use
+    /// `manager::attach_thread()` for registered address spaces, so that the thread can
+    /// be looked up.
+
     pub fn attach_thread(&mut self, tid: Tid) -> bool {
         self.attached_threads.insert(tid)
     }
@@ -168,24 +618,44 @@ impl AddrSpace {
         self.attached_threads.remove(tid)
     }
 
-    pub fn get_mapping(&self, addr: VAddr) -> Option<&AddressMapping> {
-        for map in self.vaddr_map.iter() {
-            if map.region.contains(addr as usize) {
-                return Some(map);
-            }
-        }
+    /// Returns the mapping that contains an address. Since mappings don't overlap, only
+    /// the mapping with the closest start address at or below `addr` needs to be checked.
 
-        None
+    pub fn get_mapping(&self, addr: VAddr) -> Option<&AddressMapping> {
+        self.vaddr_map
+            .range(..=addr as usize)
+            .next_back()
+            .map(|(_, map)| map)
+            .filter(|map| map.region.contains(addr as usize))
     }
 
+    /// Returns `true` if any mapping overlaps with `region`. Only the mapping that
+    /// precedes the region and the first mapping that starts within it can overlap.
+
     fn contains_region(&self, region: &MemoryRegion<usize>) -> bool {
-        for map in self.vaddr_map.iter() {
-            if map.region.overlaps(region) {
-                return true;
-            }
-        }
+        let preceding = self.vaddr_map
+            .range(..=region.start())
+            .next_back();
+
+        let following = self.vaddr_map
+            .range(region.start()..)
+            .next();
+
+        preceding.into_iter()
+            .chain(following)
+            .any(|(_, map)| map.region.overlaps(region))
+    }
 
-        false
+    fn insert_mapping(&mut self, mapping: AddressMapping) {
+        self.free_gaps.reserve(mapping.region.start(), mapping.region.end().wrapping_sub(1));
+        self.vaddr_map.insert(mapping.region.start(), mapping);
+    }
+
+    fn remove_mapping(&mut self, start: usize) -> Option<AddressMapping> {
+        let mapping = self.vaddr_map.remove(&start)?;
+
+        self.free_gaps.release(mapping.region.start(), mapping.region.end().wrapping_sub(1));
+        Some(mapping)
     }
 
     /// Maps a region of memory to some block device in a particular address space.
@@ -209,56 +679,72 @@ impl AddrSpace {
                 if self.contains_region(&new_region) {
                     None
                 } else {
-                    self.vaddr_map.insert(AddressMapping::new(new_page, new_region, flags));
+                    self.insert_mapping(AddressMapping::new(new_page, new_region, flags));
                     Some(start_address as VAddr)
                 }
             }
         } else {
-            let available_regions = self.vaddr_map
-                .iter()
-                .fold(RegionSet::empty(), |acc, mapping| {
-                    acc.union(&RegionSet::from(mapping.region.clone()))
-                })
-                .complement();
-
-            for region in available_regions.into_iter() {
-                if let Ok(l) = region.length() {
-                    if l < length {
-                        continue;
-                    }
-                }
+            let length = length.align(VirtualPage::SMALL_PAGE_SIZE);
+            let start_address = self.free_gaps.best_fit(length)?;
+            let new_region: MemoryRegion<usize> =
+                MemoryRegion::new(start_address, start_address.wrapping_add(length));
 
-                let new_region: MemoryRegion<usize> =
-                    MemoryRegion::new(region.start(), region.start() + length);
-
-                self.vaddr_map.insert(AddressMapping::new(new_page, new_region, flags));
-                return Some(region.start() as VAddr);
-            }
-
-            None
+            self.insert_mapping(AddressMapping::new(new_page, new_region, flags));
+            Some(start_address as VAddr)
         }
     }
 
+    /// Removes the pages in `[start_address, start_address + length)` from the mapping at
+    /// `start_address`. Anything past the end of that mapping is left alone. A large block
+    /// that's only partly unmapped has to be split with `large_page::split_blocks()` first;
+    /// otherwise, nothing is unmapped.
+
     pub fn unmap(&mut self, start_address: VAddr, length: usize) -> bool {
-        let end_address = (start_address as usize + length)
-            .align(VirtualPage::SMALL_PAGE_SIZE);
+        let addr_map = self.get_mapping(start_address)
+            .map(|m| m.clone());
+
+        // A region end of 0 means the end of memory
+
+        let end_address = match addr_map.as_ref().map(|m| m.region.end()) {
+            Some(region_end) if region_end != 0 =>
+                cmp::min((start_address as usize).saturating_add(length), region_end),
+            _ => start_address as usize + length,
+        }.align(VirtualPage::SMALL_PAGE_SIZE);
+
         let start_address = (start_address as usize).align_trunc(VirtualPage::SMALL_PAGE_SIZE);
 
         if end_address > start_address {
-            let addr_map = self.get_mapping(start_address as VAddr)
-                .map(|m| m.clone());
-
             let unmapped_region: MemoryRegion<usize> = MemoryRegion::new(start_address, end_address);
 
             match addr_map {
+                Some(_) if self.has_partial_large_block(start_address, end_address) => false,
                 Some(mapping) => {
-                    self.vaddr_map.remove(&mapping);
+                    self.remove_mapping(mapping.region.start());
+
+                    let unmapped_pages = self.resident
+                        .range(start_address..end_address)
+                        .map(|(&page, _)| page)
+                        .collect::<Vec<usize>>();
+
+                    for page in unmapped_pages {
+                        self.resident.remove(&page);
+                    }
+
+                    let unmapped_blocks = self.large_resident
+                        .range(cmp::max(start_address.saturating_sub(LARGE_BLOCK_SIZE - 1),
+                                        mapping.region.start())..end_address)
+                        .map(|(&block, _)| block)
+                        .collect::<Vec<usize>>();
+
+                    for block in unmapped_blocks {
+                        self.large_resident.remove(&block);
+                    }
 
                     for region in mapping.region.difference(&unmapped_region).into_iter() {
                         let mut vpage = mapping.base_page.clone();
 
                         vpage.offset += (region.start() - mapping.region.start()) as u64;
-                        self.vaddr_map.insert(AddressMapping::new(vpage, region, mapping.flags));
+                        self.insert_mapping(AddressMapping::new(vpage, region, mapping.flags));
                     }
 
                     true
@@ -269,4 +755,270 @@ impl AddrSpace {
             false
         }
     }
-}
\ No newline at end of file
+}
+
+#[cfg(test)]
+mod test {
+    use super::AddrSpace;
+    use super::manager::TidIndex;
+    use crate::address::{PAddr, VAddr, USER_VEND};
+    use crate::syscall::INIT_TID;
+    use crate::Tid;
+    use crate::device::DeviceId;
+    use crate::page::VirtualPage;
+    use crate::large_page::LARGE_BLOCK_SIZE;
+
+    const PAGE: usize = VirtualPage::SMALL_PAGE_SIZE;
+    const MAPPING_COUNT: usize = 10000;
+    const BASE_ADDR: usize = 0x10000000;
+
+    #[test]
+    fn test_many_mappings() {
+        let mut addr_space = AddrSpace::new(0x1000);
+        let dev = DeviceId::new(1);
+
+        // Single page mappings separated by an unmapped page
+
+        for i in 0..MAPPING_COUNT {
+            let addr = (BASE_ADDR + 2 * i * PAGE) as VAddr;
+            assert_eq!(addr_space.map(Some(addr), &dev, 0, 0, PAGE), Some(addr));
+        }
+
+        for i in 0..MAPPING_COUNT {
+            let addr = BASE_ADDR + 2 * i * PAGE;
+
+            assert!(addr_space.get_mapping((addr + PAGE / 2) as VAddr)
+                .map_or(false, |m| m.region.start() == addr));
+            assert!(addr_space.get_mapping((addr + PAGE) as VAddr).is_none());
+        }
+
+        assert!(addr_space.get_mapping((BASE_ADDR - 1) as VAddr).is_none());
+
+        // Overlapping requests must fail, while the gaps can still be mapped
+
+        assert!(addr_space.map(Some((BASE_ADDR + 4 * PAGE) as VAddr), &dev, 0, 0, 2 * PAGE).is_none());
+        assert!(addr_space.map(Some((BASE_ADDR - PAGE) as VAddr), &dev, 0, 0, 2 * PAGE).is_none());
+        assert!(addr_space.map(Some((BASE_ADDR + PAGE) as VAddr), &dev, 0, 0, PAGE).is_some());
+
+        assert!(addr_space.unmap(BASE_ADDR as VAddr, PAGE));
+        assert!(addr_space.get_mapping(BASE_ADDR as VAddr).is_none());
+        assert!(addr_space.get_mapping((BASE_ADDR + PAGE) as VAddr).is_some());
+    }
+
+    #[test]
+    fn test_map_any_address() {
+        let mut addr_space = AddrSpace::new(0x1000);
+        let dev = DeviceId::new(1);
+
+        for i in 0..4 {
+            let addr = (BASE_ADDR + 4 * i * PAGE) as VAddr;
+            assert!(addr_space.map(Some(addr), &dev, 0, 0, PAGE).is_some());
+        }
+
+        // Best fit: the three page gaps between the mappings are used first
+
+        assert_eq!(addr_space.map(None, &dev, 0, 0, 3 * PAGE), Some((BASE_ADDR + PAGE) as VAddr));
+        assert_eq!(addr_space.map(None, &dev, 0, 0, 2 * PAGE), Some((BASE_ADDR + 5 * PAGE) as VAddr));
+        assert_eq!(addr_space.map(None, &dev, 0, 0, PAGE), Some((BASE_ADDR + 7 * PAGE) as VAddr));
+
+        // Unmapping coalesces the freed range with its neighbors
+
+        assert!(addr_space.unmap((BASE_ADDR + 4 * PAGE) as VAddr, PAGE));
+        assert!(addr_space.unmap((BASE_ADDR + 5 * PAGE) as VAddr, 2 * PAGE));
+        assert_eq!(addr_space.map(None, &dev, 0, 0, 3 * PAGE), Some((BASE_ADDR + 4 * PAGE) as VAddr));
+
+        assert!(addr_space.map(None, &dev, 0, 0, 0).is_none());
+    }
+
+    #[test]
+    fn test_map_below_kernel() {
+        let mut addr_space = AddrSpace::new(0x1000);
+        let dev = DeviceId::new(1);
+        let length = 256 * 1024 * 1024;
+
+        while let Some(addr) = addr_space.map(None, &dev, 0, 0, length) {
+            assert!(addr as usize + length <= USER_VEND);
+        }
+
+        while let Some(addr) = addr_space.map(None, &dev, 0, 0, 64 * PAGE) {
+            assert!(addr as usize + 64 * PAGE <= USER_VEND);
+        }
+
+        // All of user space is mapped, except for the first page
+
+        let mut addr_space = AddrSpace::new(0x1000);
+
+        assert_eq!(addr_space.map(None, &dev, 0, 0, USER_VEND - PAGE), Some(PAGE as VAddr));
+        assert!(addr_space.map(None, &dev, 0, 0, PAGE).is_none());
+
+        // Unmapping the end of user space doesn't free anything above it
+
+        assert!(addr_space.unmap((USER_VEND - PAGE) as VAddr, PAGE));
+        assert_eq!(addr_space.map(None, &dev, 0, 0, PAGE), Some((USER_VEND - PAGE) as VAddr));
+        assert!(addr_space.map(None, &dev, 0, 0, PAGE).is_none());
+    }
+
+    #[test]
+    fn test_map_stack() {
+        let mut addr_space = AddrSpace::new(0x1000);
+        let stack_top = BASE_ADDR + 16 * PAGE;
+
+        // The stack ends at its top and has a guard page below it
+
+        assert_eq!(addr_space.map_stack(Some(stack_top as VAddr), 4 * PAGE - 1), Some((stack_top as VAddr, 4 * PAGE)));
+
+        let stack = addr_space.get_mapping((stack_top - PAGE) as VAddr).unwrap();
+
+        assert_eq!(stack.region.start(), stack_top - 4 * PAGE);
+        assert_eq!(stack.flags & AddrSpace::EXTEND_DOWN, AddrSpace::EXTEND_DOWN);
+        assert_eq!(addr_space.get_mapping((stack_top - 5 * PAGE) as VAddr).unwrap().flags & AddrSpace::GUARD,
+                   AddrSpace::GUARD);
+        assert!(addr_space.get_mapping(stack_top as VAddr).is_none());
+        assert!(addr_space.get_mapping((stack_top - 6 * PAGE) as VAddr).is_none());
+
+        // Stacks can't overlap
+
+        assert!(addr_space.map_stack(Some((stack_top - PAGE) as VAddr), PAGE).is_none());
+
+        // Only whole stacks are released
+
+        assert_eq!(addr_space.stack_range(stack_top as VAddr, 4 * PAGE), Some((stack_top - 4 * PAGE, stack_top)));
+        assert_eq!(addr_space.stack_range(stack_top as VAddr, 2 * PAGE), None);
+        assert!(!addr_space.release_stack_memory(stack_top as VAddr, 2 * PAGE));
+        assert!(addr_space.release_stack_memory(stack_top as VAddr, 4 * PAGE));
+        assert!(addr_space.get_mapping((stack_top - PAGE) as VAddr).is_none());
+        assert!(addr_space.get_mapping((stack_top - 5 * PAGE) as VAddr).is_none());
+
+        // Stacks without a fixed top are placed anywhere
+
+        let (top, size) = addr_space.allocate_stack_memory(PAGE).unwrap();
+
+        assert_eq!(size, PAGE);
+        assert!(addr_space.release_stack_memory(top, size));
+    }
+
+    #[test]
+    fn test_tid_index() {
+        let mut index = TidIndex::new();
+
+        // 500 address spaces with two threads each
+
+        for i in 0..500u16 {
+            let pmap = 0x100000 + i as PAddr * 0x1000;
+
+            index.insert(&Tid::new(INIT_TID + 1 + 2 * i), pmap);
+            index.insert(&Tid::new(INIT_TID + 2 + 2 * i), pmap);
+        }
+
+        for i in 0..500u16 {
+            let pmap = 0x100000 + i as PAddr * 0x1000;
+
+            assert_eq!(index.get(&Tid::new(INIT_TID + 1 + 2 * i)), Some(pmap));
+            assert_eq!(index.get(&Tid::new(INIT_TID + 2 + 2 * i)), Some(pmap));
+        }
+
+        index.remove(&Tid::new(INIT_TID + 1));
+
+        assert_eq!(index.get(&Tid::new(INIT_TID + 1)), None);
+        assert_eq!(index.get(&Tid::new(INIT_TID + 2)), Some(0x100000));
+        assert_eq!(index.get(&Tid::new(INIT_TID + 2000)), None);
+        assert_eq!(index.get(&Tid::null()), None);
+    }
+
+    #[test]
+    fn test_clone_mappings() {
+        let mut parent = AddrSpace::new(0x1000);
+        let dev = DeviceId::new(1);
+
+        parent.map(Some(BASE_ADDR as VAddr), &dev, 0, 0, 2 * PAGE);
+        parent.map(Some((BASE_ADDR + 4 * PAGE) as VAddr), &dev, 0, AddrSpace::READ_ONLY, PAGE);
+        parent.set_resident(BASE_ADDR, 0x200000);
+        parent.set_resident(BASE_ADDR + PAGE, 0x201000);
+
+        let child = parent.clone_mappings(0x2000);
+
+        for addr_space in [&parent, &child].iter() {
+            let writable = addr_space.get_mapping(BASE_ADDR as VAddr).unwrap();
+            let read_only = addr_space.get_mapping((BASE_ADDR + 4 * PAGE) as VAddr).unwrap();
+
+            assert_eq!(writable.flags & AddrSpace::COPY_ON_WRITE, AddrSpace::COPY_ON_WRITE);
+            assert_eq!(read_only.flags & AddrSpace::COPY_ON_WRITE, 0);
+        }
+
+        // Resident frames are shared by the pager, not by clone_mappings()
+
+        assert_eq!(child.resident_frame(BASE_ADDR), None);
+
+        assert!(parent.unmap((BASE_ADDR + PAGE) as VAddr, PAGE));
+        assert_eq!(parent.resident_frame(BASE_ADDR), Some(0x200000));
+        assert_eq!(parent.resident_frame(BASE_ADDR + PAGE), None);
+    }
+
+    #[test]
+    fn test_large_frames() {
+        let mut addr_space = AddrSpace::new(0x1000);
+        let dev = DeviceId::new(1);
+
+        addr_space.map(Some(BASE_ADDR as VAddr), &dev, 0, 0, 2 * LARGE_BLOCK_SIZE);
+        addr_space.set_large_resident(BASE_ADDR, 0x800000);
+        addr_space.set_large_resident(BASE_ADDR + LARGE_BLOCK_SIZE, 0xC00000);
+
+        assert_eq!(addr_space.large_frame(BASE_ADDR - 1), None);
+        assert_eq!(addr_space.large_frame(BASE_ADDR + LARGE_BLOCK_SIZE - 1), Some((BASE_ADDR, 0x800000)));
+        assert_eq!(addr_space.large_frame(BASE_ADDR + LARGE_BLOCK_SIZE),
+                   Some((BASE_ADDR + LARGE_BLOCK_SIZE, 0xC00000)));
+        assert_eq!(addr_space.large_frame(BASE_ADDR + 2 * LARGE_BLOCK_SIZE), None);
+
+        // Part of a block can't be unmapped until the block has been split
+
+        let last_page = BASE_ADDR + LARGE_BLOCK_SIZE - PAGE;
+
+        assert!(addr_space.has_partial_large_block(last_page, last_page + PAGE));
+        assert!(!addr_space.unmap(last_page as VAddr, PAGE));
+        assert_eq!(addr_space.large_frame(BASE_ADDR), Some((BASE_ADDR, 0x800000)));
+        assert!(addr_space.get_mapping(last_page as VAddr).is_some());
+
+        assert!(addr_space.split_large_resident(BASE_ADDR));
+        assert_eq!(addr_space.large_frame(BASE_ADDR), None);
+        assert_eq!(addr_space.resident_frame(BASE_ADDR + PAGE), Some(0x800000 + PAGE as PAddr));
+        assert_eq!(addr_space.resident_count(BASE_ADDR, BASE_ADDR + LARGE_BLOCK_SIZE), LARGE_BLOCK_SIZE / PAGE);
+
+        // The rest of the block stays resident
+
+        assert!(addr_space.unmap(last_page as VAddr, PAGE));
+        assert_eq!(addr_space.resident_frame(last_page), None);
+        assert_eq!(addr_space.resident_frame(last_page - PAGE), Some(0x800000 + (LARGE_BLOCK_SIZE - 2 * PAGE) as PAddr));
+        assert!(addr_space.get_mapping(last_page as VAddr).is_none());
+        assert!(addr_space.large_frame(BASE_ADDR + LARGE_BLOCK_SIZE).is_some());
+
+        // Unmapping a whole block is fine
+
+        assert!(addr_space.unmap((BASE_ADDR + LARGE_BLOCK_SIZE) as VAddr, LARGE_BLOCK_SIZE));
+        assert_eq!(addr_space.large_frame(BASE_ADDR + LARGE_BLOCK_SIZE), None);
+    }
+
+    #[test]
+    fn test_unmap_past_mapping() {
+        let mut addr_space = AddrSpace::new(0x1000);
+        let dev = DeviceId::new(1);
+        let next_addr = BASE_ADDR + LARGE_BLOCK_SIZE;
+
+        // A small mapping that's immediately followed by a large one
+
+        addr_space.map(Some((next_addr - 2 * PAGE) as VAddr), &dev, 0, 0, 2 * PAGE);
+        addr_space.map(Some(next_addr as VAddr), &dev, 0, 0, 2 * LARGE_BLOCK_SIZE);
+        addr_space.set_resident(next_addr - PAGE, 0x200000);
+        addr_space.set_resident(next_addr + PAGE, 0x201000);
+        addr_space.set_large_resident(next_addr + LARGE_BLOCK_SIZE, 0x800000);
+
+        // Only the first mapping and its pages are removed
+
+        assert!(addr_space.unmap((next_addr - 2 * PAGE) as VAddr, 3 * LARGE_BLOCK_SIZE));
+        assert!(addr_space.get_mapping((next_addr - PAGE) as VAddr).is_none());
+        assert_eq!(addr_space.resident_frame(next_addr - PAGE), None);
+
+        assert!(addr_space.get_mapping(next_addr as VAddr).map_or(false, |m| m.region.start() == next_addr));
+        assert_eq!(addr_space.resident_frame(next_addr + PAGE), Some(0x201000));
+        assert_eq!(addr_space.large_frame(next_addr + LARGE_BLOCK_SIZE), Some((next_addr + LARGE_BLOCK_SIZE, 0x800000)));
+    }
+}
@@ -255,6 +255,38 @@ pub fn receive<T: Sized>(sender: &Tid, flags: i32) -> Result<(Message<T>, usize)
     }
 }
 
+/// Sends `request` to `recipient` and waits for a response whose payload is written
+/// directly into `response`. Returns the response subject along with the number of
+/// bytes that were transferred.
+
+pub fn call_buffers(recipient: &Tid, subject: i32, request: &[u8], response: &mut [u8]) -> Result<(i32, usize)> {
+    let mut send_msg = RawMessage {
+        subject,
+        sender: Tid::null_ctid(),
+        recipient: recipient.into(),
+        buffer: request.as_ptr() as *mut c_void,
+        buffer_len: request.len(),
+        bytes_transferred: 0,
+        flags: 0,
+    };
+
+    let mut recv_msg = RawMessage {
+        subject: 0,
+        sender: Tid::null_ctid(),
+        recipient: Tid::null_ctid(),
+        buffer: response.as_mut_ptr() as *mut c_void,
+        buffer_len: response.len(),
+        bytes_transferred: 0,
+        flags: 0,
+    };
+
+    match unsafe { syscall::sys_call(&mut send_msg as *mut RawMessage,
+                                     &mut recv_msg as *mut RawMessage) } {
+        status::OK => Ok((recv_msg.subject, recv_msg.bytes_transferred)),
+        r => Err(r),
+    }
+}
+
 pub mod kernel {
     pub const EXCEPTION: i32 = -1;
     pub const IRQ: i32 = -2;
@@ -290,6 +322,7 @@ pub mod kernel {
         pub const FETCH: u32 = 0x10;
     }
 
+    #[derive(Clone)]
     pub struct ExceptionMessage {
         pub int_num: u32,
         pub who: Tid,
@@ -464,6 +497,19 @@ pub mod init {
     pub const MAP_IO: i32 = 12;         // Reserve an IO port range
     pub const UNMAP_IO: i32 = 13;       // Release an IO port range
 
+    pub const ALLOC_STACK: i32 = 14;    // Reserve a thread stack that grows on demand
+    pub const FREE_STACK: i32 = 15;
+    pub const SYNC: i32 = 16;           // Write back the dirty pages of file mappings
+
+    pub const CREATE_SHM: i32 = 17;     // Create a named shared memory region
+    pub const ATTACH_SHM: i32 = 18;
+    pub const DETACH_SHM: i32 = 19;
+    pub const DELETE_SHM: i32 = 20;
+
+    pub const MEMORY_STATS: i32 = 21;   // Report physical memory usage and fragmentation
+
+    pub const CLONE: i32 = 22;          // Start a thread in a copy-on-write clone of the sender's address space
+
     pub trait Valid {
         fn validate(&self) -> Result<()>;
     }
@@ -758,6 +804,379 @@ pub mod init {
     pub struct UnmapResponse {}
     impl SimpleResponse for UnmapResponse {}
 
+    #[derive(Clone)]
+    #[repr(C)]
+    pub struct RawAllocStackRequest {
+        pub length: usize,
+    }
+
+    impl TryFrom<RawMessage> for RawAllocStackRequest {
+        type Error = i32;
+
+        fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+            if msg.buffer_len < mem::size_of::<RawAllocStackRequest>() {
+                Err(error::PARSE_ERROR)
+            } else {
+                let length_ptr = (msg.buffer.wrapping_add(offset_of!(RawAllocStackRequest, length))) as *const [u8; mem::size_of::<usize>()];
+                let length_arr = unsafe { length_ptr.read() };
+
+                Ok(RawAllocStackRequest {
+                    length: usize::from_le_bytes(length_arr),
+                })
+            }
+        }
+    }
+
+    pub struct AllocStackRequest {
+        pub length: usize,
+    }
+
+    impl From<RawAllocStackRequest> for AllocStackRequest {
+        fn from(raw_msg: RawAllocStackRequest) -> Self {
+            AllocStackRequest {
+                length: raw_msg.length,
+            }
+        }
+    }
+
+    impl TryFrom<RawMessage> for AllocStackRequest {
+        type Error = i32;
+        fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+            RawAllocStackRequest::try_from(value)
+                .map(|request| Self::from(request))
+                .and_then(|request| request.validate().map(move |_| request))
+        }
+    }
+
+    impl Valid for AllocStackRequest {
+        fn validate(&self) -> Result<()> {
+            if self.length == 0 {
+                Err(ZERO_LENGTH)
+            } else {
+                Ok(())
+            }
+        }
+    }
+
+    /// A FREE_STACK request is an UnmapRequest with the address set to the top of the stack
+    pub type FreeStackRequest = UnmapRequest;
+
+    /// A SYNC request has the same layout as an UnmapRequest
+    pub type SyncRequest = UnmapRequest;
+
+    #[repr(C)]
+    #[derive(Clone)]
+    pub struct RawCreateShmRequest {
+        pub name: [u8; MAX_NAME_LEN],
+        pub length: usize,
+        pub flags: i32,
+    }
+
+    impl TryFrom<RawMessage> for RawCreateShmRequest {
+        type Error = i32;
+
+        fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+            if msg.buffer_len < mem::size_of::<RawCreateShmRequest>() {
+                Err(error::PARSE_ERROR)
+            } else {
+                let name_ptr = msg.buffer as *const [u8; MAX_NAME_LEN];
+                let length_ptr = (msg.buffer.wrapping_add(offset_of!(RawCreateShmRequest, length))) as *const [u8; mem::size_of::<usize>()];
+                let flags_ptr = (msg.buffer.wrapping_add(offset_of!(RawCreateShmRequest, flags))) as *const [u8; mem::size_of::<i32>()];
+
+                unsafe {
+                    Ok(RawCreateShmRequest {
+                        name: name_ptr.read(),
+                        length: usize::from_le_bytes(length_ptr.read()),
+                        flags: i32::from_le_bytes(flags_ptr.read()),
+                    })
+                }
+            }
+        }
+    }
+
+    pub struct CreateShmRequest {
+        pub name: Vec<u8>,
+        pub length: usize,
+        pub flags: u32,
+    }
+
+    impl CreateShmRequest {
+        /// Other processes may attach the region read-only
+        pub const OTHERS_READ: u32 = 0x01;
+
+        /// Other processes may attach the region read-write
+        pub const OTHERS_WRITE: u32 = 0x02;
+    }
+
+    impl From<RawCreateShmRequest> for CreateShmRequest {
+        fn from(raw_msg: RawCreateShmRequest) -> Self {
+            let name = raw_msg.name.split(|c| *c == 0)
+                .next()
+                .unwrap_or(&raw_msg.name);
+
+            Self {
+                name: Vec::from(name),
+                length: raw_msg.length,
+                flags: raw_msg.flags as u32,
+            }
+        }
+    }
+
+    impl TryFrom<RawMessage> for CreateShmRequest {
+        type Error = i32;
+        fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+            RawCreateShmRequest::try_from(value)
+                .map(|request| Self::from(request))
+                .and_then(|request| {
+                    if request.length == 0 {
+                        Err(ZERO_LENGTH)
+                    } else {
+                        request.name_string().map(move |_| request)
+                    }
+                })
+        }
+    }
+
+    impl NameString for CreateShmRequest {
+        fn name_vec(&self) -> &Vec<u8> {
+            &self.name
+        }
+    }
+
+    #[repr(C)]
+    #[derive(Clone)]
+    pub struct RawAttachShmRequest {
+        pub name: [u8; MAX_NAME_LEN],
+        pub address: *const c_void,
+        pub flags: i32,
+    }
+
+    impl TryFrom<RawMessage> for RawAttachShmRequest {
+        type Error = i32;
+
+        fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+            if msg.buffer_len < mem::size_of::<RawAttachShmRequest>() {
+                Err(error::PARSE_ERROR)
+            } else {
+                let name_ptr = msg.buffer as *const [u8; MAX_NAME_LEN];
+                let address_ptr = (msg.buffer.wrapping_add(offset_of!(RawAttachShmRequest, address))) as *const [u8; mem::size_of::<usize>()];
+                let flags_ptr = (msg.buffer.wrapping_add(offset_of!(RawAttachShmRequest, flags))) as *const [u8; mem::size_of::<i32>()];
+
+                unsafe {
+                    Ok(RawAttachShmRequest {
+                        name: name_ptr.read(),
+                        address: usize::from_le_bytes(address_ptr.read()) as *const c_void,
+                        flags: i32::from_le_bytes(flags_ptr.read()),
+                    })
+                }
+            }
+        }
+    }
+
+    pub struct AttachShmRequest {
+        pub name: Vec<u8>,
+        pub address: Option<VAddr>,
+        pub flags: u32,
+    }
+
+    impl AttachShmRequest {
+        pub const READ_ONLY: u32 = 0x01;
+    }
+
+    impl From<RawAttachShmRequest> for AttachShmRequest {
+        fn from(raw_msg: RawAttachShmRequest) -> Self {
+            let name = raw_msg.name.split(|c| *c == 0)
+                .next()
+                .unwrap_or(&raw_msg.name);
+
+            Self {
+                name: Vec::from(name),
+                address: if raw_msg.address.is_null() {
+                    None
+                } else {
+                    Some(raw_msg.address as VAddr)
+                },
+                flags: raw_msg.flags as u32,
+            }
+        }
+    }
+
+    impl TryFrom<RawMessage> for AttachShmRequest {
+        type Error = i32;
+        fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+            RawAttachShmRequest::try_from(value)
+                .map(|request| Self::from(request))
+                .and_then(|request| request.name_string().map(move |_| request))
+        }
+    }
+
+    impl NameString for AttachShmRequest {
+        fn name_vec(&self) -> &Vec<u8> {
+            &self.name
+        }
+    }
+
+    /// A DETACH_SHM request is an UnmapRequest with the address set to the start of the
+    /// attached region. The length is ignored.
+    pub type DetachShmRequest = UnmapRequest;
+
+    /// A DELETE_SHM request carries only the name of the region
+    pub type DeleteShmRequest = UnregisterNameRequest;
+
+    #[derive(Clone)]
+    #[repr(C)]
+    pub struct RawMemoryStatsRequest {
+        pub tid: CTid,
+    }
+
+    impl TryFrom<RawMessage> for RawMemoryStatsRequest {
+        type Error = i32;
+
+        fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+            if msg.buffer_len < mem::size_of::<RawMemoryStatsRequest>() {
+                Err(error::PARSE_ERROR)
+            } else {
+                let tid_ptr = (msg.buffer.wrapping_add(offset_of!(RawMemoryStatsRequest, tid))) as *const [u8; mem::size_of::<CTid>()];
+                let tid_arr = unsafe { tid_ptr.read() };
+
+                Ok(RawMemoryStatsRequest {
+                    tid: CTid::from_le_bytes(tid_arr),
+                })
+            }
+        }
+    }
+
+    pub struct MemoryStatsRequest {
+        /// The thread whose address space is reported (the sender's if null)
+        pub tid: Tid,
+    }
+
+    impl From<RawMemoryStatsRequest> for MemoryStatsRequest {
+        fn from(raw_msg: RawMemoryStatsRequest) -> Self {
+            MemoryStatsRequest {
+                tid: Tid::new(raw_msg.tid),
+            }
+        }
+    }
+
+    impl TryFrom<RawMessage> for MemoryStatsRequest {
+        type Error = i32;
+        fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+            RawMemoryStatsRequest::try_from(value)
+                .map(|request| Self::from(request))
+        }
+    }
+
+    /// A compact report of physical memory usage. Block counts are indexed by
+    /// `BlockSize::level()` and page counts are in 4 kB pages unless noted otherwise.
+
+    #[derive(Clone, Default)]
+    #[repr(C)]
+    pub struct RawMemoryStats {
+        pub total_blocks: [usize; 4],
+        pub free_blocks: [usize; 4],
+        pub used_blocks: [usize; 4],
+        pub free_frames: usize,
+        pub largest_free_run: usize,
+        pub zeroed_frames: usize,
+        pub zeroed_large_frames: usize,     // 4 MB blocks
+        pub cached_pages: usize,
+        pub swap_used: usize,
+        pub swap_total: usize,
+        pub shm_regions: usize,
+        pub shm_frames: usize,
+        pub address_spaces: usize,
+        pub total_resident_pages: usize,
+        pub total_large_pages: usize,       // 4 MB blocks
+        pub resident_pages: usize,          // of the requested address space
+        pub large_pages: usize,             // of the requested address space (4 MB blocks)
+        pub swapped_pages: usize,           // of the requested address space
+        pub heap_bytes: usize,              // taken by the init server's allocator (bytes)
+        pub heap_bytes_in_use: usize,
+        pub zero_frame_mappings: usize,     // pages mapped to the shared zero frame
+        pub zero_pages: usize,              // of the requested address space
+    }
+
+    pub struct MemoryStatsResponse {}
+
+    impl MemoryStatsResponse {
+        pub fn new_message(recipient: Tid, stats: Option<RawMemoryStats>, flags: i32) -> Message<RawMemoryStats> {
+            Message {
+                subject: if stats.is_some() { RawMessage::RESPONSE_OK } else { RawMessage::RESPONSE_FAIL },
+                sender: Tid::null(),
+                recipient,
+                data: stats.map(Box::new),
+                bytes_transferred: None,
+                flags,
+            }
+        }
+    }
+
+    #[derive(Clone)]
+    #[repr(C)]
+    pub struct RawCloneRequest {
+        pub entry: *const c_void,
+        pub stack_top: *const c_void,
+    }
+
+    impl TryFrom<RawMessage> for RawCloneRequest {
+        type Error = i32;
+
+        fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+            if msg.buffer_len < mem::size_of::<RawCloneRequest>() {
+                Err(error::PARSE_ERROR)
+            } else {
+                let entry_ptr = (msg.buffer.wrapping_add(offset_of!(RawCloneRequest, entry))) as *const [u8; mem::size_of::<usize>()];
+                let stack_top_ptr = (msg.buffer.wrapping_add(offset_of!(RawCloneRequest, stack_top))) as *const [u8; mem::size_of::<usize>()];
+
+                let (entry_arr, stack_top_arr) = unsafe { (entry_ptr.read(), stack_top_ptr.read()) };
+
+                Ok(RawCloneRequest {
+                    entry: usize::from_le_bytes(entry_arr) as *const c_void,
+                    stack_top: usize::from_le_bytes(stack_top_arr) as *const c_void,
+                })
+            }
+        }
+    }
+
+    pub struct CloneRequest {
+        /// Where the new thread starts. The clone has the same mappings as the sender, so
+        /// this is an address in the sender's image.
+        pub entry: VAddr,
+        pub stack_top: VAddr,
+    }
+
+    impl From<RawCloneRequest> for CloneRequest {
+        fn from(raw_msg: RawCloneRequest) -> Self {
+            CloneRequest {
+                entry: raw_msg.entry as VAddr,
+                stack_top: raw_msg.stack_top as VAddr,
+            }
+        }
+    }
+
+    impl TryFrom<RawMessage> for CloneRequest {
+        type Error = i32;
+        fn try_from(value: RawMessage) -> result::Result<Self, Self::Error> {
+            RawCloneRequest::try_from(value)
+                .map(|request| Self::from(request))
+                .and_then(|request| request.validate().map(move |_| request))
+        }
+    }
+
+    impl Valid for CloneRequest {
+        fn validate(&self) -> Result<()> {
+            if self.entry.is_null() || self.stack_top.is_null() {
+                Err(INVALID_ADDRESS)
+            } else {
+                Ok(())
+            }
+        }
+    }
+
+    /// A CLONE request is answered like a LOOKUP_NAME request, with the TID of the new thread
+    pub type CloneResponse = LookupNameResponse;
+
     /*
     pub struct CreatePortRequest {
         pub pid: Pid,
@@ -1443,3 +1862,81 @@ pub mod init {
         }
     }
 }
+
+/// Requests that are handled by device drivers (see `os/dev_interface.h`)
+
+pub mod device {
+    use super::{Message, RawMessage};
+    use crate::Tid;
+    use crate::error;
+    use alloc::boxed::Box;
+    use core::convert::TryFrom;
+    use core::{mem, result, slice};
+
+    pub const DEVICE_READ: i32 = 0;
+    pub const DEVICE_WRITE: i32 = 1;
+
+    /// Sent by the init server's I/O thread to the main thread once a driver has answered
+    /// a request that was made on the main thread's behalf. Never sent by other threads.
+    pub const IO_COMPLETE: i32 = 0x100;
+
+    /// The header of a read or write request. The data to be written immediately
+    /// follows it.
+
+    #[derive(Clone)]
+    #[repr(C)]
+    pub struct RawDeviceOpRequest {
+        pub device_minor: u16,
+        pub offset: u64,
+        pub length: usize,
+        pub flags: i32,
+    }
+
+    impl RawDeviceOpRequest {
+        pub fn as_bytes(&self) -> &[u8] {
+            unsafe {
+                slice::from_raw_parts(self as *const Self as *const u8, mem::size_of::<Self>())
+            }
+        }
+    }
+
+    #[derive(Clone)]
+    #[repr(C)]
+    pub struct RawIoComplete {
+        pub id: u32,
+        pub status: i32,
+    }
+
+    impl TryFrom<RawMessage> for RawIoComplete {
+        type Error = i32;
+
+        fn try_from(msg: RawMessage) -> result::Result<Self, Self::Error> {
+            if msg.buffer_len < mem::size_of::<RawIoComplete>() {
+                Err(error::PARSE_ERROR)
+            } else {
+                let id_ptr = (msg.buffer.wrapping_add(offset_of!(RawIoComplete, id))) as *const [u8; mem::size_of::<u32>()];
+                let status_ptr = (msg.buffer.wrapping_add(offset_of!(RawIoComplete, status))) as *const [u8; mem::size_of::<i32>()];
+
+                let (id_arr, status_arr) = unsafe { (id_ptr.read(), status_ptr.read()) };
+
+                Ok(RawIoComplete {
+                    id: u32::from_le_bytes(id_arr),
+                    status: i32::from_le_bytes(status_arr),
+                })
+            }
+        }
+    }
+
+    impl RawIoComplete {
+        pub fn new_message(id: u32, status: i32) -> Message<RawIoComplete> {
+            Message {
+                subject: IO_COMPLETE,
+                sender: Tid::null(),
+                recipient: Tid::null(),
+                data: Some(Box::new(RawIoComplete { id, status })),
+                bytes_transferred: None,
+                flags: 0,
+            }
+        }
+    }
+}
@@ -10,6 +10,14 @@ impl PhysicalPage {
     pub const PSE_LARGE_PAGE_SIZE: PSize = 0x400000;
     pub const HUGE_PAGE_SIZE: PSize = 0x40000000;
 
+    /// The size of a large page on the paging mode used by the kernel
+    #[cfg(feature = "pae")]
+    pub const LARGE_PAGE_SIZE: PSize = Self::PAE_LARGE_PAGE_SIZE;
+
+    /// The size of a large page on the paging mode used by the kernel
+    #[cfg(not(feature = "pae"))]
+    pub const LARGE_PAGE_SIZE: PSize = Self::PSE_LARGE_PAGE_SIZE;
+
     pub fn new(address: PAddr) -> Self {
         Self(address)
     }
@@ -66,7 +74,7 @@ impl VirtualPage {
     const UNSWAPPABLE: u32 = 0x00000008;
 
     pub const SMALL_PAGE_SIZE: usize = PhysicalPage::SMALL_PAGE_SIZE as usize;
-    pub const LARGE_PAGE_SIZE: usize = PhysicalPage::PAE_LARGE_PAGE_SIZE as usize;
+    pub const LARGE_PAGE_SIZE: usize = PhysicalPage::LARGE_PAGE_SIZE as usize;
     pub const HUGE_PAGE_SIZE: usize = PhysicalPage::HUGE_PAGE_SIZE as usize;
 
     pub(crate) fn new(device: DeviceId, offset: u64, flags: u32) -> VirtualPage {
@@ -120,6 +128,17 @@ mod test {
         assert_eq!(&p.components(), &components);
     }
 
+    #[test]
+    fn test_large_page_size() {
+        if cfg!(feature = "pae") {
+            assert_eq!(PhysicalPage::LARGE_PAGE_SIZE, PhysicalPage::PAE_LARGE_PAGE_SIZE);
+        } else {
+            assert_eq!(PhysicalPage::LARGE_PAGE_SIZE, PhysicalPage::PSE_LARGE_PAGE_SIZE);
+        }
+
+        assert_eq!(VirtualPage::LARGE_PAGE_SIZE as PSize, PhysicalPage::LARGE_PAGE_SIZE);
+    }
+
     #[test]
     fn test_new_from_frame() {
         let frame = 55132;
@@ -8,11 +8,23 @@ use crate::mapping;
 use crate::error::{ILLEGAL_MEM_ACCESS, OPERATION_FAILED};
 use alloc::string::String;
 use core::ffi::c_void;
-use crate::syscall::flags::map::{READ_WRITE, READ_ONLY};
+use crate::syscall::flags::map::{READ_WRITE, READ_ONLY, NO_EXECUTE, OVERWRITE};
 use crate::eprintln;
-use crate::syscall::c_types::ThreadInfo;
+use crate::syscall::c_types::{ThreadInfo, NULL_TID};
+use crate::syscall::ThreadStruct;
 use core::convert::TryInto;
-use crate::mapping::AddrSpace;
+use core::cmp;
+use crate::mapping::{AddrSpace, AddressMapping};
+use crate::address::{Align, PAddr, VAddr};
+use crate::phys_alloc::{self, BlockSize};
+use crate::lowlevel::phys;
+use alloc::vec::Vec;
+use alloc::collections::btree_map::BTreeMap;
+use crate::page::{PhysicalPage, VirtualPage};
+use crate::reclaim;
+use crate::large_page;
+use crate::file_map;
+use crate::shm;
 
 mod new_allocator {
     use crate::address::{PAddr, PSize};
@@ -245,10 +257,468 @@ mod new_allocator {
 
 pub type DeviceId = u32;
 
+/// The maximum number of pages that are mapped in response to a single page fault.
+const FAULT_AROUND_MAX_PAGES: usize = 16;
+
+/// Keeps track of the recent page faults in an address space. The number of pages
+/// that are mapped around a fault grows while faults are sequential and shrinks
+/// when they aren't.
+
+#[derive(Clone, Copy, Debug)]
+pub struct FaultHistory {
+    last_fault_page: Option<usize>,
+    window: usize,
+}
+
+impl FaultHistory {
+    pub const fn new() -> Self {
+        Self {
+            last_fault_page: None,
+            window: 1,
+        }
+    }
+
+    /// Records a fault on a page and returns the number of pages that should be mapped
+    /// for it. A fault is sequential if it lands within the previous window in the
+    /// direction in which the mapping grows.
+
+    pub fn record_fault(&mut self, page: usize, extend_down: bool) -> usize {
+        // A fault that's handled again after its page was read in doesn't count twice
+
+        if self.last_fault_page == Some(page) {
+            return self.window;
+        }
+
+        let span = self.window * VirtualPage::SMALL_PAGE_SIZE;
+
+        let is_sequential = match self.last_fault_page {
+            Some(last) if extend_down => page < last && last - page <= span,
+            Some(last) => page > last && page - last <= span,
+            None => false,
+        };
+
+        self.window = if is_sequential {
+            cmp::min(self.window * 2, FAULT_AROUND_MAX_PAGES)
+        } else {
+            cmp::max(self.window / 2, 1)
+        };
+
+        self.last_fault_page = Some(page);
+        self.window
+    }
+}
+
+/// Maps a faulting page along with up to `window - 1` neighboring pages of the same mapping
+/// using a single `map_frames()` call. Pages that are already present are left untouched.
+///
+/// If `share_zero_page` is set, then pages of /dev/zero are backed by the shared zero frame
+/// (`flags` must be read-only in that case).
+
+fn fault_around(addr_space: &mut AddrSpace, mapping: &AddressMapping, fault_page: usize, window: usize,
+                flags: u32, share_zero_page: bool) -> Result<(), (error::Error, Option<String>)> {
+    let root_pmap = addr_space.root_pmap();
+    let page_size = VirtualPage::SMALL_PAGE_SIZE;
+    let extend_down = mapping.flags & AddrSpace::EXTEND_DOWN == AddrSpace::EXTEND_DOWN;
+
+    // Last byte of the mapping (a region end of 0 means the end of memory)
+    let mapping_last = mapping.region.end().wrapping_sub(1);
+
+    let (first_page, last_page) = if extend_down {
+        (cmp::max(fault_page.saturating_sub((window - 1) * page_size), mapping.region.start()),
+         fault_page)
+    } else {
+        (fault_page,
+         cmp::min(fault_page.saturating_add((window - 1) * page_size),
+                  mapping_last.align_trunc(page_size)))
+    };
+
+    let vpage_at = |addr: usize| mapping.base_page.add_offset((addr - mapping.region.start()) as u64);
+    let mut page_count = (last_page - first_page) / page_size + 1;
+    let fault_index = (fault_page - first_page) / page_size;
+    let mut frames = [0 as PAddr; FAULT_AROUND_MAX_PAGES];
+
+    let release_frames = |frames: &[PAddr], from: usize| {
+        for (i, frame) in frames.iter().enumerate().skip(from) {
+            device::release_page(&vpage_at(first_page + i * page_size), &PhysicalPage::new(*frame));
+        }
+    };
+
+    let read_page = if share_zero_page {
+        device::read_page_shared
+    } else {
+        device::read_page
+    };
+
+    // Each frame comes from the page's device rather than straight from the allocator: a
+    // cached file page, the shared zero frame, or a cleared frame from the zero pool. So
+    // the frames can't be taken in one batch with alloc_phys_many(), which hands out
+    // uncleared frames. The zero pool pops from its own list without the allocator lock.
+
+    for i in 0..page_count {
+        match read_page(&vpage_at(first_page + i * page_size)) {
+            Ok(p) => frames[i] = p.as_address(),
+
+            // The pages that follow the faulting page are optional, so just map fewer pages
+
+            Err(_) if i > fault_index => {
+                page_count = i;
+                break;
+            },
+            Err(code) => {
+                release_frames(&frames[..i], 0);
+
+                return if window > 1 && i < fault_index {
+                    fault_around(addr_space, mapping, fault_page, 1, flags, share_zero_page)
+                } else if code == error::OUT_OF_MEMORY || code == error::IO_PENDING {
+                    Err((code, None))
+                } else {
+                    Err((OPERATION_FAILED, Some(format!("Reading block from device resulted in error {}", code))))
+                };
+            }
+        }
+    }
+
+    let result = unsafe {
+        syscall::map_frames(Some(root_pmap),
+                            first_page as *mut c_void,
+                            &frames[..page_count],
+                            page_count as i32,
+                            flags)
+    };
+
+    match result {
+        Ok(mapped) if mapped as usize > fault_index => {
+            // Mapping stops at the first page that's already present
+
+            for (i, frame) in frames[..mapped as usize].iter().enumerate() {
+                addr_space.set_resident(first_page + i * page_size, *frame);
+            }
+
+            release_frames(&frames[..page_count], mapped as usize);
+            Ok(())
+        },
+        Ok(mapped) => {
+            release_frames(&frames[..page_count], cmp::max(mapped, 0) as usize);
+
+            if window > 1 {
+                fault_around(addr_space, mapping, fault_page, 1, flags, share_zero_page)
+            } else {
+                Err((OPERATION_FAILED, Some(String::from("Unable to map page."))))
+            }
+        },
+        Err(code) => {
+            release_frames(&frames[..page_count], 0);
+
+            if window > 1 {
+                fault_around(addr_space, mapping, fault_page, 1, flags, share_zero_page)
+            } else {
+                Err((OPERATION_FAILED,
+                     Some(format!("Unable to map page. System call returned 0x{:X}", code))))
+            }
+        }
+    }
+}
+
+/// Resolves a write to a present, read-only page of a copy-on-write mapping. The page is
+/// made writable in place if this address space is the frame's only user. Otherwise, the
+/// page is replaced with a private copy.
+
+fn copy_on_write(addr_space: &mut AddrSpace, mapping: &AddressMapping, fault_page: usize,
+                 flags: u32) -> Result<(), (error::Error, Option<String>)> {
+    let frame = addr_space.resident_frame(fault_page)
+        .ok_or_else(|| (OPERATION_FAILED, Some(format!("No frame has been recorded for page {:#x}", fault_page))))?;
+    let vpage = mapping.base_page.add_offset((fault_page - mapping.region.start()) as u64);
+
+    // Frames that belong to a device (e.g. /dev/pmem) must never be written through
+
+    let new_frame = if device::is_zero_frame(frame) {
+        device::read_page(&vpage)
+            .map_err(|code| (code, Some(String::from("Unable to allocate a zeroed page."))))?
+            .as_address()
+    } else if device::is_private_page(&vpage) && phys_alloc::frame_ref_count(frame) == 1 {
+        frame
+    } else {
+        let (new_frame, _) = phys_alloc::alloc_phys(BlockSize::Block4k)
+            .map_err(|_| (error::OUT_OF_MEMORY, None))?;
+
+        if let Err(code) = unsafe { phys::copy_frame(new_frame, frame) } {
+            phys_alloc::release_phys(new_frame, BlockSize::Block4k);
+            return Err((code, Some(String::from("Unable to copy page."))));
+        }
+
+        new_frame
+    };
+
+    let result = unsafe {
+        syscall::map_frames(Some(addr_space.root_pmap()),
+                            fault_page as *mut c_void,
+                            &[new_frame],
+                            1,
+                            flags | OVERWRITE)
+    };
+
+    match result {
+        Ok(1) => {
+            if new_frame != frame {
+                device::release_page(&vpage, &PhysicalPage::new(frame));
+                addr_space.set_resident(fault_page, new_frame);
+            }
+
+            Ok(())
+        },
+        _ => {
+            if new_frame != frame {
+                phys_alloc::release_phys(new_frame, BlockSize::Block4k);
+            }
+
+            Err((OPERATION_FAILED, Some(format!("Unable to remap page {:#x}", fault_page))))
+        }
+    }
+}
+
+/// Unmaps the resident pages of the mapping at `start` that lie in `[start, end)` and
+/// drops their frames. This must be done before the region is removed from the address
+/// space, since the mapping is needed to identify each page's device.
+
+pub fn release_resident(addr_space: &mut AddrSpace, start: usize, end: usize) {
+    let mapping = match addr_space.get_mapping(start as VAddr).cloned() {
+        Some(mapping) => mapping,
+        None => return,
+    };
+
+    let root_pmap = addr_space.root_pmap();
+
+    for (page, frame) in resident_pages_within(addr_space, &mapping, start, end) {
+        match unsafe { syscall::unmap(Some(root_pmap), page as *const c_void, 1, None) } {
+            Ok(1) => (),
+            _ => {
+                eprintln!("Unable to unmap resident page {:#x}", page);
+                continue;
+            }
+        }
+
+        let vpage = mapping.base_page.add_offset((page - mapping.region.start()) as u64);
+
+        addr_space.remove_resident(page);
+        device::release_page(&vpage, &PhysicalPage::new(frame));
+    }
+}
+
+/// Returns the resident pages of `mapping` that lie in `[start, end)`
+
+fn resident_pages_within(addr_space: &AddrSpace, mapping: &AddressMapping, start: usize, end: usize) -> Vec<(usize, PAddr)> {
+    let page_size = VirtualPage::SMALL_PAGE_SIZE;
+    let end = end.align(page_size);
+    let mut next = start.align_trunc(page_size);
+    let mut pages = Vec::new();
+
+    while let Some((page, frame)) = addr_space.next_resident(next).filter(|&(page, _)| page < end) {
+        next = page + page_size;
+
+        if mapping.region.contains(page) {
+            pages.push((page, frame));
+        }
+    }
+
+    pages
+}
+
+/// Runs a step of the page fault handler and, if it ran out of memory, retries it once
+/// after reclaiming some pages.
+
+fn retry_after_reclaim<T, F>(mut handle: F) -> Result<T, (error::Error, Option<String>)>
+    where F: FnMut() -> Result<T, (error::Error, Option<String>)> {
+    match handle() {
+        Err((error::OUT_OF_MEMORY, _)) if reclaim::reclaim_pages(reclaim::RECLAIM_BATCH) > 0 => handle(),
+        result => result,
+    }
+}
+
+/// Creates a copy-on-write clone of an address space. Both address spaces share every
+/// resident frame read-only until one of them writes to it, so the cost of the clone
+/// depends on the number of resident pages rather than the size of the mappings.
+
+pub fn clone_addr_space(parent_pmap: PAddr, child_pmap: PAddr) -> Result<(), (error::Error, Option<String>)> {
+    let parent = mapping::manager::lookup_pmap_mut(parent_pmap)
+        .ok_or_else(|| (error::BAD_ARGUMENT, Some(String::from("Parent address space isn't registered."))))?;
+
+    // Swap slots are recorded in the parent's PTEs, so they can't be shared with the child
+
+    reclaim::swap_in_all(parent)?;
+
+    let mut child = parent.clone_mappings(child_pmap);
+
+    if let Err(err) = large_page::copy_large_pages(parent, &mut child)
+        .and_then(|_| share_resident_pages(parent, &mut child)) {
+        release_clone(&mut child);
+        return Err(err);
+    }
+
+    if mapping::manager::register(child) {
+        shm::clone_attachments(parent_pmap, child_pmap);
+        Ok(())
+    } else {
+        Err((OPERATION_FAILED, Some(String::from("Unable to register the cloned address space."))))
+    }
+}
+
+/// Maps every resident page of `parent` read-only into `child`. Copy-on-write pages are
+/// write-protected in the parent as well.
+
+fn share_resident_pages(parent: &mut AddrSpace, child: &mut AddrSpace) -> Result<(), (error::Error, Option<String>)> {
+    let parent_pmap = parent.root_pmap();
+    let child_pmap = child.root_pmap();
+    let resident_pages = parent.resident_pages().collect::<Vec<(usize, PAddr)>>();
+
+    for (page, frame) in resident_pages {
+        let (mapping_flags, vpage) = match parent.get_mapping(page as VAddr) {
+            Some(mapping) => (mapping.flags,
+                              mapping.base_page.add_offset((page - mapping.region.start()) as u64)),
+            None => continue,
+        };
+
+        // Writable shared memory stays writable in both address spaces
+
+        let access = if mapping_flags & (AddrSpace::SHARED | AddrSpace::READ_ONLY) == AddrSpace::SHARED {
+            READ_WRITE
+        } else {
+            READ_ONLY
+        };
+
+        let flags = access | if mapping_flags & AddrSpace::NO_EXECUTE == AddrSpace::NO_EXECUTE {
+            NO_EXECUTE
+        } else {
+            0
+        };
+
+        // Writes by the parent have to fault from now on
+
+        if mapping_flags & AddrSpace::COPY_ON_WRITE == AddrSpace::COPY_ON_WRITE {
+            unsafe {
+                syscall::map_frames(Some(parent_pmap), page as *mut c_void, &[frame], 1, flags | OVERWRITE)
+            }
+                .map_err(|code| (code, Some(format!("Unable to write-protect page {:#x}", page))))?;
+        }
+
+        unsafe {
+            syscall::map_frames(Some(child_pmap), page as *mut c_void, &[frame], 1, flags)
+        }
+            .map_err(|code| (code, Some(format!("Unable to share page {:#x}", page))))?;
+
+        device::share_page(&vpage, &PhysicalPage::new(frame));
+        child.set_resident(page, frame);
+    }
+
+    Ok(())
+}
+
+/// Drops the frames of a clone that couldn't be completed. The clone was never registered,
+/// so nothing else refers to it.
+
+fn release_clone(child: &mut AddrSpace) {
+    while let Some((page, frame)) = child.next_resident(0) {
+        child.remove_resident(page);
+
+        if let Some(mapping) = child.get_mapping(page as VAddr) {
+            let vpage = mapping.base_page.add_offset((page - mapping.region.start()) as u64);
+            device::release_page(&vpage, &PhysicalPage::new(frame));
+        }
+    }
+
+    let large_pages = child.large_pages().collect::<Vec<(usize, PAddr)>>();
+
+    for (block, frame) in large_pages {
+        child.remove_large_resident(block);
+        phys_alloc::release_phys(frame, BlockSize::Block4M);
+    }
+}
+
+/// Starts a thread at `entry` in a new copy-on-write clone of an address space, which is
+/// how pre-forked workers are spawned. Returns the TID of the new thread.
+
+pub fn spawn_clone(parent_pmap: PAddr, entry: VAddr, stack_top: VAddr) -> Result<Tid, (error::Error, Option<String>)> {
+    let (child_pmap, _) = phys_alloc::alloc_phys_low(BlockSize::Block4k)
+        .map_err(|_| (error::OUT_OF_MEMORY, None))?;
+
+    // The kernel only fills in its own part of a new root page map
+
+    let tid = match unsafe { phys::clear_frame(child_pmap) } {
+        Ok(_) => unsafe {
+            syscall::sys_create_thread(NULL_TID, entry as *const c_void, &child_pmap as *const PAddr,
+                                       stack_top as *const c_void)
+        },
+        Err(_) => NULL_TID,
+    };
+
+    if tid == NULL_TID {
+        phys_alloc::release_phys(child_pmap, BlockSize::Block4k);
+        return Err((OPERATION_FAILED, Some(String::from("Unable to create the cloned thread."))));
+    }
+
+    let tid = Tid::new(tid);
+
+    if let Err(err) = clone_addr_space(parent_pmap, child_pmap) {
+        unsafe { syscall::sys_destroy_thread(tid.into()); }
+        phys_alloc::release_phys(child_pmap, BlockSize::Block4k);
+        return Err(err);
+    }
+
+    mapping::manager::attach_thread(child_pmap, tid.clone());
+
+    let mut thread_info = ThreadInfo::default();
+    thread_info.status = ThreadInfo::READY;
+
+    syscall::update_thread(&tid, &ThreadStruct::new(thread_info, ThreadInfo::STATUS))
+        .map(|_| tid)
+        .map_err(|code| (code, Some(String::from("Unable to start the cloned thread."))))
+}
+
+/// Faults that are waiting for the I/O thread to read in their pages, along with the
+/// threads that the responses go to
+static mut PARKED_FAULTS: Option<BTreeMap<file_map::ReadId, Vec<(Tid, ExceptionMessage)>>> = None;
+
+fn parked_faults() -> &'static mut BTreeMap<file_map::ReadId, Vec<(Tid, ExceptionMessage)>> {
+    unsafe {
+        PARKED_FAULTS.get_or_insert_with(BTreeMap::new)
+    }
+}
+
+/// Finishes a read that was started by the page fault handler and handles each fault that
+/// was waiting for it again. Returns the result of each fault along with the thread that
+/// should be sent the response. A fault that has to wait again results in `IO_PENDING`.
+
+pub(crate) fn complete_read(id: file_map::ReadId, status: error::Error) -> Vec<(Tid, Result<(), (error::Error, Option<String>)>)> {
+    let result = if status == 0 {
+        Ok(())
+    } else {
+        Err(status)
+    };
+
+    let is_read = file_map::complete_read(id, result);
+
+    parked_faults().remove(&id)
+        .unwrap_or_default()
+        .into_iter()
+        .map(|(sender, request)| {
+            let result = if is_read {
+                handle_page_fault(&sender, &request)
+            } else {
+                Err((OPERATION_FAILED, Some(format!("Reading block from device resulted in error {}", status))))
+            };
+
+            (sender, result)
+        })
+        .collect()
+}
+
 /// The main page fault handler. Receives page fault messages from the kernel and attempts to
 /// resolve the page fault by allocating memory, mapping pages, etc.
+///
+/// If the faulting page has to be read from a driver, the fault is parked until the I/O
+/// thread is done and `IO_PENDING` is returned. No response should be sent in that case:
+/// `complete_read()` handles the fault again later.
 
-pub(crate) fn handle_page_fault(request: &ExceptionMessage) -> Result<(), (error::Error, Option<String>)> {
+pub(crate) fn handle_page_fault(sender: &Tid, request: &ExceptionMessage) -> Result<(), (error::Error, Option<String>)> {
     let is_read_access = request.error_code & ExceptionMessage::WRITE == 0;
     let is_kernel_access = request.error_code & ExceptionMessage::USER == 0;
     let is_not_present = request.error_code & ExceptionMessage::PRESENT == 0;
@@ -261,63 +731,103 @@ pub(crate) fn handle_page_fault(request: &ExceptionMessage) -> Result<(), (error
 
     let reg_state = thread_struct.state().unwrap();
 
-    let addr_space = mapping::manager::lookup_tid_mut(&request.who.into()).unwrap();
+    let addr_space = mapping::manager::lookup_tid_mut(&request.who.into())
+        .ok_or_else(|| (error::BAD_ARGUMENT, Some(String::from("Faulting thread has no address space."))))?;
     let root_pmap = addr_space.root_pmap();
 
     /* Is the fault address mapped in the thread's address space, but not yet committed? */
 
-    if let Some(mapping) = addr_space.get_mapping(request.fault_address) {
+    if let Some(mapping) = addr_space.get_mapping(request.fault_address).cloned() {
         /* Either swap the page into memory, load the page from disk into memory, or allocate a new physical page
             depending on swap status and device. */
 
         // The address hasn't been committed to memory
 
+        let mut flags = 0;
+
+        if mapping.flags & AddrSpace::NO_EXECUTE == AddrSpace::NO_EXECUTE {
+            flags |= NO_EXECUTE;
+        }
+
+        let is_cow = mapping.flags & AddrSpace::COPY_ON_WRITE == AddrSpace::COPY_ON_WRITE;
+        let fault_page = (request.fault_address as usize).align_trunc(VirtualPage::SMALL_PAGE_SIZE);
+
         if is_not_present {
-            let mapped_frame = {
-                let mapping_offset = (request.fault_address as usize - mapping.region.start()) as u64;
+            // Pages that were reclaimed have their swap slot stored in the PTE
 
-                match device::read_page(&mapping.base_page.add_offset(mapping_offset)) {
-                    Ok(p) => p.as_address(),
-                    Err(code) => return Err((OPERATION_FAILED, Some(format!("Reading block from device resulted in error {}", code))))
-                }
-            };
+            if retry_after_reclaim(|| reclaim::swap_in(addr_space, &mapping, fault_page))? {
+                return Ok(());
+            }
+
+            // Large anonymous mappings are backed by large pages from the first write
+
+            if !is_read_access && large_page::fault_large(addr_space, &mapping, fault_page)? {
+                return Ok(());
+            }
+
+            let is_read_only = mapping.flags & AddrSpace::READ_ONLY == AddrSpace::READ_ONLY;
 
-            let mut flags = 0;
+            // Reads from anonymous memory are backed by the shared zero frame until the first write
 
-            flags |= if mapping.flags & AddrSpace::READ_ONLY == AddrSpace::READ_ONLY {
+            let share_zero_page = (is_read_access || is_read_only)
+                && mapping.flags & AddrSpace::GUARD == 0
+                && device::is_zero_page(&mapping.base_page);
+
+            // Frames that belong to a device can't be written to in a copy-on-write mapping
+
+            flags |= if is_read_only || share_zero_page
+                || (is_cow && !device::is_private_page(&mapping.base_page)) {
                 READ_ONLY
             } else {
                 READ_WRITE
             };
 
-            /*eprintln!("Fault mapping {:p} -> {:#x} pmap: {:#x}",
-                      request.fault_address, mapped_frame, root_pmap); */
+            // Don't map ahead into guard pages
+
+            let window = if mapping.flags & AddrSpace::GUARD == AddrSpace::GUARD {
+                1
+            } else {
+                addr_space.fault_history.record_fault(fault_page,
+                                                      mapping.flags & AddrSpace::EXTEND_DOWN == AddrSpace::EXTEND_DOWN)
+            };
+
+            /*eprintln!("Fault mapping {:p} ({} pages) pmap: {:#x}",
+                      request.fault_address, window, root_pmap); */
+
+            let result = retry_after_reclaim(|| fault_around(addr_space, &mapping, fault_page, window, flags, share_zero_page));
 
-            return unsafe {
-                syscall::map_frames(Some(root_pmap),
-                                    request.fault_address as *mut c_void,
-                                    &[mapped_frame],
-                                    1,
-                                    flags)
+            // Sequential faults on a file also read the pages that follow into the page cache
+
+            if let Err((error::IO_PENDING, _)) = result {
+                let id = retry_after_reclaim(|| file_map::start_read(&mapping, fault_page, window)
+                    .map_err(|code| (code, None)))?;
+
+                parked_faults().entry(id)
+                    .or_insert_with(Vec::new)
+                    .push((sender.clone(), request.clone()));
+
+                return result;
             }
-                .and_then(|result| {
-                    if result == 1 {
-                        //eprintln!("Mapping ok");
-                        Ok(())
-                    } else {
-                        //eprintln!("Unable to map page");
-                        Err(OPERATION_FAILED)
-                    }
-                })
-                .map_err(|code| (OPERATION_FAILED,
-                                 Some(format!("Unable to map page. System call returned 0x{:X}", code))));
+
+            if result.is_ok() && !share_zero_page {
+                large_page::note_small_fault(addr_space, &mapping, fault_page);
+            }
+
+            return result;
         } else if is_kernel_access && reg_state.cs != 0x10 { // Don't allow access to kernel memory
             eprintln!("Attempted to access kernel memory.");
         } else if is_read_access {     // This isn't supposed to happen
             eprintln!("Address has been committed to memory, but a read access resulted in a page fault.");
+        } else if mapping.flags & AddrSpace::READ_ONLY == 0 && addr_space.large_frame(fault_page).is_some() {
+            // The small pages were write-protected while being collapsed into a large page
+
+            return Ok(());
+        } else if is_cow || (mapping.flags & AddrSpace::READ_ONLY == 0
+            && addr_space.resident_frame(fault_page).map_or(false, device::is_zero_frame)) {
+            return retry_after_reclaim(|| copy_on_write(addr_space, &mapping, fault_page, flags | READ_WRITE));
         } else {
             /* TODO: Someone wrote to a read-only page. Find out whether
-                                it is allowed (COW, for example) or not and perform the
+                                it is allowed or not and perform the
                                 relevant operation. */
             if mapping.flags & AddrSpace::READ_ONLY == AddrSpace::READ_ONLY {
                 eprintln!("Handling of read-only page faults isn't implemented yet");
@@ -347,4 +857,88 @@ pub(crate) fn handle_page_fault(request: &ExceptionMessage) -> Result<(), (error
     Err((ILLEGAL_MEM_ACCESS,
          Some(format!("Tid {} attempted to {}{} memory at address {:p}",
                       request.who.try_into().unwrap_or(0u16), access, privilege, request.fault_address))))
-}
\ No newline at end of file
+}
+
+#[cfg(test)]
+mod test {
+    use super::{resident_pages_within, FaultHistory, FAULT_AROUND_MAX_PAGES};
+    use crate::address::VAddr;
+    use crate::device::DeviceId;
+    use crate::mapping::AddrSpace;
+    use crate::page::VirtualPage;
+
+    const PAGE: usize = VirtualPage::SMALL_PAGE_SIZE;
+
+    #[test]
+    fn test_fault_history_sequential() {
+        let mut history = FaultHistory::new();
+
+        assert_eq!(history.record_fault(0x100000, false), 1);
+        assert_eq!(history.record_fault(0x100000 + PAGE, false), 2);
+        assert_eq!(history.record_fault(0x100000 + 3*PAGE, false), 4);
+        assert_eq!(history.record_fault(0x100000 + 7*PAGE, false), 8);
+        assert_eq!(history.record_fault(0x100000 + 15*PAGE, false), 16);
+        assert_eq!(history.record_fault(0x100000 + 31*PAGE, false), FAULT_AROUND_MAX_PAGES);
+    }
+
+    #[test]
+    fn test_fault_history_random() {
+        let mut history = FaultHistory::new();
+
+        for _ in 0..4 {
+            history.record_fault(0x100000, false);
+            history.record_fault(0x100000 + PAGE, false);
+        }
+
+        assert_eq!(history.record_fault(0x8000000, false), 1);
+        assert_eq!(history.record_fault(0x100000, false), 1);
+    }
+
+    #[test]
+    fn test_fault_history_extend_down() {
+        let mut history = FaultHistory::new();
+
+        assert_eq!(history.record_fault(0x800000, true), 1);
+        assert_eq!(history.record_fault(0x800000 - PAGE, true), 2);
+        assert_eq!(history.record_fault(0x800000 - 3*PAGE, true), 4);
+        assert_eq!(history.record_fault(0x800000, true), 2);
+    }
+
+    #[test]
+    fn test_fault_history_repeated() {
+        let mut history = FaultHistory::new();
+
+        assert_eq!(history.record_fault(0x100000, false), 1);
+        assert_eq!(history.record_fault(0x100000 + PAGE, false), 2);
+        assert_eq!(history.record_fault(0x100000 + PAGE, false), 2);
+        assert_eq!(history.record_fault(0x100000 + 2*PAGE, false), 4);
+    }
+
+    #[test]
+    fn test_resident_pages_within() {
+        let mut addr_space = AddrSpace::new(0x1000);
+        let dev = DeviceId::new(1);
+        let base = 0x10000000;
+
+        // Two adjacent mappings, each with a couple of resident pages
+
+        addr_space.map(Some(base as VAddr), &dev, 0, 0, 4 * PAGE);
+        addr_space.map(Some((base + 4 * PAGE) as VAddr), &dev, 0, 0, 4 * PAGE);
+        addr_space.set_resident(base, 0x200000);
+        addr_space.set_resident(base + 2 * PAGE, 0x201000);
+        addr_space.set_resident(base + 3 * PAGE, 0x202000);
+        addr_space.set_resident(base + 4 * PAGE, 0x203000);
+
+        let mapping = addr_space.get_mapping(base as VAddr).cloned().unwrap();
+
+        assert_eq!(resident_pages_within(&addr_space, &mapping, base, base + 8 * PAGE),
+                   vec![(base, 0x200000), (base + 2 * PAGE, 0x201000), (base + 3 * PAGE, 0x202000)]);
+
+        // Partial pages at either end are included
+
+        assert_eq!(resident_pages_within(&addr_space, &mapping, base + 2 * PAGE + 1, base + 2 * PAGE + 2),
+                   vec![(base + 2 * PAGE, 0x201000)]);
+
+        assert!(resident_pages_within(&addr_space, &mapping, base + PAGE, base + 2 * PAGE).is_empty());
+    }
+}
@@ -5,17 +5,37 @@ use crate::multiboot::{RawMemoryMap, RawMemoryMapIterator};
 use crate::types::bit_array::{BitArray, BitIterator, BitFilter};
 use crate::address::Align;
 use alloc::vec::Vec;
+use alloc::collections::btree_map::BTreeMap;
 use crate::page::PhysicalPage;
+use core::cmp;
 
 static mut PAGE_ALLOCATOR: Option<PhysPageAllocator> = None;
 static mut BOOTSTRAP_MEM: Option<BootstrapAllocator> = None;
 
+// Serializes alloc_phys() and release_phys() now that more than one init server thread allocates frames
+static mut ALLOC_LOCK: i32 = 0;
+
+#[link(name="os_init", kind="static")]
+extern "C" {
+    fn mutex_lock(lock: *mut i32) -> i32;
+    fn mutex_unlock(lock: *mut i32) -> i32;
+}
+
 /// 1 + the highest physical address that can be accessed with PSE
 pub const MAX_PHYS_ADDR: PAddr = 1 << 40;
 
 /// 1 + the highest physical address that can be accessed via 4 kiB pages
+#[cfg(not(feature = "pae"))]
 const MAX_PHYS_ADDR_4K: PAddr = 1 << 32;
 
+/// 1 + the highest physical address that can be accessed via 4 kiB pages
+#[cfg(feature = "pae")]
+const MAX_PHYS_ADDR_4K: PAddr = MAX_PHYS_ADDR;
+
+/// 1 + the highest physical address of a frame allocated by `alloc_phys_low()`. CR3 only
+/// holds a 32-bit address, even with PAE.
+pub const MAX_LOW_PHYS_ADDR: PAddr = 1 << 32;
+
 struct BootstrapAllocator {
     start: PAddr,
     end: PAddr,
@@ -109,6 +129,12 @@ impl BlockSize {
             BlockSize::Block128M => 128*1024*1024,
         }
     }
+
+    /// The number of 4 kB frames in a block of this size.
+
+    pub const fn frames(&self) -> usize {
+        (self.bytes() / BlockSize::Block4k.bytes()) as usize
+    }
 }
 
 pub struct PhysPageAllocator {
@@ -133,6 +159,33 @@ pub struct PhysPageAllocator {
     // The regions that cannot be allocated (because they're: being used by the kernel, MMIO ranges,
     // non-existent, marked as bad, etc.)
     resd_regions: RegionSet<PAddr>,
+
+    // Reference counts of 4 kB frames that are mapped into more than one address space.
+    // Frames that aren't present have a single owner.
+    shared_frames: BTreeMap<PAddr, u32>,
+
+    // Free lists for each BlockSize level (below and above 4G). A block is put on its list when
+    // it becomes free while its super-block doesn't. Entries aren't removed when a block is
+    // merged or allocated through the bitmaps, so they're checked against occupied_status
+    // when they're popped.
+    free_lists: Vec<Vec<PAddr>>,
+    free_lists_upper: Vec<Vec<PAddr>>,
+
+    // Number of free 4 kB frames (including those in free blocks above 4G). Recounted by
+    // fill_free_lists() and kept up to date by alloc() and release().
+    free_frames: usize,
+}
+
+/// A snapshot of the physical page allocator's counters. The arrays are indexed by
+/// `BlockSize::level()`.
+
+#[derive(Clone, Copy, Default)]
+pub struct AllocatorStats {
+    pub total_blocks: [usize; BlockSize::total_sizes()],
+    pub free_blocks: [usize; BlockSize::total_sizes()],
+    pub used_blocks: [usize; BlockSize::total_sizes()],
+    pub free_frames: usize,
+    pub largest_free_run: usize,
 }
 
 pub fn allocator() -> &'static PhysPageAllocator {
@@ -163,9 +216,42 @@ pub fn is_allocator_ready() -> bool {
     }
 }
 
+fn lock_allocator() {
+    unsafe {
+        while mutex_lock(&mut ALLOC_LOCK) != 0 {
+            crate::syscall::sys_sleep(0);
+        }
+    }
+}
+
+fn unlock_allocator() {
+    unsafe {
+        while mutex_unlock(&mut ALLOC_LOCK) != 0 {}
+    }
+}
+
 pub fn alloc_phys(block_size: BlockSize) -> Result<(PAddr, BlockSize), AllocError> {
     if is_allocator_ready() {
-        allocator_mut().alloc(block_size)
+        if let BlockSize::Block4k = block_size {
+            if let Some(frame) = magazine::alloc() {
+                return Ok((frame, block_size));
+            }
+        }
+
+        lock_allocator();
+        let mut result = allocator_mut().alloc(block_size);
+        unlock_allocator();
+
+        // The frames held by the magazines and the zero pools may be all that's left, or
+        // they may be keeping a larger block from being merged
+
+        if result.is_err() && flush_caches() > 0 {
+            lock_allocator();
+            result = allocator_mut().alloc(block_size);
+            unlock_allocator();
+        }
+
+        result
     } else if is_bootstrap_ready() {
         let bootstrap_alloc = unsafe {
             BOOTSTRAP_MEM.as_mut()
@@ -178,14 +264,515 @@ pub fn alloc_phys(block_size: BlockSize) -> Result<(PAddr, BlockSize), AllocErro
     }
 }
 
+/// Allocates up to `count` 4 kB frames, taking the allocator lock at most once. Fewer
+/// frames are returned if memory runs out.
+
+pub fn alloc_phys_many(count: usize) -> Vec<PAddr> {
+    let mut frames = Vec::with_capacity(count);
+
+    if is_allocator_ready() {
+        magazine::take(&mut frames, count);
+
+        if frames.len() < count {
+            lock_allocator();
+
+            while frames.len() < count {
+                match allocator_mut().alloc(BlockSize::Block4k) {
+                    Ok((frame, _)) => frames.push(frame),
+                    Err(_) => break,
+                }
+            }
+
+            unlock_allocator();
+        }
+    } else {
+        while frames.len() < count {
+            match alloc_phys(BlockSize::Block4k) {
+                Ok((frame, _)) => frames.push(frame),
+                Err(_) => break,
+            }
+        }
+    }
+
+    frames
+}
+
+/// Allocates a block that lies entirely below 4 GB. Root page maps and page tables must
+/// be allocated with this, since `alloc_phys()` may return frames above 4 GB with PAE.
+
+pub fn alloc_phys_low(block_size: BlockSize) -> Result<(PAddr, BlockSize), AllocError> {
+    if is_allocator_ready() {
+        lock_allocator();
+        let mut result = allocator_mut().alloc_below(block_size, MAX_LOW_PHYS_ADDR);
+        unlock_allocator();
+
+        if result.is_err() && flush_caches() > 0 {
+            lock_allocator();
+            result = allocator_mut().alloc_below(block_size, MAX_LOW_PHYS_ADDR);
+            unlock_allocator();
+        }
+
+        result
+    } else {
+        // The bootstrap allocator hands out the memory that follows the init server's image
+
+        alloc_phys(block_size)
+            .and_then(|(addr, size)| if addr + size.bytes() <= MAX_LOW_PHYS_ADDR {
+                Ok((addr, size))
+            } else {
+                Err(AllocError::OutOfMemory)
+            })
+    }
+}
+
+/// Returns the frames held by the magazines and the zero pools to the allocator. Returns
+/// the number of blocks that were released.
+
+fn flush_caches() -> usize {
+    magazine::flush() + zero_pool::flush()
+}
+
 pub fn release_phys(address: PAddr, block_size: BlockSize) {
     if is_allocator_ready() {
-        allocator_mut().release(address, block_size)
+        let is_cached = match block_size {
+            BlockSize::Block4k => magazine::release(address),
+            _ => false,
+        };
+
+        if !is_cached {
+            lock_allocator();
+            allocator_mut().release(address, block_size);
+            unlock_allocator();
+        }
     } /*else if !is_bootstrap_ready() {
         panic!("Bootstrap allocator hasn't been initialized yet.");
     }*/
 }
 
+/// Caches of free 4 kB frames in front of the allocator, so that most single frame
+/// allocations and releases don't need the allocator lock. The init server has no
+/// thread-local storage, so a thread uses the magazine that its stack address maps to.
+/// Each magazine has its own lock and is refilled from (or drained to) the allocator in
+/// batches. Cached frames are counted as used by the allocator.
+
+mod magazine {
+    use super::{allocator_mut, lock_allocator, unlock_allocator, mutex_lock, mutex_unlock, BlockSize};
+    use crate::address::PAddr;
+    use alloc::vec::Vec;
+
+    const MAGAZINE_COUNT: usize = 4;
+    const MAGAZINE_SIZE: usize = 64;
+
+    /// Number of frames that are moved between a magazine and the allocator at once
+    const BATCH_SIZE: usize = MAGAZINE_SIZE / 2;
+
+    #[derive(Copy, Clone)]
+    struct Magazine {
+        lock: i32,
+        count: usize,
+        frames: [PAddr; MAGAZINE_SIZE],
+    }
+
+    static mut MAGAZINES: [Magazine; MAGAZINE_COUNT] = [Magazine {
+        lock: 0,
+        count: 0,
+        frames: [0; MAGAZINE_SIZE],
+    }; MAGAZINE_COUNT];
+
+    impl Magazine {
+        fn refill(&mut self) {
+            lock_allocator();
+
+            while self.count < BATCH_SIZE {
+                match allocator_mut().alloc(BlockSize::Block4k) {
+                    Ok((frame, _)) => {
+                        self.frames[self.count] = frame;
+                        self.count += 1;
+                    },
+                    Err(_) => break,
+                }
+            }
+
+            unlock_allocator();
+        }
+
+        /// A frame that was released twice, into two different magazines, is caught here
+        /// when the second copy reaches the allocator.
+
+        fn drain(&mut self, keep: usize) {
+            lock_allocator();
+
+            while self.count > keep {
+                self.count -= 1;
+
+                let frame = self.frames[self.count];
+
+                assert!(!allocator_mut().is_free(frame),
+                        "Cached 4096-byte block at {:#x} was released more than once", frame);
+
+                allocator_mut().release(frame, BlockSize::Block4k);
+            }
+
+            unlock_allocator();
+        }
+    }
+
+    fn current() -> usize {
+        crate::lowlevel::stack_slot(MAGAZINE_COUNT)
+    }
+
+    /// Runs `f` with a magazine. Returns `None` if another thread holds it, in which case
+    /// the caller should go to the allocator instead of waiting.
+
+    fn with_magazine<T>(index: usize, f: impl FnOnce(&mut Magazine) -> T) -> Option<T> {
+        unsafe {
+            let magazine = &mut MAGAZINES[index];
+
+            if mutex_lock(&mut magazine.lock) != 0 {
+                return None;
+            }
+
+            let result = f(magazine);
+
+            while mutex_unlock(&mut magazine.lock) != 0 {}
+            Some(result)
+        }
+    }
+
+    pub fn alloc() -> Option<PAddr> {
+        with_magazine(current(), |magazine| {
+            if magazine.count == 0 {
+                magazine.refill();
+            }
+
+            if magazine.count == 0 {
+                None
+            } else {
+                magazine.count -= 1;
+                Some(magazine.frames[magazine.count])
+            }
+        }).flatten()
+    }
+
+    /// Moves up to `count` cached frames into `frames`.
+
+    pub fn take(frames: &mut Vec<PAddr>, count: usize) {
+        with_magazine(current(), |magazine| {
+            while frames.len() < count && magazine.count > 0 {
+                magazine.count -= 1;
+                frames.push(magazine.frames[magazine.count]);
+            }
+        });
+    }
+
+    /// Caches a released frame. Returns `false` if the frame has to be released to the
+    /// allocator instead. Only the calling thread's magazine is checked for a double
+    /// release; checking the others would mean taking their locks on every release.
+
+    pub fn release(frame: PAddr) -> bool {
+        with_magazine(current(), |magazine| {
+            if magazine.frames[..magazine.count].contains(&frame) {
+                panic!("Attempted to release a 4096-byte block at {:#x} that's already free", frame);
+            }
+
+            if magazine.count == MAGAZINE_SIZE {
+                magazine.drain(BATCH_SIZE);
+            }
+
+            magazine.frames[magazine.count] = frame;
+            magazine.count += 1;
+        }).is_some()
+    }
+
+    /// Returns every cached frame to the allocator, skipping magazines that are in use.
+    /// Returns the number of frames that were released.
+
+    pub fn flush() -> usize {
+        (0..MAGAZINE_COUNT)
+            .filter_map(|index| with_magazine(index, |magazine| {
+                let count = magazine.count;
+                magazine.drain(0);
+                count
+            }))
+            .sum()
+    }
+}
+
+/// A pool of frames that have already been cleared, so that anonymous page faults don't
+/// have to wait for a frame to be zeroed. A background thread refills each pool up to its
+/// high watermark whenever it drops below its low watermark.
+
+pub mod zero_pool {
+    use super::{alloc_phys, release_phys, allocator, allocator_mut, lock_allocator, unlock_allocator,
+                AllocError, BlockSize, mutex_lock, mutex_unlock};
+    use crate::address::PAddr;
+    use crate::lowlevel::phys;
+    use crate::syscall;
+    use alloc::vec::Vec;
+
+    const LOW_WATERMARK_4K: usize = 64;
+    const HIGH_WATERMARK_4K: usize = 256;
+    const LOW_WATERMARK_4M: usize = 1;
+    const HIGH_WATERMARK_4M: usize = 2;
+
+    /// Number of frames to clear before checking whether anything else wants to run
+    const REFILL_BATCH: usize = 8;
+
+    /// How long the refill thread sleeps once the pools are above their low watermarks
+    const IDLE_TIMEOUT: u32 = 100;
+
+    /// Pools aren't refilled when it would leave fewer free 4 kB frames than this, so that
+    /// the pools don't take back the memory that a flush released.
+    const MIN_FREE_FRAMES: usize = 1024;
+
+    struct FramePool {
+        frames: Vec<PAddr>,
+        low_watermark: usize,
+        high_watermark: usize,
+        is_refilling: bool,
+    }
+
+    impl FramePool {
+        const fn new(low_watermark: usize, high_watermark: usize) -> Self {
+            Self {
+                frames: Vec::new(),
+                low_watermark,
+                high_watermark,
+                is_refilling: true,
+            }
+        }
+
+        /// Refilling starts below the low watermark and continues until the pool
+        /// reaches its high watermark.
+
+        fn needs_refill(&mut self) -> bool {
+            if self.frames.len() < self.low_watermark {
+                self.is_refilling = true;
+            } else if self.frames.len() >= self.high_watermark {
+                self.is_refilling = false;
+            }
+
+            self.is_refilling
+        }
+    }
+
+    #[derive(Clone, Copy, Default, Debug)]
+    pub struct ZeroPoolStats {
+        pub hits: usize,
+        pub misses: usize,
+        pub free_4k: usize,
+        pub free_4m: usize,
+    }
+
+    static mut POOL_LOCK: i32 = 0;
+    static mut POOL_4K: FramePool = FramePool::new(LOW_WATERMARK_4K, HIGH_WATERMARK_4K);
+    static mut POOL_4M: FramePool = FramePool::new(LOW_WATERMARK_4M, HIGH_WATERMARK_4M);
+    static mut HITS: usize = 0;
+    static mut MISSES: usize = 0;
+
+    fn with_pool<T>(size: BlockSize, f: impl FnOnce(&mut FramePool) -> T) -> Option<T> {
+        unsafe {
+            let pool = match size {
+                BlockSize::Block4k => &mut POOL_4K,
+                BlockSize::Block4M => &mut POOL_4M,
+                _ => return None,
+            };
+
+            while mutex_lock(&mut POOL_LOCK) != 0 {
+                syscall::sys_sleep(0);
+            }
+
+            let result = f(pool);
+
+            while mutex_unlock(&mut POOL_LOCK) != 0 {}
+            Some(result)
+        }
+    }
+
+    fn clear_block(addr: PAddr, size: BlockSize) -> bool {
+        unsafe {
+            phys::clear_frames(addr, (size.bytes() / BlockSize::Block4k.bytes()) as usize).is_ok()
+        }
+    }
+
+    /// Allocates a zeroed 4 kB or 4 MB block. Pooled blocks are returned without
+    /// any clearing; otherwise, a block is allocated and cleared immediately.
+
+    pub fn alloc_zeroed(size: BlockSize) -> Result<(PAddr, BlockSize), AllocError> {
+        let pooled = with_pool(size, |pool| pool.frames.pop())
+            .flatten();
+
+        match pooled {
+            Some(addr) => {
+                unsafe { HITS += 1; }
+                Ok((addr, size))
+            },
+            None => {
+                unsafe { MISSES += 1; }
+
+                let (addr, block_size) = alloc_phys(size)?;
+
+                if clear_block(addr, block_size) {
+                    Ok((addr, block_size))
+                } else {
+                    release_phys(addr, block_size);
+                    Err(AllocError::OutOfMemory)
+                }
+            }
+        }
+    }
+
+    /// Clears up to `max_blocks` blocks for any pool that needs to be refilled. Returns the
+    /// number of blocks that were added.
+
+    pub fn refill(max_blocks: usize) -> usize {
+        let mut added = 0;
+
+        for &size in [BlockSize::Block4k, BlockSize::Block4M].iter() {
+            while added < max_blocks && has_spare_frames(size)
+                && with_pool(size, |pool| pool.needs_refill()).unwrap_or(false) {
+                let (addr, block_size) = match alloc_phys(size) {
+                    Ok(block) => block,
+                    Err(_) => break,
+                };
+
+                if !clear_block(addr, block_size) {
+                    release_phys(addr, block_size);
+                    break;
+                }
+
+                let is_full = with_pool(size, |pool| {
+                    if pool.frames.len() < pool.high_watermark {
+                        pool.frames.push(addr);
+                        false
+                    } else {
+                        true
+                    }
+                }).unwrap_or(true);
+
+                if is_full {
+                    release_phys(addr, block_size);
+                    break;
+                }
+
+                added += 1;
+            }
+        }
+
+        added
+    }
+
+    fn has_spare_frames(size: BlockSize) -> bool {
+        let frames_needed = (size.bytes() / BlockSize::Block4k.bytes()) as usize + MIN_FREE_FRAMES;
+
+        lock_allocator();
+        let free_frames = allocator().free_frames;
+        unlock_allocator();
+
+        free_frames >= frames_needed
+    }
+
+    /// Returns every pooled block to the allocator. Returns the number of blocks that were
+    /// released.
+
+    pub fn flush() -> usize {
+        let mut released = 0;
+
+        for &size in [BlockSize::Block4k, BlockSize::Block4M].iter() {
+            // split_off() keeps the pool's reserved capacity
+
+            let frames = with_pool(size, |pool| pool.frames.split_off(0))
+                .unwrap_or_default();
+
+            if !frames.is_empty() {
+                lock_allocator();
+
+                for &addr in frames.iter() {
+                    allocator_mut().release(addr, size);
+                }
+
+                unlock_allocator();
+                released += frames.len();
+            }
+        }
+
+        released
+    }
+
+    pub fn stats() -> ZeroPoolStats {
+        unsafe {
+            ZeroPoolStats {
+                hits: HITS,
+                misses: MISSES,
+                free_4k: with_pool(BlockSize::Block4k, |pool| pool.frames.len()).unwrap_or(0),
+                free_4m: with_pool(BlockSize::Block4M, |pool| pool.frames.len()).unwrap_or(0),
+            }
+        }
+    }
+
+    /// Entry point of the thread that keeps the pools filled. It runs at the normal priority:
+    /// it takes the allocator and pool locks, and a waiter that yields with `sys_sleep(0)`
+    /// would never let a lower priority lock holder run. Frames are cleared outside of
+    /// the locks, and the thread yields after every batch.
+
+    pub fn zero_pool_main() -> ! {
+        // Reserve space up front, so that the pools never need to grow while they're locked
+
+        with_pool(BlockSize::Block4k, |pool| pool.frames.reserve(HIGH_WATERMARK_4K));
+        with_pool(BlockSize::Block4M, |pool| pool.frames.reserve(HIGH_WATERMARK_4M));
+
+        loop {
+            if refill(REFILL_BATCH) == 0 {
+                let _ = syscall::sleep(IDLE_TIMEOUT);
+            } else {
+                unsafe { syscall::sys_sleep(0); }
+            }
+        }
+    }
+}
+
+/// Returns the allocator's counters. Frames held by the per-thread magazines and the zero
+/// pools are counted as used.
+
+pub fn stats() -> AllocatorStats {
+    lock_allocator();
+
+    let allocator = allocator();
+    let mut stats = AllocatorStats {
+        free_frames: allocator.free_frames,
+        largest_free_run: allocator.largest_free_run(),
+        ..AllocatorStats::default()
+    };
+
+    for level in 0..BlockSize::total_sizes() {
+        let size = BlockSize::new(level);
+
+        stats.total_blocks[level] = allocator.total_count(size);
+        stats.free_blocks[level] = allocator.free_count(size);
+        stats.used_blocks[level] = allocator.used_count(size);
+    }
+
+    unlock_allocator();
+    stats
+}
+
+/// Adds a reference to a frame that is about to be mapped into another address space.
+/// Returns the new reference count.
+
+pub fn share_frame(address: PAddr) -> u32 {
+    allocator_mut().share_frame(address)
+}
+
+/// Drops a reference to a shared frame. Returns the number of references that remain.
+
+pub fn unshare_frame(address: PAddr) -> u32 {
+    allocator_mut().unshare_frame(address)
+}
+
+pub fn frame_ref_count(address: PAddr) -> u32 {
+    allocator().frame_ref_count(address)
+}
+
 impl PhysPageAllocator {
     pub fn init_bootstrap(first_free_page: PAddr) {
         if is_allocator_ready() {
@@ -223,47 +810,7 @@ impl PhysPageAllocator {
             memory_end.align(PhysicalPage::SMALL_PAGE_SIZE).clamp(1, MAX_PHYS_ADDR)
         };
 
-        let mut allocator = PhysPageAllocator {
-            memory_size: memory_end,
-            occupied_status: Vec::new(),
-            filled_status: Vec::new(),
-            occupied_status_upper: Vec::new(),
-            filled_status_upper: Vec::new(),
-            resd_regions: RegionSet::empty(),
-        };
-
-        // Create the block status bit arrays for the first 4G
-
-        for i in 0..BlockSize::total_sizes() {
-            let block_size = BlockSize::new(i);
-            let blocks = memory_end.clamp(0, MAX_PHYS_ADDR_4K).align(block_size.bytes()) / block_size.bytes();
-
-            allocator.occupied_status.push(BitArray::new(blocks as usize, false));
-
-            // 4k blocks have no sub blocks, so don't add status bits for them
-
-            if i > 0 {
-                allocator.filled_status.push(BitArray::new(blocks as usize, false));
-            }
-        }
-
-        if memory_end > MAX_PHYS_ADDR_4K {
-            // Create the block status bit arrays
-
-            for i in BlockSize::Block4M.level()..BlockSize::total_sizes() {
-                let block_size = BlockSize::new(i);
-                let blocks = (memory_end.clamp(0, MAX_PHYS_ADDR) - MAX_PHYS_ADDR_4K)
-                    .align(block_size.bytes()) / block_size.bytes();
-
-                allocator.occupied_status_upper.push(BitArray::new(blocks as usize, false));
-
-                // 4k blocks have no sub blocks, so don't add status bits for them
-
-                if i > BlockSize::Block4M.level() {
-                    allocator.filled_status_upper.push(BitArray::new(blocks as usize, false));
-                }
-            }
-        }
+        let mut allocator = PhysPageAllocator::with_memory_size(memory_end);
 
         let bootstrap_alloc = unsafe { BOOTSTRAP_MEM.as_mut()
             .unwrap_or_else(|| panic!("Unable to get bootstrap allocator")) };
@@ -358,6 +905,222 @@ impl PhysPageAllocator {
 
             allocator_mut().mark_reserved(r);
         }
+
+        allocator_mut().fill_free_lists();
+    }
+
+    /// Creates an allocator for `memory_end` bytes of physical memory, all of which are free.
+
+    fn with_memory_size(memory_end: PSize) -> PhysPageAllocator {
+        let mut allocator = PhysPageAllocator {
+            memory_size: memory_end,
+            occupied_status: Vec::new(),
+            filled_status: Vec::new(),
+            occupied_status_upper: Vec::new(),
+            filled_status_upper: Vec::new(),
+            resd_regions: RegionSet::empty(),
+            shared_frames: BTreeMap::new(),
+            free_lists: Vec::new(),
+            free_lists_upper: Vec::new(),
+            free_frames: 0,
+        };
+
+        // Create the block status bit arrays for the first 4G
+
+        for i in 0..BlockSize::total_sizes() {
+            let block_size = BlockSize::new(i);
+            let blocks = memory_end.clamp(0, MAX_PHYS_ADDR_4K).align(block_size.bytes()) / block_size.bytes();
+
+            allocator.occupied_status.push(BitArray::with_summary(blocks as usize, false));
+            allocator.free_lists.push(Vec::new());
+
+            // 4k blocks have no sub blocks, so don't add status bits for them
+
+            if i > 0 {
+                allocator.filled_status.push(BitArray::with_summary(blocks as usize, false));
+            }
+        }
+
+        if memory_end > MAX_PHYS_ADDR_4K {
+            // Create the block status bit arrays
+
+            for i in BlockSize::Block4M.level()..BlockSize::total_sizes() {
+                let block_size = BlockSize::new(i);
+                let blocks = (memory_end.clamp(0, MAX_PHYS_ADDR) - MAX_PHYS_ADDR_4K)
+                    .align(block_size.bytes()) / block_size.bytes();
+
+                allocator.occupied_status_upper.push(BitArray::with_summary(blocks as usize, false));
+                allocator.free_lists_upper.push(Vec::new());
+
+                // 4k blocks have no sub blocks, so don't add status bits for them
+
+                if i > BlockSize::Block4M.level() {
+                    allocator.filled_status_upper.push(BitArray::with_summary(blocks as usize, false));
+                }
+            }
+        }
+
+        allocator
+    }
+
+    /// Puts every free block whose super-block isn't free on the free lists. Only blocks that
+    /// are partially used need to be searched.
+
+    fn fill_free_lists(&mut self) {
+        let top = BlockSize::new(BlockSize::total_sizes() - 1);
+
+        for list in self.free_lists.iter_mut().chain(self.free_lists_upper.iter_mut()) {
+            list.clear();
+        }
+
+        self.free_frames = self.occupied_status[0].count_zeros()
+            + self.occupied_status_upper.first().map_or(0, |status| status.count_zeros() * BlockSize::Block4M.frames());
+
+        for index in 0..self.occupied_status[top.level()].bit_count() {
+            self.fill_free_lists_from(index as PAddr * top.bytes(), top);
+        }
+
+        if let Some(upper_status) = self.occupied_status_upper.last() {
+            for index in 0..upper_status.bit_count() {
+                self.fill_free_lists_from(MAX_PHYS_ADDR_4K + index as PAddr * top.bytes(), top);
+            }
+        }
+    }
+
+    fn fill_free_lists_from(&mut self, address: PAddr, size: BlockSize) {
+        let lowest_level = if address >= MAX_PHYS_ADDR_4K {
+            BlockSize::Block4M.level()
+        } else {
+            0
+        };
+
+        if address >= self.memory_size {
+            return;
+        }
+
+        // A free block that extends past the end of memory can only be handed out in pieces
+
+        if self.is_block_free(address, size) && address + size.bytes() <= self.memory_size {
+            self.push_free(address, size);
+        } else if size.level() > lowest_level && !self.is_block_used(address, size) {
+            let sub_size = BlockSize::new(size.level() - 1);
+
+            for i in 0..BitArray::bits_per_word() {
+                self.fill_free_lists_from(address + i as PAddr * sub_size.bytes(), sub_size);
+            }
+        }
+    }
+
+    fn free_list_mut(&mut self, size: BlockSize, upper: bool) -> &mut Vec<PAddr> {
+        if upper {
+            &mut self.free_lists_upper[size.level() - BlockSize::Block4M.level()]
+        } else {
+            &mut self.free_lists[size.level()]
+        }
+    }
+
+    fn push_free(&mut self, address: PAddr, size: BlockSize) {
+        let upper = address >= MAX_PHYS_ADDR_4K;
+        let limit = self.block_status(size, upper).bit_count();
+        let list = self.free_list_mut(size, upper);
+
+        list.push(address);
+
+        // Stale entries pile up when blocks are merged, so drop them once the list holds
+        // twice as many entries as there are blocks
+
+        if list.len() > 2 * limit {
+            let mut list = core::mem::replace(self.free_list_mut(size, upper), Vec::new());
+
+            list.sort_unstable();
+            list.dedup();
+            list.retain(|&addr| self.is_block_free(addr, size));
+            *self.free_list_mut(size, upper) = list;
+        }
+    }
+
+    /// Pops the most recently freed block of `size` off of a free list.
+
+    fn pop_free(&mut self, size: BlockSize, upper: bool) -> Option<PAddr> {
+        while let Some(address) = self.free_list_mut(size, upper).pop() {
+            if self.is_block_free(address, size) {
+                return Some(address);
+            }
+        }
+
+        None
+    }
+
+    /// Takes a free block of `size` from the free lists, splitting a larger block if none is
+    /// available. The first sub-block of a split block is returned and the rest are put
+    /// on the free list.
+
+    fn take_free_block(&mut self, size: BlockSize, upper: bool) -> Option<PAddr> {
+        if let address@Some(_) = self.pop_free(size, upper) {
+            return address;
+        } else if size.level() + 1 >= BlockSize::total_sizes() {
+            return None;
+        }
+
+        let super_size = BlockSize::new(size.level() + 1);
+        let address = self.take_free_block(super_size, upper)?;
+
+        for i in (1..BitArray::bits_per_word()).rev() {
+            self.push_free(address + i as PAddr * size.bytes(), size);
+        }
+
+        Some(address)
+    }
+
+    /// Updates the super-blocks of a block that was just freed. Each of them now has at least
+    /// one free sub-block and a super-block whose sub-blocks are all free becomes free
+    /// itself. Returns the largest free block that contains the freed block.
+
+    fn merge_free(&mut self, address: PAddr, size: BlockSize) -> (PAddr, BlockSize) {
+        let upper = address >= MAX_PHYS_ADDR_4K;
+        let base = if upper { MAX_PHYS_ADDR_4K } else { 0 };
+        let mut merged = (address, size);
+
+        for level in size.level() + 1..BlockSize::total_sizes() {
+            let super_size = BlockSize::new(level);
+            let super_address = address.align_trunc(super_size.bytes());
+            let index = ((address - base) / super_size.bytes()) as usize;
+
+            if upper {
+                self.filled_status_upper_mut(super_size).clear(index);
+            } else {
+                self.filled_status_mut(super_size).clear(index);
+            }
+
+            // The sub-block bits of a super-block share a single word
+
+            let is_merged = merged.1.level() + 1 == level
+                && super_address + super_size.bytes() <= self.memory_size
+                && self.block_status(merged.1, upper).is_word_cleared(index * BitArray::bits_per_word());
+
+            if is_merged {
+                self.block_status_mut(super_size, upper).clear(index);
+                merged = (super_address, super_size);
+            }
+        }
+
+        merged
+    }
+
+    fn block_status(&self, size: BlockSize, upper: bool) -> &BitArray {
+        if upper {
+            &self.occupied_status_upper[size.level() - BlockSize::Block4M.level()]
+        } else {
+            &self.occupied_status[size.level()]
+        }
+    }
+
+    fn block_status_mut(&mut self, size: BlockSize, upper: bool) -> &mut BitArray {
+        if upper {
+            &mut self.occupied_status_upper[size.level() - BlockSize::Block4M.level()]
+        } else {
+            &mut self.occupied_status[size.level()]
+        }
     }
 
     fn filled_status(&self, block: BlockSize) -> &BitArray {
@@ -554,20 +1317,25 @@ impl PhysPageAllocator {
         self.resd_regions.insert(region);
     }
 
+    /// Allocates a block from the free lists, falling back to a search of the status bits if
+    /// the lists are empty. Blocks of 4 MB and up may also come from above 4G.
+
     pub fn alloc(&mut self, size: BlockSize) -> Result<(PAddr, BlockSize), AllocError> {
-        let result = self
-            .find_block(size)
+        let free_block = self.take_free_block(size, false)
+            .or_else(|| if size.level() >= BlockSize::Block4M.level() && !self.free_lists_upper.is_empty() {
+                self.take_free_block(size, true)
+            } else {
+                None
+            });
+
+        let result = free_block
+            .or_else(|| self.find_block(size))
             .map(|addr| (addr, size))
             .ok_or_else(|| {
-                let filled_status = if size.level() >= BlockSize::Block4M.level() {
-                    allocator()
-                        .filled_status_upper(BlockSize::new(BlockSize::total_sizes() - 1))
-                } else {
-                    allocator()
-                        .filled_status(BlockSize::new(BlockSize::total_sizes() - 1))
-                };
+                // Enough free frames means that they're just too fragmented. (The upper status
+                // bits only exist with more than 4G of memory, so they can't be used here.)
 
-                if filled_status.count_ones() == filled_status.bit_count() {
+                if self.free_frames < size.frames() {
                     AllocError::OutOfMemory
                 } else {
                     AllocError::TooBig
@@ -575,10 +1343,25 @@ impl PhysPageAllocator {
             })?;
 
         self.mark_used(result.0, result.1);
+        self.free_frames -= size.frames();
 
         Ok(result)
     }
 
+    /// Allocates the lowest free block, provided that it ends at or below `limit`. Only the
+    /// status bits are searched, since the free lists aren't ordered by address.
+
+    pub fn alloc_below(&mut self, size: BlockSize, limit: PAddr) -> Result<(PAddr, BlockSize), AllocError> {
+        let address = self.find_block(size)
+            .filter(|&addr| addr + size.bytes() <= limit)
+            .ok_or(AllocError::OutOfMemory)?;
+
+        self.mark_used(address, size);
+        self.free_frames -= size.frames();
+
+        Ok((address, size))
+    }
+
     fn find_block(&self, size: BlockSize) -> Option<PAddr> {
         self._find_block(0, BlockSize::total_sizes()-1, size)
     }
@@ -626,19 +1409,59 @@ impl PhysPageAllocator {
             panic!("Attempted to release a {}-byte block at {:#x} that's already free", block_size.bytes(), address);
         } else {
             self.mark_free(address, block_size);
+            self.free_frames += block_size.frames();
+
+            let (free_address, free_size) = self.merge_free(address, block_size);
+            self.push_free(free_address, free_size);
+        }
+    }
+
+    pub fn share_frame(&mut self, address: PAddr) -> u32 {
+        let count = self.shared_frames
+            .entry(address.align_trunc(PhysicalPage::SMALL_PAGE_SIZE))
+            .or_insert(1);
+
+        *count += 1;
+        *count
+    }
+
+    pub fn unshare_frame(&mut self, address: PAddr) -> u32 {
+        let address = address.align_trunc(PhysicalPage::SMALL_PAGE_SIZE);
+
+        match self.shared_frames.get_mut(&address) {
+            Some(count) if *count > 2 => {
+                *count -= 1;
+                *count
+            },
+            Some(_) => {
+                self.shared_frames.remove(&address);
+                1
+            },
+            None => 0,
         }
     }
 
+    pub fn frame_ref_count(&self, address: PAddr) -> u32 {
+        self.shared_frames
+            .get(&address.align_trunc(PhysicalPage::SMALL_PAGE_SIZE))
+            .cloned()
+            .unwrap_or(1)
+    }
+
+    fn has_upper(&self, size: BlockSize) -> bool {
+        size.level() >= BlockSize::Block4M.level() && !self.occupied_status_upper.is_empty()
+    }
+
     pub fn free_count(&self, size: BlockSize) -> usize {
-        self.occupied_status[size.level()].count_zeros() + if size.level() >= BlockSize::Block4M.level() {
-            self.occupied_status_upper[size.level() - size.level()].count_zeros()
+        self.occupied_status[size.level()].count_zeros() + if self.has_upper(size) {
+            self.occupied_status_upper[size.level() - BlockSize::Block4M.level()].count_zeros()
         } else {
             0
         }
     }
 
     pub fn used_count(&self, size: BlockSize) -> usize {
-        self.filled_status(size).count_ones() + if size.level() >= BlockSize::Block4M.level() {
+        self.filled_status(size).count_ones() + if self.has_upper(size) {
             self.filled_status_upper(size).count_ones()
         } else {
             0
@@ -646,116 +1469,275 @@ impl PhysPageAllocator {
     }
 
     pub fn total_count(&self, size: BlockSize) -> usize {
-        self.occupied_status[size.level()].bit_count() + if size.level() >= BlockSize::Block4M.level() {
-            self.occupied_status_upper[size.level() - size.level()].bit_count()
+        self.occupied_status[size.level()].bit_count() + if self.has_upper(size) {
+            self.occupied_status_upper[size.level() - BlockSize::Block4M.level()].bit_count()
         } else {
             0
         }
     }
+
+    /// Returns the number of free 4 kB frames.
+
+    pub fn free_frames(&self) -> usize {
+        self.free_frames
+    }
+
+    /// Returns the length (in 4 kB frames) of the longest run of physically contiguous
+    /// free memory. Runs below and above 4G are measured separately.
+
+    pub fn largest_free_run(&self) -> usize {
+        let lower = Self::longest_cleared_run(&self.occupied_status[0]);
+        let upper = self.occupied_status_upper
+            .first()
+            .map_or(0, |status| Self::longest_cleared_run(status) * BlockSize::Block4M.frames());
+
+        cmp::max(lower, upper)
+    }
+
+    fn longest_cleared_run(bits: &BitArray) -> usize {
+        let mut longest = 0;
+        let mut next = bits.next_cleared(0);
+
+        while let Some(start) = next {
+            let end = bits.next_set(start).unwrap_or(bits.bit_count());
+
+            longest = cmp::max(longest, end - start);
+            next = bits.next_cleared(end);
+        }
+
+        longest
+    }
 }
 
 #[cfg(test)]
 mod test {
     use crate::page::PhysicalPage;
-    use super::new_allocator::Page;
     use crate::address::Align;
-    use super::BlockSize;
+    use super::{BlockSize, PhysPageAllocator};
     use crate::address::{PSize, PAddr};
     use alloc::vec::Vec;
 
+    fn new_allocator(total_mem: PSize) -> PhysPageAllocator {
+        let mut allocator = PhysPageAllocator::with_memory_size(total_mem);
+        allocator.fill_free_lists();
+        allocator
+    }
+
     #[test]
     fn test_allocation() {
-        let (start_addr, total_mem) = (0x1000, 0x10000);
-        super::allocator().init_test(start_addr, total_mem);
+        let total_mem = 0x10000;
+        let mut allocator = new_allocator(total_mem);
 
-        assert_eq!(super::allocator().total_count(BlockSize::Block4k), (total_mem-start_addr) / PhysicalPage::SMALL_PAGE_SIZE);
-        assert_eq!(super::allocator().total_count(BlockSize::Block4k), super::allocator().free_count(BlockSize::Block4k));
-        assert_eq!(super::allocator().used_count(BlockSize::Block4k), 0);
+        assert_eq!(allocator.total_count(BlockSize::Block4k), (total_mem / PhysicalPage::SMALL_PAGE_SIZE) as usize);
+        assert_eq!(allocator.total_count(BlockSize::Block4k), allocator.free_count(BlockSize::Block4k));
+        assert_eq!(allocator.used_count(BlockSize::Block4k), 0);
 
-        let alloc_result = super::allocator().alloc(BlockSize::Block4k);
+        let alloc_result = allocator.alloc(BlockSize::Block4k);
 
-        assert!(alloc_result.is_some());
+        assert!(alloc_result.is_ok());
 
-        let address = alloc_result.unwrap().0;
+        let address = alloc_result.ok().unwrap().0;
 
-        assert!(address >= start_addr);
         assert!(address < total_mem as PAddr);
         assert!(address.is_aligned(PhysicalPage::SMALL_PAGE_SIZE));
-        assert!(!super::allocator().is_free(address));
-        assert!(super::allocator().is_used(address));
-
-        let page2 = page.clone();
+        assert!(!allocator.is_free(address));
+        assert!(allocator.is_used(address));
 
-        super::allocator().release(address, BlockSize::Block4k);
+        allocator.release(address, BlockSize::Block4k);
 
-        assert!(super::allocator().is_free(address));
-        assert!(super::allocator().is_used(address));
+        assert!(allocator.is_free(address));
+        assert!(!allocator.is_used(address));
     }
 
     #[test]
     fn test_free_page_count() {
-        let (start_addr, total_mem) = (0x0000, 0x100000);
-        super::allocator().init_test(start_addr, total_mem);
+        let total_mem = 0x100000;
+        let mut allocator = new_allocator(total_mem);
+        let frames = (total_mem / PhysicalPage::SMALL_PAGE_SIZE) as usize;
 
-        assert_eq!(super::allocator().free_count(BlockSize::Block4k), (total_mem-start_addr as PSize) / PhysicalPage::SMALL_PAGE_SIZE);
+        assert_eq!(allocator.free_count(BlockSize::Block4k), frames);
 
-        let p1 = super::allocator().alloc(BlockSize::Block4k).unwrap().0;
-        let p2 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
-        let p3 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
+        let p1 = allocator.alloc(BlockSize::Block4k).ok().unwrap().0;
+        let p2 = allocator.alloc(BlockSize::Block4k).ok().unwrap().0;
+        let p3 = allocator.alloc(BlockSize::Block4k).ok().unwrap().0;
 
-        assert_eq!(super::allocator().free_count(BlockSize::Block4k), ((total_mem-start_addr as PSize) / PhysicalPage::SMALL_PAGE_SIZE - 3) as PSize);
+        assert_eq!(allocator.free_count(BlockSize::Block4k), frames - 3);
+        assert_eq!(allocator.free_frames(), frames - 3);
 
         [p1, p2, p3]
             .iter()
-            .for_each(|a| super::allocator_mut().release(*a, BlockSize::Block4k));
+            .for_each(|a| allocator.release(*a, BlockSize::Block4k));
 
-        assert_eq!(super::allocator().free_count(BlockSize::Block4k), (total_mem-start_addr as PSize) / PhysicalPage::SMALL_PAGE_SIZE);
+        assert_eq!(allocator.free_count(BlockSize::Block4k), frames);
+        assert_eq!(allocator.free_frames(), frames);
     }
 
     #[test]
     fn test_used_page_count() {
-        let (start_addr, total_mem) = (0x0000, 0x100000);
-        super::allocator().init_test(start_addr, total_mem);
+        let mut allocator = new_allocator(0x100000);
 
-        assert_eq!(super::allocator().used_count(BlockSize::Block4k), 0);
+        assert_eq!(allocator.used_count(BlockSize::Block4k), 0);
 
-        let p1 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
-        let p2 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
-        let p3 = super::allocator_mut().alloc(BlockSize::Block4k).unwrap().0;
+        let p1 = allocator.alloc(BlockSize::Block4k).ok().unwrap().0;
+        let p2 = allocator.alloc(BlockSize::Block4k).ok().unwrap().0;
+        let p3 = allocator.alloc(BlockSize::Block4k).ok().unwrap().0;
 
-        assert_eq!(super::allocator().used_count(BlockSize::Block4k), 3);
+        assert_eq!(allocator.used_count(BlockSize::Block4k), 3);
 
         [p1, p2, p3]
             .iter()
-            .for_each(|a| super::allocator_mut().release(*a, BlockSize::Block4k));
+            .for_each(|a| allocator.release(*a, BlockSize::Block4k));
 
-        assert_eq!(super::allocator().used_count(BlockSize::Block4k), 0);
+        assert_eq!(allocator.used_count(BlockSize::Block4k), 0);
     }
 
     #[test]
     fn test_empty_allocator() {
-        let (start_addr, total_mem) = (0x0000, 0x0000);
+        let mut allocator = new_allocator(0);
 
-        super::allocator().init_test(start_addr, total_mem);
-        assert_eq!(super::allocator().free_count(BlockSize::Block4k), 0);
-        assert!(super::allocator_mut().alloc(BlockSize::Block4k).is_none());
+        assert_eq!(allocator.free_count(BlockSize::Block4k), 0);
+        assert!(allocator.alloc(BlockSize::Block4k).is_err());
     }
 
     #[test]
     #[should_panic]
     fn test_double_release() {
-        let (start_addr, total_mem) = (0x0000, 0x10000);
-        super::allocator().init_test(start_addr, total_mem);
+        let mut allocator = new_allocator(0x10000);
+        let result = allocator.alloc(BlockSize::Block4k);
+
+        assert!(result.is_ok());
+
+        let address = result.ok().unwrap().0;
+
+        allocator.release(address, BlockSize::Block4k);
+        allocator.release(address, BlockSize::Block4k);
+    }
+
+    #[test]
+    fn test_split_and_merge() {
+        let mut allocator = super::PhysPageAllocator::with_memory_size(0x800000);
+        allocator.fill_free_lists();
+
+        assert!(allocator.is_block_free(0, BlockSize::Block4M));
+        assert!(allocator.is_block_free(0x400000, BlockSize::Block4M));
 
-        let result = super::allocator_mut().alloc(BlockSize::Block4k);
+        let addresses = (0..40)
+            .map(|_| allocator.alloc(BlockSize::Block4k).ok().unwrap().0)
+            .collect::<Vec<PAddr>>();
 
-        assert!(result.is_some());
+        let split_block = addresses[0].align_trunc(BlockSize::Block4M.bytes());
+
+        assert!(!allocator.is_block_free(split_block, BlockSize::Block4M));
+        assert!(allocator.is_block_free(split_block ^ 0x400000, BlockSize::Block4M));
+
+        for &address in addresses.iter() {
+            assert!(addresses.iter().filter(|&&a| a == address).count() == 1);
+            allocator.release(address, BlockSize::Block4k);
+        }
+
+        // Every block should have been merged back into its 4M block
+
+        assert!(allocator.is_block_free(split_block, BlockSize::Block4M));
+        assert!(allocator.alloc(BlockSize::Block4M).is_ok());
+        assert!(allocator.alloc(BlockSize::Block4M).is_ok());
+        assert!(allocator.alloc(BlockSize::Block4k).is_err());
+    }
+
+    #[test]
+    fn test_release_large_block_in_pieces() {
+        let mut allocator = super::PhysPageAllocator::with_memory_size(0x800000);
+        allocator.fill_free_lists();
+
+        let (block, _) = allocator.alloc(BlockSize::Block4M).ok().unwrap();
+        let free_frames = allocator.free_frames;
+        let frames = BlockSize::Block4M.frames();
+
+        // A large block can be split up and released one 4 kB frame at a time
+
+        for i in 0..frames {
+            allocator.release(block + i as PAddr * PhysicalPage::SMALL_PAGE_SIZE, BlockSize::Block4k);
+        }
+
+        assert_eq!(allocator.free_frames, free_frames + frames);
+        assert!(allocator.is_block_free(block, BlockSize::Block4M));
+        assert!(allocator.alloc(BlockSize::Block4M).is_ok());
+        assert!(allocator.alloc(BlockSize::Block4M).is_ok());
+    }
+
+    #[test]
+    fn test_fragmented_large_alloc() {
+        // Less than 4G of memory, so there are no status bits for the upper section
+
+        let mut allocator = super::PhysPageAllocator::with_memory_size(0x800000);
+        allocator.fill_free_lists();
+
+        // Keep one frame in each 4M block, so that most of the memory is free but unusable
+
+        let frames = (0..BlockSize::Block4M.frames() * 2)
+            .map(|_| allocator.alloc(BlockSize::Block4k).ok().unwrap().0)
+            .collect::<Vec<PAddr>>();
+
+        for &frame in frames.iter().filter(|&&frame| frame % BlockSize::Block4M.bytes() != 0) {
+            allocator.release(frame, BlockSize::Block4k);
+        }
+
+        assert!(matches!(allocator.alloc(BlockSize::Block4M), Err(super::AllocError::TooBig)));
+
+        allocator.release(0, BlockSize::Block4k);
+        allocator.release(BlockSize::Block4M.bytes(), BlockSize::Block4k);
+
+        let block = allocator.alloc(BlockSize::Block4M).ok().unwrap().0;
+        let _ = allocator.alloc(BlockSize::Block4M).ok().unwrap();
+
+        assert!(matches!(allocator.alloc(BlockSize::Block4k), Err(super::AllocError::OutOfMemory)));
+        allocator.release(block, BlockSize::Block4M);
+    }
+
+    /// Allocates and releases a few million blocks of mixed sizes. It's ignored by default; run
+    /// the host test binary, built with optimizations, with `--ignored bench_mixed_sizes --nocapture`.
+
+    #[test]
+    #[ignore]
+    fn bench_mixed_sizes() {
+        extern crate std;
+
+        const OPERATIONS: usize = 4_000_000;
+
+        let mut allocator = super::PhysPageAllocator::with_memory_size(0x40000000);
+        allocator.fill_free_lists();
+
+        let mut live: Vec<(PAddr, BlockSize)> = Vec::new();
+        let mut seed = 0x2545f491u32;
+        let start = std::time::Instant::now();
+
+        for _ in 0..OPERATIONS {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+
+            let size = match seed % 64 {
+                0 => BlockSize::Block4M,
+                1..=8 => BlockSize::Block128k,
+                _ => BlockSize::Block4k,
+            };
+
+            if live.is_empty() || (seed >> 8) % 8 < 5 {
+                if let Ok(block) = allocator.alloc(size) {
+                    live.push(block);
+                    continue;
+                }
+            }
+
+            if !live.is_empty() {
+                let (address, size) = live.swap_remove((seed >> 12) as usize % live.len());
+                allocator.release(address, size);
+            }
+        }
 
-        let page = result.unwrap().0;
-        let cloned_page = page.clone().0;
+        let elapsed = start.elapsed();
 
-        super::allocator().release(page, BlockSize::Block4k);
-        super::allocator().release(cloned_page, BlockSize::Block4k);
+        std::println!("{} operations in {:?} ({} ns/op), {} blocks live", OPERATIONS, elapsed,
+                      elapsed.as_nanos() / OPERATIONS as u128, live.len());
     }
 
     #[test]
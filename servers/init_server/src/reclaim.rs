@@ -0,0 +1,414 @@
+#![allow(dead_code)]
+
+use crate::error;
+use crate::syscall::{self, c_types::PageMapping, flags::page_mapping};
+use crate::mapping::{self, AddrSpace, AddressMapping};
+use crate::address::{Align, PAddr, VAddr};
+use crate::device::{self, DeviceId};
+use crate::page::{PhysicalPage, VirtualPage};
+use crate::phys_alloc::{self, BlockSize};
+use crate::types::bit_array::BitArray;
+use alloc::string::String;
+use alloc::vec::Vec;
+use core::cmp;
+
+/// The number of pages that the pager tries to reclaim when it runs out of memory
+pub const RECLAIM_BATCH: usize = 32;
+
+/// The number of PTEs that are read with one system call when scanning for swapped pages.
+/// A batch never crosses a page table.
+const SCAN_BATCH: usize = 512;
+
+const PAGE_SIZE: usize = VirtualPage::SMALL_PAGE_SIZE;
+
+/// A swap device along with the slots that are in use. Slot `n` occupies the page at
+/// offset `n * PAGE_SIZE` of the device.
+
+struct SwapSpace {
+    device: DeviceId,
+    used_slots: BitArray,
+}
+
+static mut SWAP_SPACE: Option<SwapSpace> = None;
+
+/// The position of the clock hand: the root page map of an address space and the page
+/// that will be examined next.
+static mut CLOCK_HAND: Option<(PAddr, usize)> = None;
+
+/// Sets the device that dirty anonymous pages are written to. Without a swap device, only
+/// clean pages can be reclaimed.
+
+pub fn set_swap_device(device: DeviceId, slot_count: usize) {
+    let slot_count = cmp::min(slot_count, page_mapping::MAX_BLOCK_NUM as usize - 1);
+
+    unsafe {
+        SWAP_SPACE = Some(SwapSpace {
+            device,
+            used_slots: BitArray::with_summary(slot_count, false),
+        });
+    }
+}
+
+/// Returns the number of swap slots that are in use along with the total number of slots.
+
+pub fn swap_usage() -> (usize, usize) {
+    unsafe { SWAP_SPACE.as_ref() }
+        .map_or((0, 0), |swap| (swap.used_slots.count_ones(), swap.used_slots.bit_count()))
+}
+
+fn alloc_slot() -> Option<usize> {
+    unsafe { SWAP_SPACE.as_mut() }
+        .and_then(|swap| {
+            let slot = swap.used_slots.first_cleared()
+                .filter(|&slot| slot < swap.used_slots.bit_count())?;
+
+            swap.used_slots.set(slot);
+            Some(slot)
+        })
+}
+
+fn free_slot(slot: usize) {
+    if let Some(swap) = unsafe { SWAP_SPACE.as_mut() } {
+        swap.used_slots.clear(slot);
+    }
+}
+
+fn slot_page(slot: usize) -> Option<VirtualPage> {
+    unsafe { SWAP_SPACE.as_ref() }
+        .map(|swap| VirtualPage::new(swap.device.clone(), (slot * PAGE_SIZE) as u64, 0))
+}
+
+// Block number 0 is stored in PTEs that were never mapped (or were dropped without being
+// written to swap), so slots are offset by one.
+
+fn slot_to_block(slot: usize) -> u32 {
+    slot as u32 + 1
+}
+
+fn block_to_slot(block: u32) -> Option<usize> {
+    block.checked_sub(1).map(|slot| slot as usize)
+}
+
+pub fn read_pte(root_pmap: PAddr, page: usize) -> Option<PageMapping> {
+    let mut entry = [PageMapping::default()];
+
+    match syscall::get_page_mappings(page_mapping::PTE_LEVEL, page, root_pmap, &mut entry) {
+        Ok(1) => Some(entry[0]),
+        _ => None,
+    }
+}
+
+pub fn write_pte(root_pmap: PAddr, page: usize, entry: PageMapping) -> bool {
+    match syscall::set_page_mappings(page_mapping::PTE_LEVEL, page, root_pmap, &[entry]) {
+        Ok(1) => true,
+        _ => false,
+    }
+}
+
+/// Returns `true` if the frame backing `page` holds anonymous memory that belongs to this
+/// address space alone, and may therefore be reclaimed.
+
+fn is_reclaimable(mapping: &AddressMapping, frame: PAddr) -> bool {
+    mapping.flags & AddrSpace::GUARD == 0
+        && device::is_private_page(&mapping.base_page)
+        && !device::is_zero_frame(frame)
+        && phys_alloc::frame_ref_count(frame) == 1
+}
+
+/// Evicts a single page. The PTE is made non-present before the page is written to swap,
+/// so that the page can't be modified while it's being written out.
+
+fn evict_page(addr_space: &mut AddrSpace, mapping: &AddressMapping, page: usize, frame: PAddr,
+              entry: PageMapping) -> bool {
+    let root_pmap = addr_space.root_pmap();
+
+    // Copy-on-write frames may have been written through another address space's PTE, so
+    // a clean PTE doesn't mean that the page still holds zeros.
+
+    let is_dirty = entry.flags & page_mapping::DIRTY == page_mapping::DIRTY
+        || mapping.flags & AddrSpace::COPY_ON_WRITE == AddrSpace::COPY_ON_WRITE;
+
+    let slot = if is_dirty {
+        match alloc_slot() {
+            Some(slot) => Some(slot),
+            None => return false,
+        }
+    } else {
+        None
+    };
+
+    let unmapped_entry = PageMapping {
+        frame: slot.map_or(0, slot_to_block),
+        flags: page_mapping::UNMAPPED,
+    };
+
+    if !write_pte(root_pmap, page, unmapped_entry) {
+        if let Some(slot) = slot {
+            free_slot(slot);
+        }
+
+        return false;
+    }
+
+    if let Some(slot) = slot {
+        let written = slot_page(slot)
+            .ok_or(error::DEVICE_NOT_EXIST)
+            .and_then(|swap_page| device::write_page(&swap_page, &PhysicalPage::new(frame)));
+
+        if written.is_err() {
+            write_pte(root_pmap, page, entry);
+            free_slot(slot);
+            return false;
+        }
+
+        addr_space.swapped_pages += 1;
+    }
+
+    let vpage = mapping.base_page.add_offset((page - mapping.region.start()) as u64);
+
+    addr_space.remove_resident(page);
+    device::release_page(&vpage, &PhysicalPage::new(frame));
+    true
+}
+
+/// Reclaims up to `target` pages using the CLOCK algorithm. Resident pages are visited in
+/// order across all address spaces. A page that has been accessed since the hand last
+/// passed it has its accessed bit cleared and is given a second chance. Otherwise, it's
+/// either written to swap (if dirty) or dropped (if clean). Returns the number of pages
+/// that were reclaimed.
+
+pub fn reclaim_pages(target: usize) -> usize {
+    // File pages that were read ahead, but never mapped, are the cheapest to reclaim
+
+    let dropped = device::page_cache::drop_unreferenced(target);
+
+    if dropped >= target {
+        return dropped;
+    }
+
+    // The address space that the hand points to may have been unregistered since
+
+    let (mut pmap, mut next_page) = match unsafe { CLOCK_HAND } {
+        Some((pmap, page)) if mapping::manager::lookup_pmap_mut(pmap).is_some() => (pmap, page),
+        _ => match mapping::manager::next_pmap(None) {
+            Some(pmap) => (pmap, 0),
+            None => return dropped,
+        }
+    };
+
+    let mut reclaimed = dropped;
+    let mut wrapped = 0;
+    let start_pmap = pmap;
+
+    // Two full sweeps are enough to clear every accessed bit and then reclaim. A sweep
+    // ends when the hand comes back around to the address space that it started in.
+
+    while reclaimed < target && wrapped < 2 {
+        let next = mapping::manager::lookup_pmap_mut(pmap)
+            .and_then(|addr_space| addr_space.next_resident(next_page)
+                .map(|resident| (addr_space, resident)));
+
+        let (addr_space, (page, frame)) = match next {
+            Some(next) => next,
+            None => {
+                pmap = match mapping::manager::next_pmap(Some(pmap))
+                    .or_else(|| mapping::manager::next_pmap(None)) {
+                    Some(pmap) => pmap,
+                    None => break,
+                };
+
+                if pmap == start_pmap {
+                    wrapped += 1;
+                }
+
+                next_page = 0;
+                continue;
+            }
+        };
+
+        next_page = page + PAGE_SIZE;
+
+        let mapping = match addr_space.get_mapping(page as VAddr).cloned() {
+            Some(mapping) if is_reclaimable(&mapping, frame) => mapping,
+            _ => continue,
+        };
+
+        let entry = match read_pte(pmap, page) {
+            Some(entry) if entry.flags & page_mapping::UNMAPPED == 0 => entry,
+            _ => continue,
+        };
+
+        if entry.flags & page_mapping::ACCESSED == page_mapping::ACCESSED {
+            write_pte(pmap, page, PageMapping {
+                frame: entry.frame,
+                flags: entry.flags & !page_mapping::ACCESSED,
+            });
+        } else if evict_page(addr_space, &mapping, page, frame, entry) {
+            reclaimed += 1;
+        }
+    }
+
+    unsafe {
+        CLOCK_HAND = Some((pmap, next_page));
+    }
+
+    reclaimed
+}
+
+/// Brings a page back in from swap if its PTE holds a swap slot. Returns `Ok(false)` if
+/// the page was never swapped out.
+
+pub fn swap_in(addr_space: &mut AddrSpace, mapping: &AddressMapping, page: usize)
+               -> Result<bool, (error::Error, Option<String>)> {
+    if addr_space.swapped_pages == 0 {
+        return Ok(false);
+    }
+
+    let root_pmap = addr_space.root_pmap();
+
+    let slot = match read_pte(root_pmap, page) {
+        Some(entry) if entry.flags & page_mapping::UNMAPPED == page_mapping::UNMAPPED =>
+            match block_to_slot(entry.frame) {
+                Some(slot) => slot,
+                None => return Ok(false),
+            },
+        _ => return Ok(false),
+    };
+
+    let swap_page = slot_page(slot)
+        .ok_or_else(|| (error::DEVICE_NOT_EXIST, Some(String::from("Page was swapped out, but there's no swap device."))))?;
+
+    let (frame, _) = phys_alloc::alloc_phys(BlockSize::Block4k)
+        .map_err(|_| (error::OUT_OF_MEMORY, None))?;
+
+    if let Err(code) = device::read_page_into(&swap_page, &PhysicalPage::new(frame)) {
+        phys_alloc::release_phys(frame, BlockSize::Block4k);
+        return Err((code, Some(format!("Unable to read page {:#x} from swap", page))));
+    }
+
+    // The page no longer has a copy in swap, so it must be marked dirty in order to be
+    // written out again
+
+    let mut flags = page_mapping::DIRTY | page_mapping::ACCESSED;
+
+    if mapping.flags & AddrSpace::READ_ONLY == AddrSpace::READ_ONLY {
+        flags |= page_mapping::READ_ONLY;
+    }
+
+    if mapping.flags & AddrSpace::NO_EXECUTE == AddrSpace::NO_EXECUTE {
+        flags |= page_mapping::NO_EXECUTE;
+    }
+
+    let entry = PageMapping {
+        frame: (frame / PAGE_SIZE as PAddr) as u32,
+        flags,
+    };
+
+    if !write_pte(root_pmap, page, entry) {
+        phys_alloc::release_phys(frame, BlockSize::Block4k);
+        return Err((error::OPERATION_FAILED, Some(format!("Unable to map page {:#x}", page))));
+    }
+
+    free_slot(slot);
+    addr_space.swapped_pages -= 1;
+    addr_space.set_resident(page, frame);
+
+    Ok(true)
+}
+
+/// Returns the pages in `[start, end)` whose PTEs hold a swap slot, along with the slot
+
+fn swapped_pages_in(root_pmap: PAddr, start: usize, end: usize) -> Vec<(usize, usize)> {
+    let mut swapped = Vec::new();
+    let mut entries = [PageMapping::default(); SCAN_BATCH];
+    let mut batch_start = start;
+
+    while batch_start < end {
+        let batch_end = cmp::min(batch_start.align_trunc(SCAN_BATCH * PAGE_SIZE)
+                                     .saturating_add(SCAN_BATCH * PAGE_SIZE), end);
+        let count = (batch_end - batch_start) / PAGE_SIZE;
+
+        for entry in entries[..count].iter_mut() {
+            *entry = PageMapping::default();
+        }
+
+        // A batch that stops early has reached a page table that isn't present
+
+        let read = syscall::get_page_mappings(page_mapping::PTE_LEVEL, batch_start, root_pmap,
+                                              &mut entries[..count])
+            .unwrap_or(0);
+
+        for (i, entry) in entries[..read].iter().enumerate() {
+            if entry.flags & page_mapping::UNMAPPED == page_mapping::UNMAPPED {
+                if let Some(slot) = block_to_slot(entry.frame) {
+                    swapped.push((batch_start + i * PAGE_SIZE, slot));
+                }
+            }
+        }
+
+        batch_start = batch_end;
+    }
+
+    swapped
+}
+
+/// Frees the swap slots of the pages of the mapping at `start` that lie in `[start, end)`.
+/// This must be done before the region is unmapped.
+
+pub fn release_swap(addr_space: &mut AddrSpace, start: usize, end: usize) {
+    if addr_space.swapped_pages == 0 {
+        return;
+    }
+
+    let region_end = match addr_space.get_mapping(start as VAddr) {
+        Some(mapping) => mapping.region.end(),
+        None => return,
+    };
+
+    // A region end of 0 means the end of memory
+
+    let end = if region_end == 0 {
+        end
+    } else {
+        cmp::min(end, region_end)
+    };
+
+    let root_pmap = addr_space.root_pmap();
+    let start = start.align_trunc(PAGE_SIZE);
+    let end = end.align(PAGE_SIZE);
+
+    for (page, slot) in swapped_pages_in(root_pmap, start, end) {
+        write_pte(root_pmap, page, PageMapping { frame: 0, flags: page_mapping::UNMAPPED });
+        free_slot(slot);
+        addr_space.swapped_pages -= 1;
+    }
+}
+
+/// Brings every swapped page of an address space back into memory
+
+pub fn swap_in_all(addr_space: &mut AddrSpace) -> Result<(), (error::Error, Option<String>)> {
+    if addr_space.swapped_pages == 0 {
+        return Ok(());
+    }
+
+    let mappings = addr_space.mappings()
+        .cloned()
+        .collect::<Vec<AddressMapping>>();
+
+    for mapping in mappings.iter() {
+        // A region end of 0 means the end of memory
+
+        let end = match mapping.region.end() {
+            0 => usize::MAX.align_trunc(PAGE_SIZE),
+            end => end,
+        };
+
+        let swapped = swapped_pages_in(addr_space.root_pmap(), mapping.region.start(), end);
+
+        for (page, _) in swapped {
+            swap_in(addr_space, mapping, page)?;
+        }
+    }
+
+    Ok(())
+}
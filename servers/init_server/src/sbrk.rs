@@ -77,7 +77,7 @@ impl HeapRegion {
                                   frame_count as i32, READ_WRITE | if use_large_pages { PM_LARGE_PAGE } else { 0 }) {
             Ok(pages_mapped) if pages_mapped == frame_count as i32 => {
                 self.map_end += pages_mapped as usize * if use_large_pages {
-                    PhysicalPage::PSE_LARGE_PAGE_SIZE as usize
+                    PhysicalPage::LARGE_PAGE_SIZE as usize
                 } else {
                     PhysicalPage::SMALL_PAGE_SIZE as usize
                 };
@@ -109,27 +109,42 @@ impl HeapRegion {
                 let mut frames = [0; 32];
                 let mut frames_mapped = 0;
 
+                // Large pages must start on a large page boundary. While the rest of the
+                // increment is big enough for one, smaller blocks are mapped only until the end
+                // is aligned.
+
+                let large_page_size = PhysicalPage::LARGE_PAGE_SIZE as usize;
+
                 'map_loop: while map_bytes > 0 {
                     // Find the largest set of blocks that are less than or equal to the increment size
-                    // If none are available then move to the next smallest block
+                    // If none are available then move to the next smallest block.
+                    // Start over from the largest size after each block, since the end may have
+                    // reached an alignment that allows for a larger one.
 
                     for level in (0..BlockSize::total_sizes()).rev() {
                         let block_size = BlockSize::new(level);
                         let block_len = block_size.bytes();
                         let use_large_pages;
 
-                        // Divide each block into either large pages (4M for PSE) or small pages
+                        // Divide each block into either large pages (4M for PSE, 2M for PAE) or small pages
                         // (the largest one that also fits in the block)
 
-                        let page_size = if block_len >= PhysicalPage::PSE_LARGE_PAGE_SIZE {
+                        let page_size = if block_len >= PhysicalPage::LARGE_PAGE_SIZE {
                             use_large_pages = true;
-                            PhysicalPage::PSE_LARGE_PAGE_SIZE
+                            PhysicalPage::LARGE_PAGE_SIZE
                         } else {
                             use_large_pages = false;
                             PhysicalPage::SMALL_PAGE_SIZE
                         };
 
-                        while map_bytes as u64 >= block_len {
+                        let alignment = cmp::min(block_len as usize, large_page_size);
+
+                        if (use_large_pages || map_bytes >= large_page_size)
+                            && !self.map_end.is_aligned(alignment) {
+                            continue;
+                        }
+
+                        if map_bytes as u64 >= block_len {
                             // Allocate a block of physical memory, then map it to the end of the
                             // heap.
 
@@ -233,6 +248,7 @@ impl HeapRegion {
                                 break 'map_loop;
                             } else {
                                 map_bytes -= alloc_block_size.bytes() as usize;
+                                continue 'map_loop;
                             }
                         }
                     }
@@ -0,0 +1,296 @@
+#![allow(dead_code)]
+
+//! Named shared memory regions. A region is a range of frames that every attached address
+//! space maps directly, so processes can exchange data without copying it through IPC.
+//!
+//! Regions are pages of the shared memory device (the minor is the region id), so they are
+//! faulted in by the pager like any other device mapping. A region holds its own reference
+//! to each of its frames; every mapping of a frame adds another one.
+
+use crate::error::{self, Error};
+use crate::device::{self, DeviceId};
+use crate::mapping::AddrSpace;
+use crate::address::{Align, PAddr, VAddr};
+use crate::page::{PhysicalPage, VirtualPage};
+use crate::phys_alloc::{self, BlockSize};
+use crate::syscall;
+use crate::message::init::{CreateShmRequest, MAX_NAME_LEN};
+use alloc::collections::btree_map::BTreeMap;
+use alloc::string::String;
+use alloc::vec::Vec;
+use core::ffi::c_void;
+
+const PAGE_SIZE: usize = VirtualPage::SMALL_PAGE_SIZE;
+
+struct SharedRegion {
+    name: Option<String>,
+    /// Root page map of the address space that created the region
+    owner: PAddr,
+    length: usize,
+    /// `CreateShmRequest::OTHERS_READ` and/or `CreateShmRequest::OTHERS_WRITE`
+    access: u32,
+    /// Frames are allocated when a page is first touched
+    frames: Vec<Option<PAddr>>,
+    /// The root page map and start address of each attachment
+    attachments: Vec<(PAddr, usize)>,
+}
+
+impl SharedRegion {
+    fn may_attach(&self, pmap: PAddr, read_only: bool) -> bool {
+        if pmap == self.owner {
+            true
+        } else if read_only {
+            self.access & (CreateShmRequest::OTHERS_READ | CreateShmRequest::OTHERS_WRITE) != 0
+        } else {
+            self.access & CreateShmRequest::OTHERS_WRITE == CreateShmRequest::OTHERS_WRITE
+        }
+    }
+
+    /// A region is torn down once it has been deleted and the last attachment is gone
+    fn is_unused(&self) -> bool {
+        self.name.is_none() && self.attachments.is_empty()
+    }
+}
+
+static mut REGIONS: Option<BTreeMap<u16, SharedRegion>> = None;
+static mut REGION_NAMES: Option<BTreeMap<String, u16>> = None;
+static mut NEXT_REGION_ID: u16 = 0;
+
+fn regions() -> &'static mut BTreeMap<u16, SharedRegion> {
+    unsafe {
+        REGIONS.get_or_insert_with(BTreeMap::new)
+    }
+}
+
+fn region_names() -> &'static mut BTreeMap<String, u16> {
+    unsafe {
+        REGION_NAMES.get_or_insert_with(BTreeMap::new)
+    }
+}
+
+fn next_region_id() -> Option<u16> {
+    let start = unsafe { NEXT_REGION_ID };
+    let mut id = start;
+
+    loop {
+        if !regions().contains_key(&id) {
+            unsafe { NEXT_REGION_ID = id.wrapping_add(1); }
+            return Some(id);
+        }
+
+        id = id.wrapping_add(1);
+
+        if id == start {
+            return None;
+        }
+    }
+}
+
+fn destroy(id: u16) {
+    if let Some(region) = regions().remove(&id) {
+        for frame in region.frames.into_iter().flatten() {
+            phys_alloc::release_phys(frame, BlockSize::Block4k);
+        }
+    }
+}
+
+/// Creates a region of `length` bytes that's owned by the address space with root page
+/// map `owner`. No memory is allocated until the region is touched.
+
+pub fn create(owner: PAddr, name: &str, length: usize, access: u32) -> Result<(), Error> {
+    if name.len() > MAX_NAME_LEN {
+        return Err(error::LONG_NAME);
+    } else if length == 0 {
+        return Err(error::ZERO_LENGTH);
+    } else if region_names().contains_key(name) {
+        return Err(error::ALREADY_REGISTERED);
+    }
+
+    let page_count = length.checked_add(PAGE_SIZE - 1)
+        .ok_or(error::LENGTH_OVERFLOW)? / PAGE_SIZE;
+    let id = next_region_id().ok_or(error::OUT_OF_MEMORY)?;
+
+    regions().insert(id, SharedRegion {
+        name: Some(String::from(name)),
+        owner,
+        length: page_count * PAGE_SIZE,
+        access,
+        frames: vec![None; page_count],
+        attachments: Vec::new(),
+    });
+
+    region_names().insert(String::from(name), id);
+    Ok(())
+}
+
+/// Maps a region into an address space. The region is mapped at `addr` if it's given or
+/// at any free address otherwise. Returns the address and length of the mapping.
+
+pub fn attach(addr_space: &mut AddrSpace, name: &str, addr: Option<VAddr>, read_only: bool)
+              -> Result<(VAddr, usize), Error> {
+    let pmap = addr_space.root_pmap();
+    let id = *region_names().get(name).ok_or(error::NOT_REGISTERED)?;
+    let region = regions().get_mut(&id).ok_or(error::NOT_REGISTERED)?;
+
+    if !region.may_attach(pmap, read_only) {
+        return Err(error::ACCESS_DENIED);
+    }
+
+    let flags = AddrSpace::SHARED | AddrSpace::NO_EXECUTE
+        | if read_only { AddrSpace::READ_ONLY } else { 0 };
+
+    let start = addr_space.map(addr, &DeviceId::new_from_tuple((device::shared::MAJOR, id)), 0,
+                               flags, region.length)
+        .ok_or(error::INVALID_ADDRESS)?;
+
+    region.attachments.push((pmap, start as usize));
+    Ok((start, region.length))
+}
+
+/// Unmaps the region that's attached at `addr`. The frames are released once the region
+/// has been deleted and no address space has it attached.
+
+pub fn detach(addr_space: &mut AddrSpace, addr: VAddr) -> Result<(), Error> {
+    let pmap = addr_space.root_pmap();
+    let start = addr as usize;
+
+    let (id, length) = regions().iter_mut()
+        .find_map(|(&id, region)| {
+            let index = region.attachments.iter().position(|&a| a == (pmap, start))?;
+
+            region.attachments.swap_remove(index);
+            Some((id, region.length))
+        })
+        .ok_or(error::INVALID_ADDRESS)?;
+
+    unmap_pages(addr_space, start, length);
+    addr_space.unmap(addr, length);
+
+    if regions().get(&id).map_or(false, SharedRegion::is_unused) {
+        destroy(id);
+    }
+
+    Ok(())
+}
+
+/// Removes the name of a region, so that it can no longer be attached. Only the owner may
+/// delete a region.
+
+pub fn delete(owner: PAddr, name: &str) -> Result<(), Error> {
+    let id = *region_names().get(name).ok_or(error::NOT_REGISTERED)?;
+    let region = regions().get_mut(&id).ok_or(error::NOT_REGISTERED)?;
+
+    if region.owner != owner {
+        return Err(error::ACCESS_DENIED);
+    }
+
+    region.name = None;
+    region_names().remove(name);
+
+    if region.is_unused() {
+        destroy(id);
+    }
+
+    Ok(())
+}
+
+/// Returns the number of shared memory regions along with the number of frames that have
+/// been allocated for them.
+
+pub fn stats() -> (usize, usize) {
+    let frames = regions()
+        .values()
+        .map(|region| region.frames.iter().filter(|frame| frame.is_some()).count())
+        .sum();
+
+    (regions().len(), frames)
+}
+
+/// Records the attachments of a cloned address space, which inherits every region that
+/// its parent had attached.
+
+pub fn clone_attachments(parent_pmap: PAddr, child_pmap: PAddr) {
+    for region in regions().values_mut() {
+        let inherited = region.attachments.iter()
+            .filter(|(pmap, _)| *pmap == parent_pmap)
+            .map(|&(_, start)| (child_pmap, start))
+            .collect::<Vec<(PAddr, usize)>>();
+
+        region.attachments.extend(inherited);
+    }
+}
+
+/// Returns the frame that backs a page of a region, allocating it on first use, and adds a
+/// reference to it for the new mapping.
+
+pub fn read_page(vpage: &VirtualPage) -> Result<PhysicalPage, Error> {
+    let region = regions().get_mut(&vpage.device.minor)
+        .ok_or(error::DEVICE_NOT_EXIST)?;
+
+    let frame = region.frames.get_mut((vpage.offset / PAGE_SIZE as u64) as usize)
+        .ok_or(error::END_OF_FILE)?;
+
+    let frame = match frame {
+        Some(frame) => *frame,
+        None => {
+            let (new_frame, _) = phys_alloc::zero_pool::alloc_zeroed(BlockSize::Block4k)
+                .map_err(|_| error::OUT_OF_MEMORY)?;
+
+            *frame = Some(new_frame);
+            new_frame
+        }
+    };
+
+    phys_alloc::share_frame(frame);
+    Ok(PhysicalPage::new(frame))
+}
+
+/// Unmaps the resident pages of a region from an address space and drops their references
+
+fn unmap_pages(addr_space: &mut AddrSpace, start: usize, length: usize) {
+    let end = start + length;
+    let mut next_page = start.align_trunc(PAGE_SIZE);
+
+    while let Some((page, frame)) = addr_space.next_resident(next_page).filter(|&(page, _)| page < end) {
+        next_page = page + PAGE_SIZE;
+
+        let _ = unsafe {
+            syscall::unmap(Some(addr_space.root_pmap()), page as *const c_void, 1, None)
+        };
+
+        addr_space.remove_resident(page);
+        phys_alloc::unshare_frame(frame);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::SharedRegion;
+    use crate::message::init::CreateShmRequest;
+    use alloc::vec::Vec;
+
+    fn region(access: u32) -> SharedRegion {
+        SharedRegion {
+            name: None,
+            owner: 0x1000,
+            length: 0x1000,
+            access,
+            frames: vec![None],
+            attachments: Vec::new(),
+        }
+    }
+
+    #[test]
+    fn test_may_attach() {
+        let private = region(0);
+        let readable = region(CreateShmRequest::OTHERS_READ);
+        let writable = region(CreateShmRequest::OTHERS_WRITE);
+
+        assert!(private.may_attach(0x1000, false));
+        assert!(!private.may_attach(0x2000, true));
+        assert!(readable.may_attach(0x2000, true));
+        assert!(!readable.may_attach(0x2000, false));
+        assert!(writable.may_attach(0x2000, true));
+        assert!(writable.may_attach(0x2000, false));
+    }
+}
@@ -0,0 +1,427 @@
+//! The init server's global allocator.
+//!
+//! Small objects are allocated from size classes. Each class keeps a free list of objects
+//! that are carved out of 4 kB pages, and the pages come from chunks that are taken from
+//! the C heap. Chunks double in size up to a large page, so a busy init server's objects
+//! end up in memory that sbrk has mapped with large pages. Pages are never handed back
+//! to the C heap.
+//!
+//! Anything that doesn't fit in a class goes to `malloc()` (or `memalign()` when the
+//! alignment is larger than what `malloc()` guarantees).
+
+use crate::page::VirtualPage;
+use crate::syscall;
+use core::alloc::{GlobalAlloc, Layout};
+use core::ffi::c_void;
+use core::{cmp, mem, ptr};
+
+#[link(name="c", kind="static")]
+extern "C" {
+    fn malloc(length: usize) -> *mut c_void;
+    fn calloc(num_blocks: usize, block_size: usize) -> *mut c_void;
+    fn memalign(alignment: usize, length: usize) -> *mut c_void;
+    fn free(buffer: *mut c_void);
+    fn realloc(buffer: *mut c_void, new_length: usize) -> *mut c_void;
+}
+
+#[link(name="os_init", kind="static")]
+extern "C" {
+    fn mutex_lock(lock: *mut i32) -> i32;
+    fn mutex_unlock(lock: *mut i32) -> i32;
+}
+
+const PAGE_SIZE: usize = VirtualPage::SMALL_PAGE_SIZE;
+
+/// The alignment of memory returned by `malloc()`
+const MALLOC_ALIGNMENT: usize = 2 * mem::size_of::<usize>();
+
+const CLASS_COUNT: usize = 14;
+
+/// Object sizes of each class. Most allocations are boxed message payloads and requests
+/// (16-64 bytes), error strings (32-128 bytes), `BTreeMap` nodes (roughly 100-400 bytes,
+/// depending on the key and value types) and small frame vectors.
+///
+/// An object is aligned to the largest power of two that divides its class size.
+const CLASS_SIZES: [usize; CLASS_COUNT] = [8, 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 2048];
+
+const MIN_CHUNK_SIZE: usize = 64 * 1024;
+const MAX_CHUNK_SIZE: usize = VirtualPage::LARGE_PAGE_SIZE;
+
+/// An unallocated object (or page). The link is stored in the object itself.
+struct FreeObject {
+    next: *mut FreeObject,
+}
+
+#[derive(Clone, Copy)]
+struct SizeClass {
+    lock: i32,
+    free: *mut FreeObject,
+    allocs: usize,
+    frees: usize,
+    pages: usize,
+}
+
+impl SizeClass {
+    const fn new() -> Self {
+        Self {
+            lock: 0,
+            free: ptr::null_mut(),
+            allocs: 0,
+            frees: 0,
+            pages: 0,
+        }
+    }
+
+    unsafe fn push(&mut self, object: *mut u8) {
+        let object = object as *mut FreeObject;
+
+        (*object).next = self.free;
+        self.free = object;
+    }
+
+    unsafe fn pop(&mut self) -> *mut u8 {
+        let object = self.free;
+
+        if !object.is_null() {
+            self.free = (*object).next;
+        }
+
+        object.cast()
+    }
+
+    /// Splits a page into objects of `size` bytes, which are put on the free list in
+    /// address order.
+
+    unsafe fn add_page(&mut self, page: *mut u8, size: usize) {
+        for i in (0..PAGE_SIZE / size).rev() {
+            self.push(page.add(i * size));
+        }
+
+        self.pages += 1;
+    }
+}
+
+struct PageSource {
+    lock: i32,
+    /// Pages that were left over when a chunk was replaced
+    free: *mut FreeObject,
+    /// The unused part of the current chunk
+    next: usize,
+    end: usize,
+    chunk_size: usize,
+    chunk_bytes: usize,
+}
+
+static mut CLASSES: [SizeClass; CLASS_COUNT] = [SizeClass::new(); CLASS_COUNT];
+
+static mut PAGES: PageSource = PageSource {
+    lock: 0,
+    free: ptr::null_mut(),
+    next: 0,
+    end: 0,
+    chunk_size: MIN_CHUNK_SIZE,
+    chunk_bytes: 0,
+};
+
+static mut LARGE_ALLOCS: usize = 0;
+static mut LARGE_FREES: usize = 0;
+
+/// Spins until `lock` is acquired, yielding to threads of the same priority in between.
+/// The scheduler never runs a lower priority thread while this one is ready, so the
+/// allocator must only be used by threads at the normal priority.
+
+fn lock(lock: &mut i32) {
+    unsafe {
+        while mutex_lock(lock) != 0 {
+            syscall::sys_sleep(0);
+        }
+    }
+}
+
+fn unlock(lock: &mut i32) {
+    unsafe {
+        while mutex_unlock(lock) != 0 {}
+    }
+}
+
+const fn class_alignment(size: usize) -> usize {
+    1 << size.trailing_zeros()
+}
+
+/// Returns the index of the smallest class that can hold an object with `layout`, if any.
+
+fn class_index(layout: &Layout) -> Option<usize> {
+    if layout.size() > CLASS_SIZES[CLASS_COUNT - 1] {
+        None
+    } else {
+        CLASS_SIZES
+            .iter()
+            .position(|&size| size >= layout.size() && class_alignment(size) >= layout.align())
+    }
+}
+
+impl PageSource {
+    unsafe fn take(&mut self) -> *mut u8 {
+        if !self.free.is_null() {
+            let page = self.free;
+            self.free = (*page).next;
+            page.cast()
+        } else if self.next < self.end {
+            let page = self.next;
+            self.next += PAGE_SIZE;
+            page as *mut u8
+        } else {
+            ptr::null_mut()
+        }
+    }
+
+    /// Makes `chunk` the current chunk. Whatever is left of the previous one (if another
+    /// thread added a chunk at the same time) is kept on the free page list.
+
+    unsafe fn add_chunk(&mut self, chunk: usize, size: usize) {
+        while self.next < self.end {
+            let page = self.next as *mut FreeObject;
+
+            (*page).next = self.free;
+            self.free = page;
+            self.next += PAGE_SIZE;
+        }
+
+        self.next = chunk;
+        self.end = chunk + size;
+        self.chunk_bytes += size;
+        self.chunk_size = cmp::min(size * 2, MAX_CHUNK_SIZE);
+    }
+}
+
+/// Returns a page for a size class. The page source's lock isn't held while a chunk is
+/// allocated, since extending the C heap may allocate memory itself.
+
+unsafe fn alloc_page() -> *mut u8 {
+    loop {
+        lock(&mut PAGES.lock);
+
+        let page = PAGES.take();
+        let chunk_size = PAGES.chunk_size;
+
+        unlock(&mut PAGES.lock);
+
+        if !page.is_null() {
+            return page;
+        }
+
+        let alignment = if chunk_size == MAX_CHUNK_SIZE { MAX_CHUNK_SIZE } else { PAGE_SIZE };
+        let chunk = memalign(alignment, chunk_size);
+
+        lock(&mut PAGES.lock);
+
+        if !chunk.is_null() {
+            PAGES.add_chunk(chunk as usize, chunk_size);
+        } else if chunk_size > MIN_CHUNK_SIZE {
+            // Large chunks may not be available when memory is tight
+            PAGES.chunk_size = MIN_CHUNK_SIZE;
+        } else {
+            unlock(&mut PAGES.lock);
+            return ptr::null_mut();
+        }
+
+        unlock(&mut PAGES.lock);
+    }
+}
+
+unsafe fn alloc_object(index: usize) -> *mut u8 {
+    let class = &mut CLASSES[index];
+
+    lock(&mut class.lock);
+
+    if class.free.is_null() {
+        unlock(&mut class.lock);
+
+        let page = alloc_page();
+
+        if page.is_null() {
+            return ptr::null_mut();
+        }
+
+        lock(&mut class.lock);
+        class.add_page(page, CLASS_SIZES[index]);
+    }
+
+    let object = class.pop();
+    class.allocs += 1;
+
+    unlock(&mut class.lock);
+    object
+}
+
+unsafe fn release_object(index: usize, object: *mut u8) {
+    let class = &mut CLASSES[index];
+
+    lock(&mut class.lock);
+
+    class.push(object);
+    class.frees += 1;
+
+    unlock(&mut class.lock);
+}
+
+unsafe fn alloc_large(layout: &Layout) -> *mut u8 {
+    let ptr = if layout.align() <= MALLOC_ALIGNMENT {
+        malloc(layout.size())
+    } else {
+        memalign(layout.align(), layout.size())
+    };
+
+    if !ptr.is_null() {
+        LARGE_ALLOCS += 1;
+    }
+
+    ptr.cast()
+}
+
+unsafe fn release_large(ptr: *mut u8) {
+    LARGE_FREES += 1;
+    free(ptr.cast());
+}
+
+#[derive(Clone, Copy, Default)]
+pub struct ClassStats {
+    pub size: usize,
+    pub allocs: usize,
+    pub frees: usize,
+    pub pages: usize,
+}
+
+pub struct SlabStats {
+    pub classes: [ClassStats; CLASS_COUNT],
+    /// Bytes taken from the C heap for size classes
+    pub chunk_bytes: usize,
+    /// Allocations that were passed on to the C heap
+    pub large_allocs: usize,
+    pub large_frees: usize,
+}
+
+impl SlabStats {
+    /// Returns the number of bytes in objects that are currently allocated from size classes.
+
+    pub fn bytes_in_use(&self) -> usize {
+        self.classes
+            .iter()
+            .map(|class| (class.allocs - class.frees) * class.size)
+            .sum()
+    }
+}
+
+/// Returns the allocation counters. They're read without locking, so they may be
+/// slightly out of date.
+
+pub fn stats() -> SlabStats {
+    let mut classes = [ClassStats::default(); CLASS_COUNT];
+
+    for (index, stats) in classes.iter_mut().enumerate() {
+        let class = unsafe { &CLASSES[index] };
+
+        *stats = ClassStats {
+            size: CLASS_SIZES[index],
+            allocs: class.allocs,
+            frees: class.frees,
+            pages: class.pages,
+        };
+    }
+
+    unsafe {
+        SlabStats {
+            classes,
+            chunk_bytes: PAGES.chunk_bytes,
+            large_allocs: LARGE_ALLOCS,
+            large_frees: LARGE_FREES,
+        }
+    }
+}
+
+pub struct SlabAllocator;
+
+unsafe impl GlobalAlloc for SlabAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        match class_index(&layout) {
+            Some(index) => alloc_object(index),
+            None => alloc_large(&layout),
+        }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        match class_index(&layout) {
+            Some(index) => release_object(index, ptr),
+            None => release_large(ptr),
+        }
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        match class_index(&layout) {
+            None if layout.align() <= MALLOC_ALIGNMENT => {
+                let ptr = calloc(1, layout.size());
+
+                if !ptr.is_null() {
+                    LARGE_ALLOCS += 1;
+                }
+
+                ptr.cast()
+            },
+            _ => {
+                let ptr = self.alloc(layout);
+
+                if !ptr.is_null() {
+                    ptr::write_bytes(ptr, 0, layout.size());
+                }
+
+                ptr
+            }
+        }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+
+        match (class_index(&layout), class_index(&new_layout)) {
+            (Some(old_index), Some(new_index)) if old_index == new_index => ptr,
+            (None, None) if layout.align() <= MALLOC_ALIGNMENT => realloc(ptr.cast(), new_size).cast(),
+            _ => {
+                let new_ptr = self.alloc(new_layout);
+
+                if !new_ptr.is_null() {
+                    ptr::copy_nonoverlapping(ptr, new_ptr, cmp::min(layout.size(), new_size));
+                    self.dealloc(ptr, layout);
+                }
+
+                new_ptr
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::{class_alignment, class_index, CLASS_SIZES};
+    use core::alloc::Layout;
+
+    #[test]
+    fn test_class_index() {
+        let index = |size, align| class_index(&Layout::from_size_align(size, align).unwrap())
+            .map(|index| CLASS_SIZES[index]);
+
+        assert_eq!(index(1, 1), Some(8));
+        assert_eq!(index(24, 8), Some(32));
+        assert_eq!(index(40, 8), Some(48));
+        assert_eq!(index(40, 32), Some(64));
+        assert_eq!(index(300, 4), Some(384));
+        assert_eq!(index(300, 256), Some(512));
+        assert_eq!(index(2048, 8), Some(2048));
+        assert_eq!(index(2049, 8), None);
+        assert_eq!(index(64, 4096), None);
+
+        for size in CLASS_SIZES.iter() {
+            assert_eq!(class_alignment(*size) & (class_alignment(*size) - 1), 0);
+            assert_eq!(*size % class_alignment(*size), 0);
+        }
+    }
+}
@@ -106,6 +106,17 @@ pub mod c_types {
             }
         }
     }
+
+    /// A page map entry as read or written by `sys_get_page_mappings()` and
+    /// `sys_set_page_mappings()`. If the `UNMAPPED` flag is set, then `frame` holds the
+    /// block number that's stored in the non-present entry instead of a page frame number.
+
+    #[repr(C)]
+    #[derive(Clone, Copy, Default)]
+    pub struct PageMapping {
+        pub frame: u32,
+        pub flags: u32,
+    }
 }
 
 pub struct ThreadStruct {
@@ -180,6 +191,7 @@ pub mod flags {
         pub const PM_ACCESSED: u32 = 0x20;
         pub const PM_DIRTY: u32 = 0x40;
         pub const PM_LARGE_PAGE: u32 = 0x80;
+        pub const NO_EXECUTE: u32 = 0x100;  // ignored unless the kernel uses PAE
         pub const OVERWRITE: u32 = 0x20000000;  // if set to 1, then sys_map() will not fail
                                                 // if an address maps to a previous entry that's already
                                                 // marked as present.
@@ -212,6 +224,26 @@ pub mod flags {
         pub const LARGE_PAGE_FLAG_MASK: u64 = 0x1FFF;
     }
 
+    pub mod page_mapping {
+        pub const UNMAPPED: u32 = 0x01;
+        pub const READ_ONLY: u32 = 0x02;
+        pub const KERNEL: u32 = 0x04;
+        pub const UNCACHED: u32 = 0x08;
+        pub const WRITE_THROUGH: u32 = 0x10;
+        pub const WRITE_COMBINE: u32 = 0x20;
+        pub const DIRTY: u32 = 0x40;
+        pub const ACCESSED: u32 = 0x80;
+        pub const PAGE_SIZED: u32 = 0x100;
+        pub const STICKY: u32 = 0x200;
+        pub const NO_EXECUTE: u32 = 0x400;
+
+        /// Block numbers stored in non-present entries can't use the highest bit
+        pub const MAX_BLOCK_NUM: u32 = 0x7FFFFFFF;
+
+        pub const PTE_LEVEL: u32 = 0;
+        pub const PDE_LEVEL: u32 = 1;
+    }
+
     pub mod thread {
         pub const STATUS: u32 = 1;
         pub const PRIORITY: u32 = 2;
@@ -332,6 +364,40 @@ pub unsafe fn unmap(root_map: Option<PAddr>, vaddr: *const c_void, num_pages: i3
     }
 }
 
+/// Reads the page map entries of `mappings.len()` consecutive pages (or page tables, depending
+/// on `level`) starting at `vaddr`. Returns the number of entries that were read.
+
+pub fn get_page_mappings(level: u32, vaddr: usize, root_map: PAddr, mappings: &mut [c_types::PageMapping])
+                         -> Result<usize, Error> {
+    let result = unsafe {
+        sys_get_page_mappings(level, vaddr as c_types::CAddr, mappings.len(),
+                              root_map as c_types::CAddr, mappings.as_mut_ptr())
+    };
+
+    if result >= 0 {
+        Ok(result as usize)
+    } else {
+        Err(result)
+    }
+}
+
+/// Writes page map entries for consecutive pages (or page tables, depending on `level`)
+/// starting at `vaddr`. Returns the number of entries that were written.
+
+pub fn set_page_mappings(level: u32, vaddr: usize, root_map: PAddr, mappings: &[c_types::PageMapping])
+                         -> Result<usize, Error> {
+    let result = unsafe {
+        sys_set_page_mappings(level, vaddr as c_types::CAddr, mappings.len(),
+                              root_map as c_types::CAddr, mappings.as_ptr())
+    };
+
+    if result >= 0 {
+        Ok(result as usize)
+    } else {
+        Err(result)
+    }
+}
+
 pub fn read_thread(tid: &Tid, flags: u32) -> Result<ThreadStruct, Error> {
     let mut info = ThreadInfo::default();
 
@@ -384,4 +450,8 @@ extern "C" {
     pub fn sys_destroy_thread(tid: CTid) -> i32;
     pub fn sys_read_thread(tid: CTid, flags: u32, info: *mut ThreadInfo) -> i32;
     pub fn sys_update_thread(tid: CTid, flags: u32, info: *const ThreadInfo) -> i32;
+    pub fn sys_get_page_mappings(level: u32, vaddr: c_types::CAddr, count: usize,
+                                 addr_space: c_types::CAddr, mappings: *mut c_types::PageMapping) -> i32;
+    pub fn sys_set_page_mappings(level: u32, vaddr: c_types::CAddr, count: usize,
+                                 addr_space: c_types::CAddr, mappings: *const c_types::PageMapping) -> i32;
 }
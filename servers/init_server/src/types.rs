@@ -6,9 +6,94 @@ pub mod bit_array {
 
     type Word = u32;
 
+    /// Summary levels that let a search skip over runs of full or empty words. Bit `i` of
+    /// the first level of `any_set` is set if data word `i` has at least one set bit (for
+    /// `any_cleared`, a cleared bit). Bit `i` of each level after that is set if word `i` of
+    /// the previous level is non-zero. The last level is a single word.
+    struct Summary {
+        any_set: Vec<Vec<Word>>,
+        any_cleared: Vec<Vec<Word>>,
+    }
+
+    impl Summary {
+        fn new(word_count: usize) -> Self {
+            let mut levels = Vec::new();
+            let mut bits = word_count;
+
+            loop {
+                let words = BitArray::word_count(bits);
+
+                levels.push(vec![0; words]);
+
+                if words <= 1 {
+                    break;
+                }
+
+                bits = words;
+            }
+
+            Summary {
+                any_set: levels.clone(),
+                any_cleared: levels,
+            }
+        }
+
+        /// Sets or clears bit `index` of the first level and propagates the change upward
+        /// until a word's zero/non-zero state stays the same.
+
+        fn update(levels: &mut [Vec<Word>], index: usize, set_true: bool) {
+            let mut index = index;
+            let mut set_true = set_true;
+
+            for level in levels.iter_mut() {
+                let word = &mut level[index / Word::BITS as usize];
+                let was_set = *word != 0;
+
+                if set_true {
+                    *word |= 1 << (index % Word::BITS as usize);
+                } else {
+                    *word &= !(1 << (index % Word::BITS as usize));
+                }
+
+                if (*word != 0) == was_set {
+                    break;
+                }
+
+                set_true = *word != 0;
+                index /= Word::BITS as usize;
+            }
+        }
+
+        /// Returns the index of the first set bit in `levels[level]` at or after `start`.
+
+        fn find(levels: &[Vec<Word>], level: usize, start: usize) -> Option<usize> {
+            let words = &levels[level];
+            let word_index = start / Word::BITS as usize;
+
+            if word_index >= words.len() {
+                return None;
+            }
+
+            let masked = words[word_index] & (Word::MAX << (start % Word::BITS as usize));
+
+            if masked != 0 {
+                return Some(word_index * Word::BITS as usize + masked.trailing_zeros() as usize);
+            }
+
+            let next = if level + 1 < levels.len() {
+                Self::find(levels, level + 1, word_index + 1)?
+            } else {
+                (word_index + 1..words.len()).find(|&i| words[i] != 0)?
+            };
+
+            Some(next * Word::BITS as usize + words[next].trailing_zeros() as usize)
+        }
+    }
+
     pub struct BitArray {
-        pub data: Vec<Word>,
+        data: Vec<Word>,
         num_bits: usize,
+        summary: Option<Summary>,
     }
 
     pub enum BitFilter {
@@ -51,40 +136,21 @@ pub mod bit_array {
 
                         Some(bit)
                     },
-                    BitFilter::One => {
-                        while self.bit_array.bit_count() - self.index >= Word::BITS as usize
-                            && self.bit_array.is_word_cleared(self.index) {
-                            self.index += Word::BITS as usize - self.index % Word::BITS as usize;
-                        }
-
-                        while self.index < self.bit_array.bit_count() && self.bit_array.is_cleared(self.index) {
-                            self.index += 1;
-                        }
-
-                        if self.index >= self.bit_array.bit_count() {
-                            None
-                        } else {
-                            let option = Some(self.index);
-                            self.index += 1;
-                            option
-                        }
-                    },
-                    BitFilter::Zero => {
-                        while self.bit_array.bit_count() - self.index >= Word::BITS as usize
-                            && self.bit_array.is_word_set(self.index) {
-                            self.index += Word::BITS as usize - self.index % Word::BITS as usize;
-                        }
-
-                        while self.index < self.bit_array.bit_count() && self.bit_array.is_set(self.index) {
-                            self.index += 1;
-                        }
-
-                        if self.index >= self.bit_array.bit_count() {
-                            None
-                        } else {
-                            let option = Some(self.index);
-                            self.index += 1;
-                            option
+                    BitFilter::One | BitFilter::Zero => {
+                        let found = match self.bit_filter {
+                            BitFilter::One => self.bit_array.next_set(self.index),
+                            _ => self.bit_array.next_cleared(self.index),
+                        };
+
+                        match found {
+                            Some(bit) => {
+                                self.index = bit + 1;
+                                Some(bit)
+                            },
+                            None => {
+                                self.index = self.bit_array.bit_count();
+                                None
+                            }
                         }
                     }
                 }
@@ -116,9 +182,102 @@ pub mod bit_array {
             Self {
                 data: vec![init_val; Self::word_count(num_bits)],
                 num_bits,
+                summary: None,
             }
         }
 
+        /// Creates a bit array that keeps summary levels, so that finding the next set or
+        /// cleared bit takes O(log n) word reads instead of a scan over every word. Each
+        /// update costs up to O(log n) more, so this is meant for large arrays that are
+        /// searched often.
+
+        pub fn with_summary(num_bits: usize, default: bool) -> Self {
+            let mut bit_array = Self::new(num_bits, default);
+            bit_array.summary = Some(Summary::new(bit_array.data.len()));
+
+            for word_index in 0..bit_array.data.len() {
+                bit_array.update_summary(word_index);
+            }
+
+            bit_array
+        }
+
+        /// Returns the mask of the bits of a word that lie within the array.
+
+        fn valid_bits(&self, word_index: usize) -> Word {
+            let remainder = self.num_bits % Word::BITS as usize;
+
+            if word_index + 1 == self.data.len() && remainder != 0 {
+                (1 << remainder) - 1
+            } else {
+                Word::MAX
+            }
+        }
+
+        /// Returns a data word with its set bits (or, if `set_true` is false, its cleared
+        /// bits) as ones.
+
+        fn word_bits(&self, word_index: usize, set_true: bool) -> Word {
+            let word = if set_true {
+                self.data[word_index]
+            } else {
+                !self.data[word_index]
+            };
+
+            word & self.valid_bits(word_index)
+        }
+
+        fn update_summary(&mut self, word_index: usize) {
+            let any_set = self.word_bits(word_index, true) != 0;
+            let any_cleared = self.word_bits(word_index, false) != 0;
+
+            if let Some(summary) = self.summary.as_mut() {
+                Summary::update(&mut summary.any_set, word_index, any_set);
+                Summary::update(&mut summary.any_cleared, word_index, any_cleared);
+            }
+        }
+
+        fn find_from(&self, start: usize, set_true: bool) -> Option<usize> {
+            if start >= self.num_bits {
+                return None;
+            }
+
+            let word_index = start / Word::BITS as usize;
+            let masked = self.word_bits(word_index, set_true) & (Word::MAX << (start % Word::BITS as usize));
+
+            if masked != 0 {
+                return Some(word_index * Word::BITS as usize + masked.trailing_zeros() as usize);
+            }
+
+            let next = match &self.summary {
+                Some(summary) => {
+                    let levels = if set_true {
+                        &summary.any_set
+                    } else {
+                        &summary.any_cleared
+                    };
+
+                    Summary::find(levels, 0, word_index + 1)?
+                },
+                None => (word_index + 1..self.data.len())
+                    .find(|&i| self.word_bits(i, set_true) != 0)?,
+            };
+
+            Some(next * Word::BITS as usize + self.word_bits(next, set_true).trailing_zeros() as usize)
+        }
+
+        /// Returns the index of the first set bit at or after `start`.
+
+        pub fn next_set(&self, start: usize) -> Option<usize> {
+            self.find_from(start, true)
+        }
+
+        /// Returns the index of the first cleared bit at or after `start`.
+
+        pub fn next_cleared(&self, start: usize) -> Option<usize> {
+            self.find_from(start, false)
+        }
+
         pub fn set(&mut self, n: usize) {
             self.set_to(n, true);
         }
@@ -146,6 +305,8 @@ pub mod bit_array {
                 } else {
                     self.data[n / Word::BITS as usize] &= !(1 << (n % Word::BITS as usize));
                 }
+
+                self.update_summary(n / Word::BITS as usize);
             }
         }
 
@@ -160,9 +321,10 @@ pub mod bit_array {
             (start_bit..word_start_bit)
                 .for_each(|b| self.set_to(b, set_true));
 
-            (word_start_bit..word_end_bit)
-                .step_by(Word::BITS as usize)
-                .for_each(|b| self.data[b / Word::BITS as usize] = if set_true { Word::MAX } else { 0 });
+            for b in (word_start_bit..word_end_bit).step_by(Word::BITS as usize) {
+                self.data[b / Word::BITS as usize] = if set_true { Word::MAX } else { 0 };
+                self.update_summary(b / Word::BITS as usize);
+            }
 
             (word_end_bit..end_bit)
                 .for_each(|b| self.set_to(b, set_true));
@@ -193,31 +355,11 @@ pub mod bit_array {
         }
 
         pub fn first_set(&self) -> Option<usize> {
-            let mut index = 0;
-
-            for word in &self.data {
-                if word != &0 {
-                    return Some(index + word.trailing_zeros() as usize)
-                } else {
-                    index += Word::BITS as usize;
-                }
-            }
-
-            None
+            self.next_set(0)
         }
 
         pub fn first_cleared(&self) -> Option<usize> {
-            let mut index = 0;
-
-            for word in &self.data {
-                if word != &Word::MAX {
-                    return Some(index + word.trailing_ones() as usize)
-                } else {
-                    index += Word::BITS as usize;
-                }
-            }
-
-            None
+            self.next_cleared(0)
         }
 
         pub fn count_zeros(&self) -> usize {
@@ -431,4 +573,31 @@ mod test {
         assert_eq!(barray2.count_ones(), 53);
         assert_eq!(barray2.count_zeros(), 12);
     }
+
+    #[test]
+    fn test_bitmap_summary_search() {
+        let bit_count = 1 << 20;
+        let mut barray: BitArray = BitArray::with_summary(bit_count, true);
+
+        assert!(barray.first_cleared().is_none());
+
+        barray.clear(70000);
+        barray.clear(bit_count - 1);
+
+        assert_eq!(barray.next_cleared(0), Some(70000));
+        assert_eq!(barray.next_cleared(70001), Some(bit_count - 1));
+
+        barray.clear_bits(1000, 5000);
+        barray.set(1000);
+
+        assert_eq!(barray.first_cleared(), Some(1001));
+        assert_eq!(barray.next_cleared(5000), Some(70000));
+        assert_eq!(barray.next_set(1001), Some(5000));
+
+        barray.set_bits(0, bit_count);
+
+        assert!(barray.first_cleared().is_none());
+        assert_eq!(barray.zeros().count(), 0);
+        assert_eq!(barray.ones().count(), bit_count);
+    }
 }
\ No newline at end of file